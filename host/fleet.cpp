@@ -0,0 +1,176 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "fleet.h"
+
+namespace tinydfu
+{
+
+namespace
+{
+
+/* What the workers of one run share, all under lock */
+struct Rollout
+{
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<size_t> queue;              /* targets still to go, in order */
+  std::map<std::string, unsigned> busy;  /* uploads per route */
+  unsigned running = 0;
+  std::vector<Report> reports;
+};
+
+} // namespace
+
+const char *state_name(State state)
+{
+  switch (state)
+  {
+    case State::waiting: return "waiting";
+    case State::running: return "running";
+    case State::done:    return "done";
+    case State::failed:  return "failed";
+  }
+  return "?";
+}
+
+Fleet::Fleet(const Image &image, FleetOptions options)
+  : image_(image), options_(std::move(options)), streams_(image)
+{
+}
+
+std::vector<Report> Fleet::run(const std::vector<Target> &targets)
+{
+  Rollout rollout;
+  unsigned attempts = std::max(options_.attempts, 1u);
+
+  rollout.reports.resize(targets.size());
+  for (size_t i = 0; i < targets.size(); i++)
+  {
+    rollout.queue.push_back(i);
+  }
+
+  auto tell = [&](size_t index)
+  {
+    if (options_.progress)
+    {
+      options_.progress(index, rollout.reports[index]);
+    }
+  };
+
+  /* the first one in line whose route has room */
+  auto take = [&](size_t &index)
+  {
+    for (auto it = rollout.queue.begin(); it != rollout.queue.end(); ++it)
+    {
+      const std::string &route = targets[*it].route;
+
+      if (route.empty() || !options_.per_route || rollout.busy[route] < options_.per_route)
+      {
+        index = *it;
+        rollout.queue.erase(it);
+        return true;
+      }
+    }
+    return false;
+  };
+
+  auto work = [&]
+  {
+    std::unique_lock<std::mutex> hold(rollout.lock);
+
+    for (;;)
+    {
+      size_t index;
+
+      while (!take(index))
+      {
+        /* nothing that could still come back to the queue */
+        if (rollout.queue.empty() && !rollout.running)
+        {
+          return;
+        }
+        rollout.changed.wait(hold);
+      }
+
+      const Target &target = targets[index];
+      Report &report = rollout.reports[index];
+
+      rollout.running++;
+      rollout.busy[target.route]++;
+      report.state = State::running;
+      report.progress = Progress{ Phase::hash, 0, 0 };
+      report.attempts++;
+      tell(index);
+      hold.unlock();
+
+      std::string error;
+      Result result;
+      try
+      {
+        UploadOptions upload = options_.upload;
+        upload.streams = &streams_;
+        upload.progress = [&](const Progress &progress)
+        {
+          std::lock_guard<std::mutex> told(rollout.lock);
+          report.progress = progress;
+          tell(index);
+        };
+
+        std::unique_ptr<Transport> transport = target.connect();
+        Uploader uploader(*transport, upload);
+        result = uploader.upload(image_);
+      }
+      catch (const std::exception &e)
+      {
+        error = e.what();
+      }
+
+      hold.lock();
+      rollout.running--;
+      rollout.busy[target.route]--;
+
+      if (error.empty())
+      {
+        report.state = State::done;
+        report.result = result;
+      }
+      else
+      {
+        report.error = error;
+        report.state = report.attempts < attempts ? State::waiting : State::failed;
+        if (report.state == State::waiting)
+        {
+          rollout.queue.push_back(index);
+        }
+      }
+      tell(index);
+      rollout.changed.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  size_t jobs = std::min<size_t>(std::max(options_.jobs, 1u), targets.size());
+
+  for (size_t i = 0; i < jobs; i++)
+  {
+    workers.emplace_back(work);
+  }
+  for (std::thread &worker : workers)
+  {
+    worker.join();
+  }
+  return rollout.reports;
+}
+
+} // namespace tinydfu
@@ -0,0 +1,85 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#ifndef _tinydfu_fleet_h
+#define _tinydfu_fleet_h
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "uploader.h"
+
+namespace tinydfu
+{
+
+/* One device of a rollout and the way to it */
+struct Target
+{
+  std::string name;   /* for reports */
+  std::string route;  /* adapter or bridge it is reached through, "" for its own */
+  std::function<std::unique_ptr<Transport>()> connect;
+};
+
+enum class State
+{
+  waiting,
+  running,
+  done,
+  failed,
+};
+
+const char *state_name(State state);
+
+/* Where a device is at, and how it ended */
+struct Report
+{
+  State state = State::waiting;
+  Progress progress{ Phase::hash, 0, 0 };
+  unsigned attempts = 0;
+  std::string error;  /* of the last attempt that failed */
+  Result result;      /* of the one that worked */
+};
+
+struct FleetOptions
+{
+  unsigned jobs = 8;          /* uploads at once */
+  unsigned per_route = 0;     /* uploads at once through one route, 0 for no limit */
+  unsigned attempts = 2;      /* per device */
+  UploadOptions upload;       /* progress and streams are the fleet's */
+  /* every change of a device's report, one call at a time, from the workers */
+  std::function<void(size_t index, const Report &report)> progress;
+};
+
+/*
+ * Many devices, one image
+ *
+ * run() uploads to every target on a pool of jobs threads. A target is
+ * taken once its route has room, so an adapter that holds only so many
+ * connections is never asked for more. A failed upload goes to the back
+ * of the queue for another attempt, which skips the pages that made it.
+ * One failure never stops the others; the reports say how each device
+ * ended. All uploads read the same Image and share one StreamCache.
+ */
+class Fleet
+{
+public:
+  Fleet(const Image &image, FleetOptions options = {});
+
+  std::vector<Report> run(const std::vector<Target> &targets);
+
+  StreamCache &streams() { return streams_; }
+
+private:
+  const Image &image_;
+  FleetOptions options_;
+  StreamCache streams_;
+};
+
+} // namespace tinydfu
+
+#endif
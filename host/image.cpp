@@ -0,0 +1,219 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include "image.h"
+
+extern "C"
+{
+#include "crc32.h"
+}
+
+namespace tinydfu
+{
+
+/* Bytes land at absolute addresses, which have to be in the region */
+void Image::put(uint32_t addr, const uint8_t *data, size_t len)
+{
+  if (!len)
+  {
+    return;
+  }
+
+  if (addr < kAppStart || addr + len > kAppEnd || addr + len < addr)
+  {
+    char what[64];
+    snprintf(what, sizeof(what), "data at 0x%08x is outside the application region", addr);
+    throw Error(what);
+  }
+
+  uint32_t end = addr + len - kAppStart;
+  uint32_t padded = (end + kPageSize - 1) / kPageSize * kPageSize;
+
+  if (bytes_.size() < padded)
+  {
+    bytes_.resize(padded, 0xFF);
+  }
+  std::copy(data, data + len, bytes_.begin() + (addr - kAppStart));
+  length_ = std::max(length_, end);
+}
+
+static uint8_t hex_byte(const std::string &line, size_t at, unsigned number)
+{
+  auto digit = [&](char c) -> int
+  {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    throw Error("line " + std::to_string(number) + ": not a hex digit");
+  };
+
+  if (at + 2 > line.size())
+  {
+    throw Error("line " + std::to_string(number) + ": record too short");
+  }
+  return digit(line[at]) << 4 | digit(line[at + 1]);
+}
+
+/*
+ * Records 00 (data), 01 (end), 02 and 04 (segment and linear base), 03 and
+ * 05 (start address, of no use here)
+ */
+Image Image::from_hex(std::istream &in)
+{
+  Image image;
+  std::string line;
+  uint32_t base = 0;
+  unsigned number = 0;
+  bool ended = false;
+
+  while (!ended && std::getline(in, line))
+  {
+    number++;
+    while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+    {
+      line.pop_back();
+    }
+    if (line.empty())
+    {
+      continue;
+    }
+    if (line[0] != ':')
+    {
+      throw Error("line " + std::to_string(number) + ": no record");
+    }
+
+    std::vector<uint8_t> record;
+    for (size_t at = 1; at < line.size(); at += 2)
+    {
+      record.push_back(hex_byte(line, at, number));
+    }
+
+    if (record.size() < 5 || record.size() != 5u + record[0])
+    {
+      throw Error("line " + std::to_string(number) + ": bad record length");
+    }
+
+    uint8_t sum = 0;
+    for (uint8_t byte : record)
+    {
+      sum += byte;
+    }
+    if (sum)
+    {
+      throw Error("line " + std::to_string(number) + ": bad checksum");
+    }
+
+    uint8_t len = record[0];
+    uint16_t offset = record[1] << 8 | record[2];
+    const uint8_t *data = &record[4];
+
+    if ((record[3] == 0x02 || record[3] == 0x04) && len != 2)
+    {
+      throw Error("line " + std::to_string(number) + ": bad address record");
+    }
+
+    switch (record[3])
+    {
+      case 0x00:
+        image.put(base + offset, data, len);
+        break;
+      case 0x01:
+        ended = true;
+        break;
+      case 0x02:
+        base = (data[0] << 8 | data[1]) << 4;
+        break;
+      case 0x04:
+        base = (uint32_t)(data[0] << 8 | data[1]) << 16;
+        break;
+      case 0x03:
+      case 0x05:
+        break;
+      default:
+        throw Error("line " + std::to_string(number) + ": unknown record type");
+    }
+  }
+
+  if (!ended)
+  {
+    throw Error("no end of file record");
+  }
+  if (!image.length_)
+  {
+    throw Error("no data");
+  }
+  return image;
+}
+
+Image Image::from_bin(const std::vector<uint8_t> &data, uint32_t base)
+{
+  Image image;
+
+  if (data.empty())
+  {
+    throw Error("no data");
+  }
+  image.put(base, data.data(), data.size());
+  return image;
+}
+
+Image Image::load(const std::string &path, uint32_t base)
+{
+  std::ifstream in(path, std::ios::binary);
+
+  if (!in)
+  {
+    throw Error(path + ": cannot open");
+  }
+
+  std::string ext = path.substr(path.find_last_of('.') == std::string::npos ? path.size() :
+      path.find_last_of('.'));
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+  try
+  {
+    if (ext == ".hex" || ext == ".ihex")
+    {
+      return from_hex(in);
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return from_bin(data, base);
+  }
+  catch (const Error &e)
+  {
+    throw Error(path + ": " + e.what());
+  }
+}
+
+bool Image::blank(uint8_t index) const
+{
+  const uint8_t *p = page(index);
+  return std::all_of(p, p + kPageSize, [](uint8_t b) { return b == 0xFF; });
+}
+
+bool Image::chunk_blank(uint8_t index, uint8_t chunk) const
+{
+  const uint8_t *p = page(index) + chunk * kChunkSize;
+  return std::all_of(p, p + kChunkSize, [](uint8_t b) { return b == 0xFF; });
+}
+
+uint32_t Image::crc() const
+{
+  return crc32(0, bytes_.data(), bytes_.size());
+}
+
+uint32_t Image::page_crc(uint8_t index) const
+{
+  return crc32(0, page(index), kPageSize);
+}
+
+} // namespace tinydfu
@@ -0,0 +1,71 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#ifndef _tinydfu_image_h
+#define _tinydfu_image_h
+
+#include <cstdint>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace tinydfu
+{
+
+/* Anything that ends an upload: bad input, a dead transport, a refusal */
+class Error : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+/* The device's side of things, as in source/main.c */
+constexpr uint32_t kAppStart   = 0x00018000;
+constexpr uint32_t kAppEnd     = 0x0003C000;
+constexpr uint32_t kPageSize   = 1024;
+constexpr uint32_t kChunkSize  = 16;
+constexpr uint8_t  kChunks     = kPageSize / kChunkSize;
+constexpr uint8_t  kFirstPage  = kAppStart / kPageSize;
+constexpr uint8_t  kPageLimit  = kAppEnd / kPageSize; /* first page past the region */
+constexpr size_t   kPacketSize = 20;                  /* ATT payload of a default MTU */
+
+/*
+ * Application image
+ *
+ * What goes to the application region, from kAppStart up to the last byte
+ * the input had, with the gaps and the rest of the last page 0xFF. That is
+ * what the device's 'f' checksum covers too.
+ */
+class Image
+{
+public:
+  /* Intel HEX by extension (.hex, .ihex), raw binary at base otherwise */
+  static Image load(const std::string &path, uint32_t base = kAppStart);
+  static Image from_hex(std::istream &in);
+  static Image from_bin(const std::vector<uint8_t> &data, uint32_t base = kAppStart);
+
+  uint32_t length() const { return length_; }
+  uint8_t pages() const { return bytes_.size() / kPageSize; }
+  const std::vector<uint8_t> &bytes() const { return bytes_; }
+  const uint8_t *page(uint8_t index) const { return &bytes_[index * kPageSize]; }
+  bool blank(uint8_t index) const;
+  bool chunk_blank(uint8_t index, uint8_t chunk) const;
+
+  uint32_t crc() const;
+  uint32_t page_crc(uint8_t index) const;
+
+private:
+  void put(uint32_t addr, const uint8_t *data, size_t len);
+
+  std::vector<uint8_t> bytes_;
+  uint32_t length_ = 0;
+};
+
+} // namespace tinydfu
+
+#endif
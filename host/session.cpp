@@ -0,0 +1,243 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <algorithm>
+#include "session.h"
+
+namespace tinydfu
+{
+
+namespace
+{
+
+/* Refusals that only mean "not now" */
+bool busy(const std::string &text)
+{
+  return text == "! flash busy" || text == "! stage busy";
+}
+
+/* Failures of earlier, already answered work: nothing to retry */
+bool broken(const std::string &text)
+{
+  return text == "! erase failed" || text == "! write failed" || text == "! commit failed";
+}
+
+std::string describe(const Command &command)
+{
+  std::string what = "'";
+
+  what += static_cast<char>(command.bytes[0]);
+  what += "'";
+  for (size_t i = 1; i < command.bytes.size() && i < 3; i++)
+  {
+    what += (i == 1 ? " " : "/") + std::to_string(command.bytes[i]);
+  }
+  return what;
+}
+
+} // namespace
+
+Session::Session(Transport &transport, SessionOptions options)
+  : transport_(transport), options_(options), heard_(Clock::now())
+{
+  set_window(options.window);
+}
+
+void Session::fail(const std::string &what) const
+{
+  throw Error(transport_.name() + ": " + what);
+}
+
+void Session::send(Entry entry)
+{
+  const Command &command = entry.command;
+
+  if (flight_.empty())
+  {
+    heard_ = Clock::now(); /* the timeout runs from the first command out */
+  }
+
+  transport_.send(command.channel, command.bytes.data(), command.bytes.size());
+  stats_.packets++;
+  stats_.bytes += command.bytes.size();
+  timing_ = command.timing;
+
+  if (!command.key.empty())
+  {
+    flight_.push_back(std::move(entry));
+  }
+}
+
+/* Refused commands go again once the backoff is over and there is room */
+void Session::resend()
+{
+  while (!again_.empty() && flight_.size() < options_.window && Clock::now() >= hold_)
+  {
+    Entry entry = std::move(again_.front());
+    again_.pop_front();
+    stats_.retries++;
+    send(std::move(entry));
+  }
+}
+
+void Session::submit(Command command)
+{
+  if (command.timing != timing_ && in_flight())
+  {
+    drain();
+  }
+
+  while (in_flight() >= options_.window)
+  {
+    pump();
+  }
+
+  send(Entry{ std::move(command) });
+}
+
+void Session::post(Channel channel, const uint8_t *data, size_t len)
+{
+  transport_.send(channel, data, len);
+  stats_.packets++;
+  stats_.bytes += len;
+}
+
+void Session::drain()
+{
+  while (in_flight())
+  {
+    pump();
+  }
+}
+
+/* Until done() says so, on whatever the device sends unprompted */
+void Session::wait(const std::function<bool()> &done)
+{
+  heard_ = std::max(heard_, Clock::now());
+  while (!done())
+  {
+    pump();
+  }
+}
+
+/* Take one notification, or find out the device is gone */
+void Session::pump()
+{
+  resend();
+
+  auto now = Clock::now();
+  auto deadline = heard_ + options_.timeout;
+
+  if (!again_.empty() && flight_.size() < options_.window)
+  {
+    deadline = std::min(deadline, std::max(hold_, now));
+  }
+
+  Packet packet;
+  stats_.waits++;
+  if (transport_.receive(packet, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now)))
+  {
+    handle(packet);
+    return;
+  }
+
+  if (Clock::now() - heard_ >= options_.timeout)
+  {
+    fail(flight_.empty() ? "no answer" : "no answer to " + describe(flight_.front().command));
+  }
+}
+
+void Session::refused(Entry entry, const std::string &text)
+{
+  if (!busy(text))
+  {
+    fail(describe(entry.command) + ": " + text);
+  }
+
+  if (++entry.retries > options_.busy_retries)
+  {
+    fail(describe(entry.command) + ": still busy");
+  }
+  again_.push_back(std::move(entry));
+  hold_ = Clock::now() + options_.busy_backoff;
+}
+
+void Session::handle(const Packet &packet)
+{
+  stats_.answers++;
+  heard_ = Clock::now();
+
+  if (packet.data[0] == '!')
+  {
+    std::string text(reinterpret_cast<const char *>(packet.data), packet.len);
+
+    if (broken(text) || flight_.empty())
+    {
+      fail(text);
+    }
+
+    if (timing_ == Timing::immediate)
+    {
+      Entry entry = std::move(flight_.front());
+      flight_.pop_front();
+      refused(std::move(entry), text);
+      return;
+    }
+
+    /*
+     * Deferred: the refused one is among those in flight, and it is the
+     * one whose answer never comes. Once all that are left were refused,
+     * they go again.
+     */
+    if (!busy(text))
+    {
+      fail(text);
+    }
+    unclaimed_++;
+  }
+  else
+  {
+    auto match = std::find_if(flight_.begin(), flight_.end(), [&](const Entry &entry)
+    {
+      const std::vector<uint8_t> &key = entry.command.key;
+      return key.size() <= packet.len && std::equal(key.begin(), key.end(), packet.data);
+    });
+
+    if (match == flight_.end())
+    {
+      hold_ = heard_; /* commits and the like free up room on the device */
+      if (unsolicited)
+      {
+        unsolicited(packet);
+      }
+      return;
+    }
+
+    if (timing_ == Timing::deferred)
+    {
+      hold_ = heard_;
+    }
+    if (match->command.answered && !match->command.answered(packet))
+    {
+      return;
+    }
+    flight_.erase(match);
+  }
+
+  if (timing_ == Timing::deferred && unclaimed_ && unclaimed_ >= flight_.size())
+  {
+    for (Entry &entry : flight_)
+    {
+      refused(std::move(entry), "! flash busy");
+    }
+    flight_.clear();
+    unclaimed_ = 0;
+    hold_ = heard_;
+  }
+}
+
+} // namespace tinydfu
@@ -0,0 +1,120 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#ifndef _tinydfu_session_h
+#define _tinydfu_session_h
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+#include "transport.h"
+
+namespace tinydfu
+{
+
+/*
+ * When the device answers a command
+ *
+ * The device takes commands in order. Immediate ones ('w' when staged,
+ * 's', 'r', 'q', 'z' ...) are answered, or refused, right away, so the
+ * answers come back in the order the commands went out. Deferred ones ('w'
+ * when plain, 'd', 'f') are answered once the flash is done, but refused
+ * right away. A refusal ("! flash busy") says nothing about which command
+ * it was for, so the two kinds are never in flight together.
+ */
+enum class Timing
+{
+  immediate,
+  deferred,
+};
+
+struct Command
+{
+  Channel channel = Channel::control;
+  std::vector<uint8_t> bytes;
+  std::vector<uint8_t> key;       /* leading bytes of the answer */
+  Timing timing = Timing::immediate;
+  /* sees every answer, true once it was the last one (default: the first is) */
+  std::function<bool(const Packet &)> answered;
+};
+
+struct SessionOptions
+{
+  unsigned window = 8;                                      /* commands in flight */
+  std::chrono::milliseconds timeout{5000};                  /* device silent this long: gone */
+  std::chrono::milliseconds busy_backoff{5};                /* before sending refused ones again */
+  unsigned busy_retries = 1000;                             /* per command */
+};
+
+struct SessionStats
+{
+  uint32_t packets = 0;     /* sent, posts included */
+  uint32_t bytes = 0;
+  uint32_t answers = 0;     /* notifications received */
+  uint32_t retries = 0;     /* commands sent again after "busy" */
+  uint32_t waits = 0;       /* times there was nothing to do but wait */
+};
+
+/*
+ * Pipelined command engine
+ *
+ * Keeps up to window commands in flight, matches answers to them by key,
+ * sends refused ones again after a short backoff and hands everything it
+ * has no command for (commits, bitmaps, stream credit) to unsolicited.
+ * Commands answered more than once ('h', 'D') are best sent alone, with
+ * drain() on either side. Errors from the device end the session with an
+ * Error, as does silence for longer than the timeout.
+ */
+class Session
+{
+public:
+  explicit Session(Transport &transport, SessionOptions options = {});
+
+  void submit(Command command);
+  void post(Channel channel, const uint8_t *data, size_t len);
+  void drain();
+  void wait(const std::function<bool()> &done);
+
+  void set_window(unsigned window) { options_.window = window ? window : 1; }
+  size_t in_flight() const { return flight_.size() + again_.size(); }
+  const SessionStats &stats() const { return stats_; }
+  Transport &transport() { return transport_; }
+
+  std::function<void(const Packet &)> unsolicited;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Entry
+  {
+    Command command;
+    unsigned retries = 0;
+  };
+
+  void send(Entry entry);
+  void resend();
+  void pump();
+  void handle(const Packet &packet);
+  void refused(Entry entry, const std::string &text);
+  [[noreturn]] void fail(const std::string &what) const;
+
+  Transport &transport_;
+  SessionOptions options_;
+  SessionStats stats_;
+  Timing timing_ = Timing::immediate;
+  std::deque<Entry> flight_;       /* sent, oldest first */
+  std::deque<Entry> again_;        /* refused, to go again */
+  unsigned unclaimed_ = 0;         /* deferred refusals not pinned to a command yet */
+  Clock::time_point hold_ {};      /* no resends before then */
+  Clock::time_point heard_ {};     /* last sign of life */
+};
+
+} // namespace tinydfu
+
+#endif
@@ -0,0 +1,684 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "fleet.h"
+
+extern "C"
+{
+#include "crc32.h"
+}
+
+/*
+ * Tests of the uploader library
+ *
+ * Image parsing and the session engine on their own (against a scripted
+ * BleTransport), then whole uploads against nrf51_tinydfu_sim. Like
+ * sim/test_main.c, every test runs in a child of its own.
+ */
+
+using namespace tinydfu;
+
+#define CHECK(cond) \
+do \
+{ \
+  if (!(cond)) \
+  { \
+    fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+    exit(1); \
+  } \
+} while (0)
+
+/* expr has to throw an Error */
+#define CHECK_THROWS(expr) \
+do \
+{ \
+  bool thrown = false; \
+  try \
+  { \
+    expr; \
+  } \
+  catch (const Error &) \
+  { \
+    thrown = true; \
+  } \
+  CHECK(thrown && #expr); \
+} while (0)
+
+static const char *flash_path = nullptr;
+
+/* One Intel HEX record, checksum included */
+static std::string record(uint8_t type, uint16_t addr, const std::vector<uint8_t> &data)
+{
+  std::vector<uint8_t> raw = { (uint8_t)data.size(), (uint8_t)(addr >> 8), (uint8_t)addr, type };
+  raw.insert(raw.end(), data.begin(), data.end());
+
+  uint8_t sum = 0;
+  for (uint8_t b : raw)
+  {
+    sum += b;
+  }
+  raw.push_back(-sum);
+
+  std::string line = ":";
+  char hex[3];
+  for (uint8_t b : raw)
+  {
+    snprintf(hex, sizeof(hex), "%02X", b);
+    line += hex;
+  }
+  return line + "\n";
+}
+
+/* Something that looks like an application, pages of it */
+static std::vector<uint8_t> application(uint8_t pages, uint32_t seed)
+{
+  std::vector<uint8_t> data(pages * kPageSize);
+
+  for (size_t i = 0; i < data.size(); i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    data[i] = seed >> 16;
+  }
+  uint32_t vectors[2] = { 0x20004000, kAppStart + 0xC1 };
+  memcpy(data.data(), vectors, sizeof(vectors));
+  return data;
+}
+
+static std::vector<uint8_t> flash_contents(const std::string &path)
+{
+  std::ifstream in(path, std::ios::binary);
+  return std::vector<uint8_t>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+static bool flash_holds(const Image &image, const std::string &path = flash_path)
+{
+  std::vector<uint8_t> flash = flash_contents(path);
+
+  return flash.size() >= kAppStart + image.bytes().size() &&
+      std::equal(image.bytes().begin(), image.bytes().end(), flash.begin() + kAppStart);
+}
+
+/*
+ * nrf51_tinydfu_sim on the test's flash (or another), for as long as this
+ * is around. where() is what it listens on, socket path or pty.
+ */
+class Simulator
+{
+public:
+  explicit Simulator(const std::vector<std::string> &options, const std::string &flash = flash_path)
+  {
+    int out[2];
+    CHECK(pipe(out) == 0);
+
+    pid_ = fork();
+    CHECK(pid_ >= 0);
+    if (pid_ == 0)
+    {
+      std::vector<std::string> args = { "./nrf51_tinydfu_sim", "-x", "50", "-f", flash };
+      args.insert(args.end(), options.begin(), options.end());
+
+      std::vector<char *> argv;
+      for (std::string &arg : args)
+      {
+        argv.push_back(&arg[0]);
+      }
+      argv.push_back(nullptr);
+
+      prctl(PR_SET_PDEATHSIG, SIGTERM); /* also when a CHECK ends the test */
+      dup2(out[1], STDOUT_FILENO);
+      close(out[0]);
+      close(out[1]);
+      execv(argv[0], argv.data());
+      perror(argv[0]);
+      _exit(127);
+    }
+    close(out[1]);
+
+    /* the first line comes once it is ready */
+    char c;
+    while (read(out[0], &c, 1) == 1 && c != '\n')
+    {
+      where_ += c;
+    }
+    close(out[0]);
+    CHECK(!where_.empty());
+  }
+
+  ~Simulator()
+  {
+    kill(pid_, SIGTERM);
+    waitpid(pid_, nullptr, 0);
+  }
+
+  const std::string &where() const { return where_; }
+
+private:
+  pid_t pid_ = -1;
+  std::string where_;
+};
+
+static std::string socket_path(unsigned n = 0)
+{
+  return "/tmp/tinydfu_sock_" + std::to_string(getpid()) + "_" + std::to_string(n);
+}
+
+static void test_image_hex(void)
+{
+  std::vector<uint8_t> first = { 0x00, 0x40, 0x00, 0x20, 0xC1, 0x80, 0x01, 0x00 };
+  std::vector<uint8_t> second = { 0x11, 0x22 };
+  std::stringstream hex;
+
+  /* 0x10000 + 0x8000 is the application start */
+  hex << record(0x04, 0, { 0x00, 0x01 }) << record(0x00, 0x8000, first)
+      << record(0x00, 0x8010, second) << record(0x05, 0, { 0, 0, 0x80, 0xC1 })
+      << record(0x01, 0, {});
+
+  Image image = Image::from_hex(hex);
+  CHECK(image.length() == 0x12);
+  CHECK(image.pages() == 1);
+  CHECK(std::equal(first.begin(), first.end(), image.bytes().begin()));
+  CHECK(image.bytes()[0x08] == 0xFF); /* the gap */
+  CHECK(image.bytes()[0x10] == 0x11 && image.bytes()[0x11] == 0x22);
+  CHECK(image.bytes()[0x12] == 0xFF && image.bytes()[kPageSize - 1] == 0xFF);
+  CHECK(image.chunk_blank(0, 2) && !image.chunk_blank(0, 1));
+
+  std::string bad = record(0x00, 0x8000, first);
+  bad[bad.size() - 2] ^= 1;
+  std::stringstream checksum(record(0x04, 0, { 0x00, 0x01 }) + bad + record(0x01, 0, {}));
+  CHECK_THROWS(Image::from_hex(checksum));
+
+  /* below the application region */
+  std::stringstream low(record(0x00, 0x8000, first) + record(0x01, 0, {}));
+  CHECK_THROWS(Image::from_hex(low));
+
+  std::stringstream unended(record(0x04, 0, { 0x00, 0x01 }) + record(0x00, 0x8000, first));
+  CHECK_THROWS(Image::from_hex(unended));
+
+  std::stringstream junk("hello\n");
+  CHECK_THROWS(Image::from_hex(junk));
+
+  /* address records carry exactly two bytes */
+  std::stringstream empty_base(record(0x04, 0, {}) + record(0x00, 0x8000, first) + record(0x01, 0, {}));
+  CHECK_THROWS(Image::from_hex(empty_base));
+  std::stringstream long_segment(record(0x02, 0, { 0x10, 0x00, 0x00 }) + record(0x01, 0, {}));
+  CHECK_THROWS(Image::from_hex(long_segment));
+}
+
+static void test_image_bin(void)
+{
+  std::vector<uint8_t> data = application(2, 1);
+  data.resize(1500);
+
+  Image image = Image::from_bin(data);
+  CHECK(image.length() == 1500);
+  CHECK(image.pages() == 2);
+  CHECK(image.bytes()[1499] == data[1499] && image.bytes()[1500] == 0xFF);
+
+  /* what 'f' and 'h' compute on the device: whole pages */
+  CHECK(image.crc() == crc32(0, image.bytes().data(), 2 * kPageSize));
+  CHECK(image.page_crc(1) == crc32(0, image.bytes().data() + kPageSize, kPageSize));
+
+  Image later = Image::from_bin(data, kAppStart + kPageSize);
+  CHECK(later.length() == kPageSize + 1500);
+  CHECK(later.blank(0) && !later.blank(1));
+
+  CHECK_THROWS(Image::from_bin(data, kAppStart - kPageSize));
+  CHECK_THROWS(Image::from_bin(data, kAppEnd - 1000));
+  CHECK_THROWS(Image::from_bin({}));
+}
+
+/* Refusals in immediate mode go again, in order, until they get through */
+static void test_session_busy(void)
+{
+  BleTransport *link = nullptr;
+  unsigned refused = 0;
+
+  BleTransport transport([&](Channel, const uint8_t *data, size_t len)
+  {
+    /* every chunk is refused the first time round */
+    static uint64_t seen = 0;
+    uint8_t chunk = data[2];
+
+    if (!(seen & (1ULL << chunk)))
+    {
+      seen |= 1ULL << chunk;
+      refused++;
+      link->notified((const uint8_t *)"! stage busy", 12);
+      return;
+    }
+    uint8_t reply[3] = { 'w', data[1], chunk };
+    link->notified(reply, sizeof(reply));
+  });
+  link = &transport;
+
+  Session session(transport, SessionOptions{ 4, std::chrono::milliseconds(1000) });
+  unsigned answered = 0;
+
+  for (uint8_t chunk = 0; chunk < 10; chunk++)
+  {
+    Command command;
+    command.channel = Channel::data;
+    command.bytes = { 'w', kFirstPage, chunk };
+    command.key = { 'w', kFirstPage, chunk };
+    command.answered = [&](const Packet &) { answered++; return true; };
+    session.submit(std::move(command));
+  }
+  session.drain();
+
+  CHECK(answered == 10);
+  CHECK(refused == 10);
+  CHECK(session.stats().retries == 10);
+  CHECK(session.stats().packets == 20);
+}
+
+/* A deferred refusal pins down the command whose answer never comes */
+static void test_session_deferred(void)
+{
+  BleTransport *link = nullptr;
+  std::vector<uint8_t> sent;
+
+  BleTransport transport([&](Channel, const uint8_t *data, size_t len)
+  {
+    sent.push_back(data[2]);
+    if (sent.size() == 2)
+    {
+      link->notified((const uint8_t *)"! flash busy", 12);
+      return;
+    }
+    uint8_t reply[6] = { 'w', data[1], data[2], 'O', 'K', 0 };
+    link->notified(reply, sizeof(reply));
+  });
+  link = &transport;
+
+  Session session(transport, SessionOptions{ 3, std::chrono::milliseconds(1000) });
+
+  for (uint8_t chunk = 0; chunk < 3; chunk++)
+  {
+    Command command;
+    command.bytes = { 'w', kFirstPage, chunk };
+    command.key = { 'w', kFirstPage, chunk };
+    command.timing = Timing::deferred;
+    session.submit(std::move(command));
+  }
+  session.drain();
+
+  CHECK(sent.size() == 4 && sent[1] == 1 && sent[3] == 1);
+  CHECK(session.stats().retries == 1);
+
+  /* an error that is not about room ends it */
+  BleTransport broken([&](Channel, const uint8_t *, size_t)
+  {
+    link->notified((const uint8_t *)"! invalid page", 14);
+  });
+  link = &broken;
+
+  Session failing(broken, SessionOptions{ 3, std::chrono::milliseconds(1000) });
+  Command command;
+  command.bytes = { 'w', 0, 0 };
+  command.key = { 'w', 0, 0 };
+  failing.submit(std::move(command));
+  CHECK_THROWS(failing.drain());
+}
+
+/* The device has to answer in time */
+static void test_session_timeout(void)
+{
+  BleTransport transport([](Channel, const uint8_t *, size_t) {});
+  Session session(transport, SessionOptions{ 1, std::chrono::milliseconds(50) });
+
+  Command command;
+  command.bytes = { 'i' };
+  command.key = { 'i' };
+  session.submit(std::move(command));
+  CHECK_THROWS(session.drain());
+}
+
+/* Every mode gets the image into flash, from scratch and over old data */
+static void test_upload_modes(void)
+{
+  /* a blank page in the middle, 'D' or nothing at all for it */
+  std::vector<uint8_t> data = application(6, 2);
+  std::fill(data.begin() + 3 * kPageSize, data.begin() + 4 * kPageSize, 0xFF);
+  data.resize(data.size() - 100);
+  Image image = Image::from_bin(data);
+
+  std::vector<uint8_t> other = application(6, 3);
+  Image old = Image::from_bin(other);
+
+  for (Mode mode : { Mode::plain, Mode::staged, Mode::windowed, Mode::lz })
+  {
+    CHECK(truncate(flash_path, 0) == 0);
+    Simulator device({ "-u", socket_path() });
+
+    for (const Image *upload : { &old, &image })
+    {
+      SocketTransport transport(device.where());
+      UploadOptions options;
+      options.mode = mode;
+      options.timeout = std::chrono::milliseconds(2000);
+
+      Uploader uploader(transport, options);
+      Result result = uploader.upload(*upload);
+      if (!flash_holds(*upload))
+      {
+        fprintf(stderr, "%s: flash differs\n", mode_name(mode));
+        exit(1);
+      }
+      CHECK(result.plan.skip.empty()); /* every page differs from before */
+    }
+
+    /* nothing left to do */
+    SocketTransport transport(device.where());
+    Uploader uploader(transport, UploadOptions{ mode });
+    Plan plan = uploader.plan(image);
+    CHECK(plan.write.empty() && plan.stream.empty() && plan.erase.empty());
+    CHECK(plan.skip.size() == image.pages());
+  }
+}
+
+/* Over a serial line, only the page that changed goes again */
+static void test_upload_pty(void)
+{
+  std::vector<uint8_t> data = application(8, 4);
+  Image image = Image::from_bin(data);
+
+  Simulator device({ "-t" });
+  UartTransport transport(device.where());
+  Uploader uploader(transport);
+
+  DeviceInfo info = uploader.info();
+  CHECK(info.config_id != 0);
+
+  Result first = uploader.upload(image);
+  CHECK(first.plan.stream.size() == 8);
+  CHECK(flash_holds(image));
+
+  data[5 * kPageSize + 17] ^= 0x55;
+  Image changed = Image::from_bin(data);
+  Result second = uploader.upload(changed);
+  CHECK(second.plan.stream.size() == 1 && second.plan.stream[0] == kFirstPage + 5);
+  CHECK(second.plan.skip.size() == 7);
+  CHECK(flash_holds(changed));
+  CHECK(second.stats.packets - first.stats.packets < first.stats.packets / 4); /* stats add up */
+}
+
+/* Left unfinalized, 'f' with another image's checksum names the right one */
+static void test_upload_unfinalized(void)
+{
+  Image image = Image::from_bin(application(2, 5));
+
+  Simulator device({ "-u", socket_path() });
+  SocketTransport transport(device.where());
+  UploadOptions options;
+  options.mode = Mode::staged;
+  options.finalize = false;
+  Uploader uploader(transport, options);
+
+  Result result = uploader.upload(image);
+  CHECK(flash_holds(image));
+  CHECK(result.plan.write.size() == 2);
+
+  Image other = Image::from_bin(application(2, 6));
+  uint32_t length = other.length();
+  uint32_t crc = other.crc();
+  Packet answer;
+
+  Command finalize;
+  finalize.bytes = { 'f' };
+  finalize.bytes.insert(finalize.bytes.end(), (uint8_t *)&length, (uint8_t *)&length + 4);
+  finalize.bytes.insert(finalize.bytes.end(), (uint8_t *)&crc, (uint8_t *)&crc + 4);
+  finalize.key = { 'f' };
+  finalize.timing = Timing::deferred;
+  finalize.answered = [&](const Packet &packet) { answer = packet; return true; };
+  uploader.session().submit(std::move(finalize));
+  uploader.session().drain();
+
+  uint32_t found;
+  memcpy(&found, &answer.data[2], 4);
+  CHECK(answer.len >= 6 && answer.data[1] == '!');
+  CHECK(found == image.crc());
+}
+
+/* Counts the uploads going on through one route */
+class Counted : public Transport
+{
+public:
+  Counted(std::unique_ptr<Transport> inner, std::atomic<unsigned> &count, unsigned &peak)
+    : inner_(std::move(inner)), count_(count)
+  {
+    peak = std::max(peak, ++count_);
+  }
+
+  ~Counted() override { count_--; }
+
+  void send(Channel channel, const uint8_t *data, size_t len) override { inner_->send(channel, data, len); }
+  bool receive(Packet &packet, std::chrono::milliseconds timeout) override { return inner_->receive(packet, timeout); }
+  std::string name() const override { return inner_->name(); }
+
+private:
+  std::unique_ptr<Transport> inner_;
+  std::atomic<unsigned> &count_;
+};
+
+/* Several devices at once, each route only as busy as allowed */
+static void test_fleet_rollout(void)
+{
+  constexpr unsigned kDevices = 6;
+  std::vector<uint8_t> data = application(10, 7);
+  Image image = Image::from_bin(data);
+
+  std::vector<std::string> flashes;
+  std::vector<std::unique_ptr<Simulator>> devices;
+  for (unsigned i = 0; i < kDevices; i++)
+  {
+    flashes.push_back(std::string(flash_path) + "_" + std::to_string(i));
+    CHECK(truncate(flashes[i].c_str(), 0) == 0 || errno == ENOENT);
+    devices.push_back(std::make_unique<Simulator>(std::vector<std::string>{ "-u", socket_path(i) },
+          flashes[i]));
+  }
+
+  /* two adapters, three devices behind each */
+  std::atomic<unsigned> busy[2] = { {0}, {0} };
+  unsigned peak[2] = { 0, 0 };
+  std::vector<Target> targets;
+  for (unsigned i = 0; i < kDevices; i++)
+  {
+    std::string where = devices[i]->where();
+    unsigned route = i % 2;
+
+    targets.push_back(Target{ "device " + std::to_string(i), "adapter " + std::to_string(route),
+        [&, where, route] { return std::make_unique<Counted>(std::make_unique<SocketTransport>(where),
+              busy[route], peak[route]); } });
+  }
+
+  std::vector<unsigned> phases(kDevices, 0);
+  FleetOptions options;
+  options.jobs = 4;
+  options.per_route = 1;
+  options.progress = [&](size_t index, const Report &report)
+  {
+    if (report.state == State::running)
+    {
+      phases[index] |= 1 << (unsigned)report.progress.phase;
+    }
+  };
+
+  Fleet fleet(image, options);
+  std::vector<Report> reports = fleet.run(targets);
+
+  for (unsigned i = 0; i < kDevices; i++)
+  {
+    CHECK(reports[i].state == State::done && reports[i].attempts == 1);
+    CHECK(reports[i].result.plan.stream.size() == 10);
+    CHECK(flash_holds(image, flashes[i]));
+    CHECK(phases[i] & (1 << (unsigned)Phase::write));
+    CHECK(phases[i] & (1 << (unsigned)Phase::done));
+  }
+  CHECK(peak[0] == 1 && peak[1] == 1);
+  CHECK(fleet.streams().size() == 1); /* all blank before, all the same stream */
+
+  /* once more: nothing left to write, and a device that is not there */
+  targets.push_back(Target{ "missing", "", [] { return std::make_unique<SocketTransport>(socket_path(99)); } });
+  options.progress = nullptr;
+  options.per_route = 0;
+  options.attempts = 3;
+  Fleet again(image, options);
+  reports = again.run(targets);
+
+  for (unsigned i = 0; i < kDevices; i++)
+  {
+    CHECK(reports[i].state == State::done);
+    CHECK(reports[i].result.plan.skip.size() == 10);
+  }
+  CHECK(reports[kDevices].state == State::failed);
+  CHECK(reports[kDevices].attempts == 3);
+  CHECK(!reports[kDevices].error.empty());
+  CHECK(again.streams().size() == 0);
+
+  devices.clear();
+  for (const std::string &flash : flashes)
+  {
+    unlink(flash.c_str());
+  }
+}
+
+/* Loses everything sent after the first so many packets */
+class Cut : public Transport
+{
+public:
+  Cut(std::unique_ptr<Transport> inner, unsigned packets) : inner_(std::move(inner)), left_(packets) {}
+
+  void send(Channel channel, const uint8_t *data, size_t len) override
+  {
+    if (left_)
+    {
+      left_--;
+      inner_->send(channel, data, len);
+    }
+  }
+  bool receive(Packet &packet, std::chrono::milliseconds timeout) override { return inner_->receive(packet, timeout); }
+  std::string name() const override { return inner_->name(); }
+
+private:
+  std::unique_ptr<Transport> inner_;
+  unsigned left_;
+};
+
+/* A device that fails midway gets another go, which picks up where it was */
+static void test_fleet_retry(void)
+{
+  std::vector<uint8_t> data = application(8, 8);
+  Image image = Image::from_bin(data);
+  Simulator device({ "-u", socket_path() });
+
+  /* the first connection goes silent after a few hundred packets */
+  unsigned connections = 0;
+  Target target{ "flaky", "", [&]() -> std::unique_ptr<Transport>
+  {
+    return std::make_unique<Cut>(std::make_unique<SocketTransport>(device.where()),
+        connections++ ? ~0u : 300);
+  } };
+
+  FleetOptions options;
+  options.upload.mode = Mode::staged;
+  options.upload.timeout = std::chrono::milliseconds(300);
+  Fleet fleet(image, options);
+  std::vector<Report> reports = fleet.run({ target });
+
+  CHECK(reports[0].state == State::done);
+  CHECK(reports[0].attempts == 2);
+  CHECK(!reports[0].error.empty());
+  CHECK(!reports[0].result.plan.skip.empty()); /* what made it the first time */
+  CHECK(flash_holds(image));
+}
+
+typedef struct
+{
+  const char *name;
+  void      (*fn)(void);
+} test_t;
+
+static const test_t tests[] =
+{
+  { "image_hex",          test_image_hex          },
+  { "image_bin",          test_image_bin          },
+  { "session_busy",       test_session_busy       },
+  { "session_deferred",   test_session_deferred   },
+  { "session_timeout",    test_session_timeout    },
+  { "upload_modes",       test_upload_modes       },
+  { "upload_pty",         test_upload_pty         },
+  { "upload_unfinalized", test_upload_unfinalized },
+  { "fleet_rollout",      test_fleet_rollout      },
+  { "fleet_retry",        test_fleet_retry        },
+};
+
+int main(int argc, char **argv)
+{
+  char path[] = "/tmp/tinydfu_flash_XXXXXX";
+  int  failed = 0;
+
+  int fd = mkstemp(path);
+  if (fd < 0)
+  {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+  flash_path = path;
+
+  for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+  {
+    if (truncate(path, 0))
+    {
+      perror("truncate");
+      return 1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      try
+      {
+        tests[i].fn();
+      }
+      catch (const Error &e)
+      {
+        fprintf(stderr, "%s\n", e.what());
+        exit(1);
+      }
+      exit(0);
+    }
+
+    int status = 1;
+    waitpid(pid, &status, 0);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (WIFSIGNALED(status))
+    {
+      fprintf(stderr, "%s: signal %d\n", tests[i].name, WTERMSIG(status));
+    }
+    printf("%s %s\n", ok ? "PASS" : "FAIL", tests[i].name);
+    failed += !ok;
+  }
+
+  unlink(path);
+  printf("%d of %d failed\n", failed, (int)(sizeof(tests) / sizeof(tests[0])));
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "fleet.h"
+
+/*
+ * tinydfu: upload an image to the bootloader
+ *
+ * Over a Unix socket (the simulator, nrf51_tinydfu_sim -u, or a bridge
+ * that speaks the same SLIP frames) or a serial port to a UART bridge.
+ * Given more than one device, it updates them all at once.
+ */
+
+using namespace tinydfu;
+
+static int usage(const char *name)
+{
+  fprintf(stderr,
+      "usage: %s (-s socket | -u tty [-b baud]) [options] image.hex|image.bin\n"
+      "       %s (-s socket | -u tty [-b baud]) -i\n"
+      "       %s (-s socket | -u tty)... [-j n] [-A n] [options] image.hex|image.bin\n"
+      "  -m mode    plain, staged, windowed or lz (default lz)\n"
+      "  -w n       commands in flight (default: per mode)\n"
+      "  -a addr    load address of a .bin image (default 0x%x)\n"
+      "  -t ms      give up on a device silent this long (default 5000)\n"
+      "  -j n       devices updated at once (default 8)\n"
+      "  -A n       attempts per device (default 2)\n"
+      "  -F         write every page, also those the device has already\n"
+      "  -N         leave the image unfinalized\n"
+      "  -n         only show what would be done (one device)\n"
+      "  -i         show the device's ids (one device)\n"
+      "  -q         no progress\n",
+      name, name, name, kAppStart);
+  return 2;
+}
+
+static void show_progress(const Progress &progress)
+{
+  unsigned percent = progress.total ? (uint64_t)progress.done * 100 / progress.total : 100;
+  fprintf(stderr, "\r%-8s %3u%%", phase_name(progress.phase), percent);
+  if (progress.phase == Phase::done)
+  {
+    fprintf(stderr, "\n");
+  }
+}
+
+static void show_pages(const char *what, const std::vector<uint8_t> &pages)
+{
+  if (pages.empty())
+  {
+    return;
+  }
+
+  printf("%-8s %3zu pages:", what, pages.size());
+  for (size_t i = 0; i < pages.size(); )
+  {
+    size_t run = 1;
+    while (i + run < pages.size() && pages[i + run] == pages[i] + run)
+    {
+      run++;
+    }
+    if (run == 1)
+    {
+      printf(" %u", pages[i]);
+    }
+    else
+    {
+      printf(" %u-%u", pages[i], pages[i + run - 1]);
+    }
+    i += run;
+  }
+  printf("\n");
+}
+
+/* A line whenever a device of a fleet moves on */
+static void show_device(const std::vector<Target> &targets, std::vector<int> &shown,
+    size_t index, const Report &report)
+{
+  const char *name = targets[index].name.c_str();
+  int now = (int)report.state * 16 + (int)report.progress.phase;
+
+  if (now == shown[index] || (report.state == State::running && report.progress.phase == Phase::done))
+  {
+    return;
+  }
+  shown[index] = now;
+
+  switch (report.state)
+  {
+    case State::running:
+      fprintf(stderr, "%s: %s\n", name, phase_name(report.progress.phase));
+      break;
+    case State::waiting:
+      fprintf(stderr, "%s: %s, trying again later\n", name, report.error.c_str());
+      break;
+    case State::failed:
+      fprintf(stderr, "%s: %s, giving up\n", name, report.error.c_str());
+      break;
+    case State::done:
+      fprintf(stderr, "%s: done\n", name);
+      break;
+  }
+}
+
+static int update_fleet(const Image &image, const std::vector<Target> &targets,
+    const FleetOptions &options, bool quiet)
+{
+  FleetOptions fleet_options = options;
+  std::vector<int> shown(targets.size(), -100); /* nothing shown yet */
+  unsigned failed = 0;
+
+  if (!quiet)
+  {
+    fleet_options.progress = [&](size_t index, const Report &report)
+    {
+      show_device(targets, shown, index, report);
+    };
+  }
+
+  Fleet fleet(image, fleet_options);
+  std::vector<Report> reports = fleet.run(targets);
+
+  for (size_t i = 0; i < reports.size(); i++)
+  {
+    const Report &report = reports[i];
+
+    if (report.state == State::done)
+    {
+      const Plan &plan = report.result.plan;
+      printf("%s: done in %.2f s, %zu pages written, %zu unchanged, %u retries\n",
+          targets[i].name.c_str(), report.result.elapsed.count() / 1000.0,
+          plan.write.size() + plan.stream.size(), plan.skip.size(), report.result.stats.retries);
+    }
+    else
+    {
+      printf("%s: failed after %u attempts: %s\n", targets[i].name.c_str(), report.attempts,
+          report.error.c_str());
+      failed++;
+    }
+  }
+  printf("%zu devices, %zu done, %u failed\n", reports.size(), reports.size() - failed, failed);
+  return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<std::string> sockets;
+  std::vector<std::string> ttys;
+  unsigned baud = 115200;
+  uint32_t base = kAppStart;
+  bool dry_run = false;
+  bool ids = false;
+  bool quiet = false;
+  FleetOptions fleet_options;
+  UploadOptions &options = fleet_options.upload;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:u:b:m:w:a:t:j:A:FNniq")) != -1)
+  {
+    switch (opt)
+    {
+      case 's':
+        sockets.push_back(optarg);
+        break;
+      case 'u':
+        ttys.push_back(optarg);
+        break;
+      case 'b':
+        baud = strtoul(optarg, nullptr, 0);
+        break;
+      case 'm':
+        if (!mode_parse(optarg, options.mode))
+        {
+          return usage(argv[0]);
+        }
+        break;
+      case 'w':
+        options.window = strtoul(optarg, nullptr, 0);
+        break;
+      case 'a':
+        base = strtoul(optarg, nullptr, 0);
+        break;
+      case 't':
+        options.timeout = std::chrono::milliseconds(strtoul(optarg, nullptr, 0));
+        break;
+      case 'j':
+        fleet_options.jobs = strtoul(optarg, nullptr, 0);
+        break;
+      case 'A':
+        fleet_options.attempts = strtoul(optarg, nullptr, 0);
+        break;
+      case 'F':
+        options.skip_unchanged = false;
+        break;
+      case 'N':
+        options.finalize = false;
+        break;
+      case 'n':
+        dry_run = true;
+        break;
+      case 'i':
+        ids = true;
+        break;
+      case 'q':
+        quiet = true;
+        break;
+      default:
+        return usage(argv[0]);
+    }
+  }
+
+  std::vector<Target> targets;
+  for (const std::string &path : sockets)
+  {
+    targets.push_back(Target{ path, "", [path] { return std::make_unique<SocketTransport>(path); } });
+  }
+  for (const std::string &path : ttys)
+  {
+    targets.push_back(Target{ path, "", [path, baud] { return std::make_unique<UartTransport>(path, baud); } });
+  }
+
+  if (targets.empty() || (!ids && optind != argc - 1) ||
+      (targets.size() > 1 && (ids || dry_run)))
+  {
+    return usage(argv[0]);
+  }
+
+  if (!quiet && targets.size() == 1)
+  {
+    options.progress = show_progress;
+  }
+
+  try
+  {
+    std::unique_ptr<Image> image;
+    if (!ids)
+    {
+      image = std::make_unique<Image>(Image::load(argv[optind], base));
+    }
+
+    if (targets.size() > 1)
+    {
+      return update_fleet(*image, targets, fleet_options, quiet);
+    }
+
+    std::unique_ptr<Transport> transport = targets[0].connect();
+    Uploader uploader(*transport, options);
+
+    if (ids)
+    {
+      DeviceInfo info = uploader.info();
+      printf("config %08x device %016llx\n", info.config_id, (unsigned long long)info.device_id);
+      return 0;
+    }
+
+    if (dry_run)
+    {
+      Plan plan = uploader.plan(*image);
+      if (!quiet)
+      {
+        fprintf(stderr, "\n");
+      }
+      printf("image    %u bytes, crc %08x, %s\n", image->length(), image->crc(), mode_name(options.mode));
+      show_pages("erase", plan.erase);
+      show_pages("write", plan.write);
+      show_pages("stream", plan.stream);
+      show_pages("keep", plan.skip);
+      return 0;
+    }
+
+    Result result = uploader.upload(*image);
+    double seconds = result.elapsed.count() / 1000.0;
+
+    printf("%u bytes in %.2f s (%.0f bytes/s), %u packets, %u bytes sent, %u retries\n",
+        image->length(), seconds, seconds > 0 ? image->length() / seconds : 0.0,
+        result.stats.packets, result.stats.bytes, result.stats.retries);
+    printf("pages: %zu written, %zu erased, %zu unchanged\n",
+        result.plan.write.size() + result.plan.stream.size(), result.plan.erase.size(),
+        result.plan.skip.size());
+    return 0;
+  }
+  catch (const Error &e)
+  {
+    if (!quiet)
+    {
+      fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+}
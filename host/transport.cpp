@@ -0,0 +1,320 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "transport.h"
+
+namespace tinydfu
+{
+
+namespace
+{
+
+constexpr uint8_t kSlipEnd    = 0xC0;
+constexpr uint8_t kSlipEsc    = 0xDB;
+constexpr uint8_t kSlipEscEnd = 0xDC;
+constexpr uint8_t kSlipEscEsc = 0xDD;
+
+Error system_error(const std::string &what)
+{
+  return Error(what + ": " + strerror(errno));
+}
+
+} // namespace
+
+/*
+ * SLIP
+ */
+
+StreamTransport::StreamTransport(int fd, std::string name)
+  : fd_(fd), name_(std::move(name))
+{
+}
+
+StreamTransport::~StreamTransport()
+{
+  close(fd_);
+}
+
+void StreamTransport::send(Channel channel, const uint8_t *data, size_t len)
+{
+  uint8_t out[2 * (1 + kPacketSize) + 2];
+  size_t o = 0;
+
+  if (len > kPacketSize)
+  {
+    throw Error(name_ + ": packet too long");
+  }
+
+  out[o++] = kSlipEnd;
+  out[o++] = static_cast<uint8_t>(channel);
+  for (size_t i = 0; i < len; i++)
+  {
+    if (data[i] == kSlipEnd || data[i] == kSlipEsc)
+    {
+      out[o++] = kSlipEsc;
+      out[o++] = data[i] == kSlipEnd ? kSlipEscEnd : kSlipEscEsc;
+    }
+    else
+    {
+      out[o++] = data[i];
+    }
+  }
+  out[o++] = kSlipEnd;
+
+  for (size_t done = 0; done < o; )
+  {
+    ssize_t n = write(fd_, out + done, o - done);
+
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      throw system_error(name_);
+    }
+    done += n;
+  }
+}
+
+bool StreamTransport::receive(Packet &packet, std::chrono::milliseconds timeout)
+{
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+
+  for (;;)
+  {
+    while (buf_pos_ < buf_len_)
+    {
+      uint8_t byte = buf_[buf_pos_++];
+
+      if (byte == kSlipEnd)
+      {
+        bool complete = frame_.size() > 1 && frame_.size() <= 1 + kPacketSize;
+
+        if (complete)
+        {
+          packet.len = frame_.size() - 1;
+          std::copy(frame_.begin() + 1, frame_.end(), packet.data);
+        }
+        frame_.clear();
+        escaped_ = false;
+        if (complete)
+        {
+          return true;
+        }
+        continue;
+      }
+
+      if (byte == kSlipEsc)
+      {
+        escaped_ = true;
+        continue;
+      }
+
+      if (escaped_)
+      {
+        byte = byte == kSlipEscEnd ? kSlipEnd : byte == kSlipEscEsc ? kSlipEsc : byte;
+        escaped_ = false;
+      }
+      if (frame_.size() <= 1 + kPacketSize)
+      {
+        frame_.push_back(byte);
+      }
+    }
+
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    struct pollfd in = { fd_, POLLIN, 0 };
+    int ready = poll(&in, 1, std::max<int>(0, left.count()));
+
+    if (ready < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (ready < 0)
+    {
+      throw system_error(name_);
+    }
+    if (!ready)
+    {
+      return false;
+    }
+
+    ssize_t n = read(fd_, buf_, sizeof(buf_));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+    {
+      continue;
+    }
+    if (n < 0)
+    {
+      throw system_error(name_);
+    }
+    if (!n)
+    {
+      throw Error(name_ + ": closed");
+    }
+    buf_pos_ = 0;
+    buf_len_ = n;
+  }
+}
+
+static int socket_open(const std::string &path)
+{
+  struct sockaddr_un addr = {};
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (path.size() >= sizeof(addr.sun_path))
+  {
+    throw Error(path + ": path too long");
+  }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+
+  if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)))
+  {
+    Error error = system_error(path);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    throw error;
+  }
+  return fd;
+}
+
+SocketTransport::SocketTransport(const std::string &path)
+  : StreamTransport(socket_open(path), path)
+{
+}
+
+static speed_t baud_constant(unsigned baud)
+{
+  switch (baud)
+  {
+    case 9600:    return B9600;
+    case 19200:   return B19200;
+    case 38400:   return B38400;
+    case 57600:   return B57600;
+    case 115200:  return B115200;
+    case 230400:  return B230400;
+    case 460800:  return B460800;
+    case 921600:  return B921600;
+    case 1000000: return B1000000;
+    default:
+      throw Error("unsupported baud rate " + std::to_string(baud));
+  }
+}
+
+static int uart_open(const std::string &path, unsigned baud)
+{
+  speed_t speed = baud_constant(baud);
+  int fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+  struct termios tio;
+
+  if (fd < 0 || tcgetattr(fd, &tio))
+  {
+    Error error = system_error(path);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    throw error;
+  }
+
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  tio.c_cc[VMIN] = 1;
+  tio.c_cc[VTIME] = 0;
+
+  if (tcsetattr(fd, TCSANOW, &tio))
+  {
+    Error error = system_error(path);
+    close(fd);
+    throw error;
+  }
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+UartTransport::UartTransport(const std::string &path, unsigned baud)
+  : StreamTransport(uart_open(path, baud), path)
+{
+}
+
+/*
+ * BLE adapter
+ */
+
+BleTransport::BleTransport(Write write, std::string name)
+  : write_(std::move(write)), name_(std::move(name))
+{
+}
+
+void BleTransport::send(Channel channel, const uint8_t *data, size_t len)
+{
+  {
+    std::lock_guard<std::mutex> hold(lock_);
+    if (gone_)
+    {
+      throw Error(name_ + ": disconnected");
+    }
+  }
+  write_(channel, data, len);
+}
+
+bool BleTransport::receive(Packet &packet, std::chrono::milliseconds timeout)
+{
+  std::unique_lock<std::mutex> hold(lock_);
+
+  if (!arrived_.wait_for(hold, timeout, [this] { return !inbox_.empty() || gone_; }))
+  {
+    return false;
+  }
+  if (inbox_.empty())
+  {
+    throw Error(name_ + ": disconnected");
+  }
+  packet = inbox_.front();
+  inbox_.pop_front();
+  return true;
+}
+
+void BleTransport::notified(const uint8_t *data, size_t len)
+{
+  Packet packet;
+
+  packet.len = std::min(len, kPacketSize);
+  std::copy(data, data + packet.len, packet.data);
+  {
+    std::lock_guard<std::mutex> hold(lock_);
+    inbox_.push_back(packet);
+  }
+  arrived_.notify_one();
+}
+
+void BleTransport::disconnected()
+{
+  {
+    std::lock_guard<std::mutex> hold(lock_);
+    gone_ = true;
+  }
+  arrived_.notify_all();
+}
+
+} // namespace tinydfu
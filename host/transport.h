@@ -0,0 +1,126 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#ifndef _tinydfu_transport_h
+#define _tinydfu_transport_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "image.h"
+
+namespace tinydfu
+{
+
+/* Which characteristic a write goes to */
+enum class Channel : uint8_t
+{
+  control = 0, /* control point, everything but bulk data */
+  data    = 1, /* write without response: 'w', 'Z', 'P' */
+};
+
+/* One notification from the control point */
+struct Packet
+{
+  uint8_t data[kPacketSize];
+  uint8_t len = 0;
+};
+
+/*
+ * The way to a device
+ *
+ * send() may block while the link is full but never waits for an answer.
+ * receive() waits up to timeout for the next notification. Both throw
+ * Error once the device is gone.
+ */
+class Transport
+{
+public:
+  virtual ~Transport() = default;
+  virtual void send(Channel channel, const uint8_t *data, size_t len) = 0;
+  virtual bool receive(Packet &packet, std::chrono::milliseconds timeout) = 0;
+  virtual std::string name() const = 0;
+};
+
+/*
+ * SLIP (RFC 1055) frames over a byte stream, what sim/server_main.c and a
+ * UART bridge speak. First byte of a frame is the Channel, the rest the
+ * write or notification.
+ */
+class StreamTransport : public Transport
+{
+public:
+  ~StreamTransport() override;
+  void send(Channel channel, const uint8_t *data, size_t len) override;
+  bool receive(Packet &packet, std::chrono::milliseconds timeout) override;
+  std::string name() const override { return name_; }
+
+protected:
+  StreamTransport(int fd, std::string name);
+
+private:
+  int fd_;
+  std::string name_;
+  std::vector<uint8_t> frame_;
+  bool escaped_ = false;
+  uint8_t buf_[256];
+  size_t buf_pos_ = 0;
+  size_t buf_len_ = 0;
+};
+
+/* Unix socket, e.g. nrf51_tinydfu_sim -u */
+class SocketTransport : public StreamTransport
+{
+public:
+  explicit SocketTransport(const std::string &path);
+};
+
+/* Serial port (or a pty, nrf51_tinydfu_sim -t), raw 8N1 */
+class UartTransport : public StreamTransport
+{
+public:
+  explicit UartTransport(const std::string &path, unsigned baud = 115200);
+};
+
+/*
+ * Whatever BLE stack the caller has
+ *
+ * write gets every packet with the characteristic it is for (write
+ * without response will do for both). The stack calls notified() for
+ * notifications of the control point and disconnected() when the link is
+ * gone, from any thread.
+ */
+class BleTransport : public Transport
+{
+public:
+  using Write = std::function<void(Channel channel, const uint8_t *data, size_t len)>;
+
+  BleTransport(Write write, std::string name = "ble");
+  void send(Channel channel, const uint8_t *data, size_t len) override;
+  bool receive(Packet &packet, std::chrono::milliseconds timeout) override;
+  std::string name() const override { return name_; }
+
+  void notified(const uint8_t *data, size_t len);
+  void disconnected();
+
+private:
+  Write write_;
+  std::string name_;
+  std::mutex lock_;
+  std::condition_variable arrived_;
+  std::deque<Packet> inbox_;
+  bool gone_ = false;
+};
+
+} // namespace tinydfu
+
+#endif
@@ -0,0 +1,642 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include "uploader.h"
+
+extern "C"
+{
+#include "encode.h"
+}
+
+namespace tinydfu
+{
+
+namespace
+{
+
+constexpr uint8_t  kFlagStaged     = 0x01;
+constexpr uint8_t  kFlagWindowed   = 0x02;
+constexpr uint8_t  kFlagAutoErase  = 0x08;
+constexpr unsigned kStagePages     = 2;  /* STAGE_SLOTS: pages open at once */
+constexpr unsigned kPlainWindow    = 7;  /* FLASH_QUEUE_SIZE, one left for the image record */
+constexpr unsigned kDefaultWindow  = 8;
+constexpr unsigned kMaxWindow      = 16; /* RX_HOLD_SIZE: commands the device holds while its TX ring is full */
+constexpr uint64_t kAllChunks      = ~0ULL;
+
+uint32_t le32(const uint8_t *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint32_t be32(const uint8_t *p)
+{
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+void put_le32(std::vector<uint8_t> &out, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    out.push_back(value >> (8 * i));
+  }
+}
+
+/* Unprompted packets go to handler while this is in scope */
+class Listener
+{
+public:
+  Listener(Session &session, std::function<void(const Packet &)> handler)
+    : session_(session), previous_(std::move(session.unsolicited))
+  {
+    session_.unsolicited = std::move(handler);
+  }
+
+  ~Listener()
+  {
+    session_.unsolicited = std::move(previous_);
+  }
+
+private:
+  Session &session_;
+  std::function<void(const Packet &)> previous_;
+};
+
+} // namespace
+
+const char *mode_name(Mode mode)
+{
+  switch (mode)
+  {
+    case Mode::plain:    return "plain";
+    case Mode::staged:   return "staged";
+    case Mode::windowed: return "windowed";
+    case Mode::lz:       return "lz";
+  }
+  return "?";
+}
+
+bool mode_parse(const std::string &name, Mode &mode)
+{
+  for (Mode m : { Mode::plain, Mode::staged, Mode::windowed, Mode::lz })
+  {
+    if (name == mode_name(m))
+    {
+      mode = m;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *phase_name(Phase phase)
+{
+  switch (phase)
+  {
+    case Phase::hash:     return "hash";
+    case Phase::erase:    return "erase";
+    case Phase::write:    return "write";
+    case Phase::finalize: return "finalize";
+    case Phase::done:     return "done";
+  }
+  return "?";
+}
+
+Uploader::Uploader(Transport &transport, UploadOptions options)
+  : session_(transport, SessionOptions{ kDefaultWindow, options.timeout }), options_(std::move(options))
+{
+}
+
+void Uploader::report(Phase phase, uint32_t done, uint32_t total)
+{
+  if (options_.progress)
+  {
+    options_.progress(Progress{ phase, done, total });
+  }
+}
+
+/*
+ * Questions
+ */
+
+DeviceInfo Uploader::info()
+{
+  DeviceInfo info;
+  Command command;
+
+  command.bytes = { 'i' };
+  command.key = { 'i' };
+  command.answered = [&](const Packet &packet)
+  {
+    if (packet.len == 13)
+    {
+      info.config_id = be32(&packet.data[1]);
+      info.device_id = (uint64_t)be32(&packet.data[5]) << 32 | be32(&packet.data[9]);
+    }
+    return true;
+  };
+  session_.submit(std::move(command));
+  session_.drain();
+  return info;
+}
+
+/* CRC-32 of pages first to last, as the device sees them */
+std::vector<uint32_t> Uploader::hashes(uint8_t first, uint8_t last)
+{
+  std::vector<uint32_t> crcs;
+  Command command;
+
+  command.bytes = { 'h', first, last };
+  command.key = { 'h' };
+  command.answered = [&](const Packet &packet)
+  {
+    for (uint8_t at = 2; at + 4 <= packet.len; at += 4)
+    {
+      crcs.push_back(le32(&packet.data[at]));
+    }
+    return crcs.size() >= (size_t)(last - first + 1);
+  };
+
+  session_.drain();
+  session_.submit(std::move(command));
+  session_.drain();
+  return crcs;
+}
+
+/*
+ * Plan
+ *
+ * Pages the device already has as in the image are left alone, blank ones
+ * only erased, the rest written. An lz stream has to be one piece, so it
+ * runs from the first page that changes to the last, whatever lies between.
+ */
+Plan Uploader::plan(const Image &image)
+{
+  Plan plan;
+  std::vector<uint32_t> device;
+  uint8_t last = kFirstPage + image.pages() - 1;
+
+  if (options_.skip_unchanged)
+  {
+    report(Phase::hash, 0, image.pages());
+    device = hashes(kFirstPage, last);
+    report(Phase::hash, image.pages(), image.pages());
+  }
+
+  for (uint8_t i = 0; i < image.pages(); i++)
+  {
+    uint8_t page = kFirstPage + i;
+
+    if (i < device.size() && device[i] == image.page_crc(i))
+    {
+      plan.skip.push_back(page);
+    }
+    else if (image.blank(i))
+    {
+      plan.erase.push_back(page);
+    }
+    else
+    {
+      plan.write.push_back(page);
+    }
+  }
+
+  if (options_.mode == Mode::lz && (!plan.erase.empty() || !plan.write.empty()))
+  {
+    uint8_t from = std::min(plan.erase.empty() ? 255 : plan.erase.front(),
+        plan.write.empty() ? 255 : plan.write.front());
+    uint8_t to = std::max(plan.erase.empty() ? 0 : plan.erase.back(),
+        plan.write.empty() ? 0 : plan.write.back());
+
+    for (uint8_t page = from; page <= to; page++)
+    {
+      plan.stream.push_back(page);
+    }
+    plan.erase.clear();
+    plan.write.clear();
+    plan.skip.erase(std::remove_if(plan.skip.begin(), plan.skip.end(),
+          [&](uint8_t page) { return page >= from && page <= to; }), plan.skip.end());
+  }
+  return plan;
+}
+
+/*
+ * Doing it
+ */
+
+unsigned Uploader::window(unsigned fallback) const
+{
+  return std::min(options_.window ? options_.window : fallback, kMaxWindow);
+}
+
+void Uploader::set_flags(uint8_t flags, uint8_t window)
+{
+  Command command;
+
+  command.bytes = { 's', flags };
+  if (window)
+  {
+    command.bytes.push_back(window);
+  }
+  command.key = { 's' };
+  session_.submit(std::move(command));
+  session_.drain();
+}
+
+/* 'D' per run of pages, one run at a time since a new one replaces the last */
+void Uploader::erase(const std::vector<uint8_t> &pages)
+{
+  uint32_t done = 0;
+
+  for (size_t i = 0; i < pages.size(); )
+  {
+    size_t run = 1;
+    while (i + run < pages.size() && pages[i + run] == pages[i] + run)
+    {
+      run++;
+    }
+
+    Command command;
+    command.bytes = { 'D', pages[i], (uint8_t)run };
+    command.key = { 'D' };
+    command.answered = [&](const Packet &packet)
+    {
+      report(Phase::erase, ++done, pages.size());
+      return packet.len < 6 || packet.data[5] == 0;
+    };
+    session_.submit(std::move(command));
+    session_.drain();
+    i += run;
+  }
+}
+
+Command Uploader::chunk(const Image &image, uint8_t page, uint8_t index, Timing timing)
+{
+  const uint8_t *data = image.page(page - kFirstPage) + index * kChunkSize;
+  Command command;
+
+  command.channel = Channel::data;
+  command.bytes = { 'w', page, index };
+  command.bytes.insert(command.bytes.end(), data, data + kChunkSize);
+  command.key = { 'w', page, index };
+  command.timing = timing;
+  return command;
+}
+
+/* Erased beforehand, blank chunks left out, each answered once it is in flash */
+void Uploader::write_plain(const Image &image, const std::vector<uint8_t> &pages)
+{
+  uint32_t total = pages.size() * kPageSize;
+  uint32_t done = 0;
+
+  set_flags(0);
+  session_.set_window(window(kPlainWindow));
+
+  for (uint8_t page : pages)
+  {
+    for (uint8_t i = 0; i < kChunks; i++)
+    {
+      if (image.chunk_blank(page - kFirstPage, i))
+      {
+        done += kChunkSize;
+        continue;
+      }
+
+      Command command = chunk(image, page, i, Timing::deferred);
+      command.answered = [&](const Packet &)
+      {
+        done += kChunkSize;
+        report(Phase::write, done, total);
+        return true;
+      };
+      session_.submit(std::move(command));
+    }
+  }
+  session_.drain();
+}
+
+/* Every chunk answered right away, pages committed ('c') as they fill */
+void Uploader::write_staged(const Image &image, const std::vector<uint8_t> &pages)
+{
+  uint32_t total = pages.size() * kPageSize;
+
+  set_flags(kFlagStaged | kFlagAutoErase);
+  session_.set_window(window(kDefaultWindow));
+
+  for (uint8_t page : pages)
+  {
+    for (uint8_t i = 0; i < kChunks; i++)
+    {
+      session_.submit(chunk(image, page, i, Timing::immediate));
+    }
+  }
+  session_.drain();
+  session_.wait([&] { return commits_ >= pages.size(); });
+  report(Phase::write, total, total);
+}
+
+/*
+ * Chunks go out unanswered, a page at a time with the next one behind it.
+ * The 'a' bitmap after each page says what arrived; what did not goes again,
+ * with a 'q' behind it for a fresh bitmap.
+ */
+void Uploader::write_windowed(const Image &image, const std::vector<uint8_t> &pages)
+{
+  std::map<uint8_t, uint64_t> have;
+  std::map<uint8_t, unsigned> heard;
+  std::deque<uint8_t> open;
+  size_t next = 0;
+  uint32_t total = pages.size() * kPageSize;
+  uint32_t done = 0;
+
+  auto bitmap = [&](const Packet &packet)
+  {
+    if (packet.len == 10 && have.count(packet.data[1]))
+    {
+      uint64_t bits = 0;
+      for (int i = 0; i < 8; i++)
+      {
+        bits |= (uint64_t)packet.data[2 + i] << (8 * i);
+      }
+      have[packet.data[1]] |= bits;
+      heard[packet.data[1]]++;
+    }
+  };
+
+  auto send = [&](uint8_t page, uint64_t missing)
+  {
+    for (uint8_t i = 0; i < kChunks; i++)
+    {
+      if (missing & (1ULL << i))
+      {
+        Command command = chunk(image, page, i, Timing::immediate);
+        session_.post(command.channel, command.bytes.data(), command.bytes.size());
+      }
+    }
+  };
+
+  set_flags(kFlagStaged | kFlagWindowed | kFlagAutoErase, kChunks);
+  session_.set_window(window(kDefaultWindow));
+  Listener listener(session_, [&](const Packet &packet)
+  {
+    if (packet.data[0] == 'c')
+    {
+      commits_++;
+    }
+    bitmap(packet);
+  });
+
+  while (next < pages.size() || !open.empty())
+  {
+    while (open.size() < kStagePages && next < pages.size())
+    {
+      uint8_t page = pages[next++];
+      have[page] = 0;
+      heard[page] = 0;
+      send(page, kAllChunks);
+      open.push_back(page);
+    }
+
+    uint8_t page = open.front();
+    session_.wait([&] { return heard[page] > 0; });
+    if (have[page] == kAllChunks)
+    {
+      open.pop_front();
+      done += kPageSize;
+      report(Phase::write, done, total);
+      continue;
+    }
+
+    /*
+     * Chunks that found no room on the device, for every open page: the
+     * room may be held by the page behind this one. A commit makes some.
+     */
+    std::map<uint8_t, uint64_t> before = have;
+    uint32_t commits = commits_;
+
+    for (uint8_t missing : open)
+    {
+      if (have[missing] == kAllChunks)
+      {
+        continue;
+      }
+      send(missing, ~have[missing]);
+
+      Command query;
+      query.bytes = { 'q', missing };
+      query.key = { 'a', missing };
+      query.answered = [&](const Packet &packet)
+      {
+        bitmap(packet);
+        return true;
+      };
+      session_.submit(std::move(query));
+    }
+    session_.drain();
+
+    if (have == before)
+    {
+      session_.wait([&] { return commits_ > commits; });
+    }
+  }
+
+  session_.wait([&] { return commits_ >= pages.size(); });
+}
+
+std::vector<uint8_t> Uploader::compress(const Image &image, uint8_t first, uint8_t last)
+{
+  const uint8_t *from = image.page(first - kFirstPage);
+  size_t len = (last - first + 1) * kPageSize;
+
+  /* the device pads the end with 0xFF anyway */
+  while (len && from[len - 1] == 0xFF)
+  {
+    len--;
+  }
+
+  std::vector<uint8_t> packed(ENCODE_MAX(len));
+  packed.resize(encode_lz(from, len, packed.data()));
+  return packed;
+}
+
+std::shared_ptr<const std::vector<uint8_t>> StreamCache::get(uint8_t first, uint8_t last)
+{
+  std::lock_guard<std::mutex> hold(lock_);
+  auto &stream = streams_[{ first, last }];
+
+  if (!stream)
+  {
+    stream = std::make_shared<const std::vector<uint8_t>>(Uploader::compress(image_, first, last));
+  }
+  return stream;
+}
+
+size_t StreamCache::size()
+{
+  std::lock_guard<std::mutex> hold(lock_);
+  return streams_.size();
+}
+
+/* One stream, as far ahead as the device's credit allows */
+void Uploader::write_lz(const Image &image, Plan &plan)
+{
+  uint8_t first = plan.stream.front();
+  std::shared_ptr<const std::vector<uint8_t>> stream = options_.streams ?
+      options_.streams->get(first, plan.stream.back()) :
+      std::make_shared<const std::vector<uint8_t>>(compress(image, first, plan.stream.back()));
+  const std::vector<uint8_t> &packed = *stream;
+  uint32_t total = plan.stream.size() * kPageSize;
+  uint32_t fifo = 0;
+  uint32_t acked = 0;
+  size_t sent = 0;
+
+  plan.stream_bytes = packed.size();
+  set_flags(kFlagAutoErase);
+  session_.set_window(window(kDefaultWindow));
+  Listener listener(session_, [&](const Packet &packet)
+  {
+    if (packet.data[0] == 'c')
+    {
+      commits_++;
+    }
+    else if (packet.data[0] == 'Z' && packet.len == 5)
+    {
+      acked = le32(&packet.data[1]);
+      report(Phase::write, (uint64_t)acked * total / packed.size(), total);
+    }
+  });
+
+  Command start;
+  start.bytes = { 'z', first };
+  start.key = { 'z', first };
+  start.answered = [&](const Packet &packet)
+  {
+    fifo = packet.len >= 6 ? packet.data[4] | packet.data[5] << 8 : 0;
+    return true;
+  };
+  session_.submit(std::move(start));
+  session_.drain();
+
+  if (!fifo)
+  {
+    throw Error(session_.transport().name() + ": stream without credit");
+  }
+
+  while (sent < packed.size())
+  {
+    size_t n = std::min(packed.size() - sent, kPacketSize - 1);
+
+    if (sent + n - acked > fifo)
+    {
+      session_.wait([&] { return sent + n - acked <= fifo; });
+    }
+
+    uint8_t packet[kPacketSize];
+    packet[0] = 'Z';
+    memcpy(&packet[1], &packed[sent], n);
+    session_.post(Channel::data, packet, n + 1);
+    sent += n;
+  }
+
+  Command end;
+  end.bytes = { 'z' };
+  end.key = { 'z', 'E' };
+  session_.submit(std::move(end));
+  session_.drain();
+  session_.wait([&] { return commits_ >= plan.stream.size(); });
+  report(Phase::write, total, total);
+}
+
+/* The record that lets the image boot, once the device agrees on the CRC */
+void Uploader::finalize(const Image &image)
+{
+  uint32_t crc = image.crc();
+  Command command;
+
+  command.bytes = { 'f' };
+  put_le32(command.bytes, image.length());
+  put_le32(command.bytes, crc);
+  command.key = { 'f' };
+  command.timing = Timing::deferred;
+  command.answered = [&](const Packet &packet)
+  {
+    if (packet.len >= 6 && packet.data[1] == '!')
+    {
+      char what[64];
+      snprintf(what, sizeof(what), ": image CRC %08x, device has %08x", crc, le32(&packet.data[2]));
+      throw Error(session_.transport().name() + what);
+    }
+    return true;
+  };
+
+  report(Phase::finalize, 0, 1);
+  session_.submit(std::move(command));
+  session_.drain();
+  report(Phase::finalize, 1, 1);
+}
+
+Result Uploader::upload(const Image &image)
+{
+  auto start = std::chrono::steady_clock::now();
+  Result result;
+
+  commits_ = 0;
+  Listener listener(session_, [this](const Packet &packet)
+  {
+    if (packet.data[0] == 'c')
+    {
+      commits_++;
+    }
+  });
+
+  result.plan = plan(image);
+  Plan &plan = result.plan;
+
+  switch (options_.mode)
+  {
+    case Mode::plain:
+    {
+      std::vector<uint8_t> pages = plan.erase;
+      pages.insert(pages.end(), plan.write.begin(), plan.write.end());
+      std::sort(pages.begin(), pages.end());
+      erase(pages);
+      write_plain(image, plan.write);
+      break;
+    }
+    case Mode::staged:
+      erase(plan.erase);
+      write_staged(image, plan.write);
+      break;
+    case Mode::windowed:
+      erase(plan.erase);
+      write_windowed(image, plan.write);
+      break;
+    case Mode::lz:
+      if (!plan.stream.empty())
+      {
+        write_lz(image, plan);
+      }
+      break;
+  }
+
+  if (options_.finalize)
+  {
+    finalize(image);
+  }
+
+  result.stats = session_.stats();
+  result.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  report(Phase::done, image.length(), image.length());
+  return result;
+}
+
+} // namespace tinydfu
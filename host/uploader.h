@@ -0,0 +1,152 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#ifndef _tinydfu_uploader_h
+#define _tinydfu_uploader_h
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "image.h"
+#include "session.h"
+
+namespace tinydfu
+{
+
+/* How the pages get there, see 's', 'w' and 'z' in source/main.c */
+enum class Mode
+{
+  plain,    /* 'D' first, then every 'w' answered once it is in flash */
+  staged,   /* 'w' collected into pages on the device, auto erase */
+  windowed, /* staged, 'w' unanswered, one bitmap per page */
+  lz,       /* one 'z' stream from the first page that changed, auto erase */
+};
+
+const char *mode_name(Mode mode);
+bool mode_parse(const std::string &name, Mode &mode);
+
+enum class Phase
+{
+  hash,
+  erase,
+  write,
+  finalize,
+  done,
+};
+
+const char *phase_name(Phase phase);
+
+struct Progress
+{
+  Phase phase;
+  uint32_t done;  /* image bytes in flash (write), pages (erase) */
+  uint32_t total;
+};
+
+/*
+ * lz streams of one image, by page range
+ *
+ * Devices that are all on the same old image need the same stream, so
+ * uploads on other threads can share one of these and compress once.
+ */
+class StreamCache
+{
+public:
+  explicit StreamCache(const Image &image) : image_(image) {}
+
+  std::shared_ptr<const std::vector<uint8_t>> get(uint8_t first, uint8_t last);
+  size_t size();
+
+private:
+  const Image &image_;
+  std::mutex lock_;
+  std::map<std::pair<uint8_t, uint8_t>, std::shared_ptr<const std::vector<uint8_t>>> streams_;
+};
+
+struct UploadOptions
+{
+  Mode mode = Mode::lz;
+  unsigned window = 0;        /* commands in flight (up to 16), 0 for the mode's own default */
+  bool skip_unchanged = true; /* 'h' first, pages the device already has stay */
+  bool finalize = true;       /* 'f' at the end, so the image boots */
+  std::chrono::milliseconds timeout{5000};
+  std::function<void(const Progress &)> progress;
+  StreamCache *streams = nullptr; /* lz: of the same image, shared with other uploads */
+};
+
+/* What an upload does to the device, pages by number */
+struct Plan
+{
+  std::vector<uint8_t> erase;   /* blank in the image */
+  std::vector<uint8_t> write;
+  std::vector<uint8_t> skip;    /* already right */
+  std::vector<uint8_t> stream;  /* lz: what the compressed image covers */
+  uint32_t stream_bytes = 0;
+};
+
+struct DeviceInfo
+{
+  uint32_t config_id = 0;
+  uint64_t device_id = 0;
+};
+
+struct Result
+{
+  Plan plan;
+  SessionStats stats;
+  std::chrono::milliseconds elapsed{0};
+};
+
+/*
+ * One device, one upload
+ *
+ * Everything goes through a Session on the given transport. plan() asks
+ * the device for its page hashes and works out what has to change,
+ * upload() does that in the chosen mode and finalizes. The Image is only
+ * read, uploaders on other threads can share it.
+ */
+class Uploader
+{
+public:
+  explicit Uploader(Transport &transport, UploadOptions options = {});
+
+  DeviceInfo info();
+  std::vector<uint32_t> hashes(uint8_t first, uint8_t last);
+  Plan plan(const Image &image);
+  Result upload(const Image &image);
+
+  /* lz stream of pages first to last, what the 'z' packets carry */
+  static std::vector<uint8_t> compress(const Image &image, uint8_t first, uint8_t last);
+
+  Session &session() { return session_; }
+
+private:
+  void report(Phase phase, uint32_t done, uint32_t total);
+  unsigned window(unsigned fallback) const;
+  void set_flags(uint8_t flags, uint8_t window = 0);
+  void erase(const std::vector<uint8_t> &pages);
+  void write_plain(const Image &image, const std::vector<uint8_t> &pages);
+  void write_staged(const Image &image, const std::vector<uint8_t> &pages);
+  void write_windowed(const Image &image, const std::vector<uint8_t> &pages);
+  void write_lz(const Image &image, Plan &plan);
+  void finalize(const Image &image);
+  Command chunk(const Image &image, uint8_t page, uint8_t index, Timing timing);
+
+  Session session_;
+  UploadOptions options_;
+  uint32_t commits_ = 0;
+};
+
+} // namespace tinydfu
+
+#endif
@@ -0,0 +1,767 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sim.h"
+#include "encode.h"
+#include "ble_dfus.h"
+#include "crc32.h"
+#include "dfu_request.h"
+#include "nrf.h"
+#include "flash.h"
+#include "lz.h"
+#include "patch.h"
+#include "stage.h"
+#include "stream.h"
+#include "tx.h"
+
+/*
+ * DFU throughput benchmark
+ *
+ * Uploads a few representative images in every protocol mode the
+ * bootloader has, the way a straightforward host would, and reports what
+ * each took as JSON: virtual time, bytes per second, how often the host had
+ * to wait for the device, packets, flash work, host CPU time in the
+ * bootloader per packet and the RAM the mode needs.
+ *
+ * Every run is a fresh boot in a child of its own. Uploads are verified
+ * against the flash, a run that fails says so with "ok": false.
+ */
+
+bool steady_state_test = false; /* debug.h: print _debug_printf */
+
+#define IMAGE_SIZE     (64 * 1024)
+#define FIRST_PAGE     96
+#define APP_ADDR       (FIRST_PAGE * 1024)
+#define REGION_SIZE    (240 * 1024 - APP_ADDR)
+#define STAGED_WINDOW  8                      /* 'w' in flight in staged mode */
+#define STREAM_PAYLOAD (GATT_MTU_SIZE_DEFAULT - 4) /* per 'Z' / 'P' packet */
+#define RUN_TIMEOUT_US (600ULL * 1000000)
+
+typedef struct
+{
+  const uint8_t *image;
+  const uint8_t *old;        /* region contents before the upload */
+  uint32_t       len;
+  uint8_t        pages;
+  uint32_t       round_trips; /* waits for the device with nothing to send */
+  uint32_t       commits;     /* 'c' seen */
+  uint32_t       sent;        /* bytes the host wrote, headers included */
+  uint64_t       start;
+  bool           failed;
+} run_t;
+
+/*
+ * Images
+ */
+
+static uint32_t random_state;
+
+static uint32_t random_next(void)
+{
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+static void vectors(uint8_t *image)
+{
+  uint32_t table[2] = { 0x20004000, APP_ADDR + 0xC1 };
+  memcpy(image, table, sizeof(table));
+}
+
+/*
+ * Something like thumb code: a small set of halfwords, now and then a
+ * constant, and sequences that came up shortly before again
+ */
+static void code(uint8_t *out, uint32_t len)
+{
+  uint16_t ops[48];
+
+  for (uint8_t i = 0; i < 48; i++)
+  {
+    ops[i] = random_next();
+  }
+
+  for (uint32_t i = 0; i + 1 < len; )
+  {
+    if (i >= 512 && random_next() % 3 == 0)
+    {
+      uint32_t from = i - 2 * (1 + random_next() % 255);
+      uint32_t n = 2 * (2 + random_next() % 10);
+
+      for (uint32_t k = 0; k < n && i + 1 < len; k++, i++)
+      {
+        out[i] = out[from + k];
+      }
+      continue;
+    }
+
+    uint16_t op = (random_next() % 16) ? ops[random_next() % 48] : random_next();
+    out[i++] = op & 0xFF;
+    out[i++] = op >> 8;
+  }
+}
+
+/*
+ * Every run starts with some other application installed, the way a field
+ * update does, so pages have to be erased before they take the new image
+ */
+static void installed(uint8_t *old)
+{
+  random_state = 0x01D5EED5;
+  code(old, IMAGE_SIZE);
+  vectors(old);
+}
+
+static void image_full(uint8_t *old, uint8_t *image)
+{
+  for (uint32_t i = 0; i < IMAGE_SIZE; i++)
+  {
+    image[i] = random_next();
+  }
+  vectors(image);
+}
+
+/* Code up front, a table at the end, erased flash in between */
+static void image_sparse(uint8_t *old, uint8_t *image)
+{
+  memset(image, 0xFF, IMAGE_SIZE);
+  code(image, 12 * 1024);
+  code(image + IMAGE_SIZE - 4 * 1024, 4 * 1024);
+  vectors(image);
+}
+
+/* The installed image with a few fixes and a function grown by 40 bytes */
+static void image_mostly_unchanged(uint8_t *old, uint8_t *image)
+{
+  code(old, IMAGE_SIZE);
+  vectors(old);
+
+  uint32_t at = 20 * 1024;
+  memcpy(image, old, at);
+  for (uint32_t i = 0; i < 40; i++)
+  {
+    image[at + i] = random_next();
+  }
+  memcpy(image + at + 40, old + at, IMAGE_SIZE - at - 40);
+
+  for (uint8_t i = 0; i < 16; i++)
+  {
+    image[8 + random_next() % (IMAGE_SIZE - 8)] ^= 1 + random_next() % 255;
+  }
+}
+
+static void image_compressible(uint8_t *old, uint8_t *image)
+{
+  code(image, IMAGE_SIZE);
+  vectors(image);
+}
+
+typedef struct
+{
+  const char *name;
+  void      (*make)(uint8_t *old, uint8_t *image);
+} image_t;
+
+static const image_t images[] =
+{
+  { "full",             image_full             },
+  { "sparse",           image_sparse           },
+  { "mostly_unchanged", image_mostly_unchanged },
+  { "compressible",     image_compressible     },
+};
+
+/*
+ * RAM
+ *
+ * The static buffers the bootloader has, and which of them a mode needs.
+ * Sizes are the host's, with its wider pointers the flash queue comes out
+ * larger than on the chip. The stack comes on top, measured on the host it
+ * is only a guide to what the Cortex-M0 uses.
+ */
+
+#define RX_HOLD_SIZE 16 /* main.c */
+
+enum
+{
+  RAM_TX_RING     = 0x01,
+  RAM_RX_HOLD     = 0x02,
+  RAM_FLASH_QUEUE = 0x04,
+  RAM_STAGE       = 0x08,
+  RAM_STREAM_FIFO = 0x10,
+  RAM_DECODER     = 0x20,
+};
+
+static const char *const buffer_names[] =
+{
+  "tx_ring", "rx_hold", "flash_queue", "stage_slots", "stream_fifo", "decoder",
+};
+
+static uint32_t buffer_bytes(uint8_t index)
+{
+  switch (1 << index)
+  {
+    case RAM_TX_RING:
+      return TX_RING_SIZE * (1 + BLE_DFUS_MAX_DATA_LEN);
+    case RAM_RX_HOLD:
+      return RX_HOLD_SIZE * (1 + BLE_DFUS_MAX_DATA_LEN);
+    case RAM_FLASH_QUEUE:
+      return FLASH_QUEUE_SIZE * sizeof(flash_op_t);
+    case RAM_STAGE:
+      return stage_ram();
+    case RAM_STREAM_FIFO:
+      return STREAM_FIFO_SIZE;
+    case RAM_DECODER:
+      return sizeof(lz_t) > sizeof(patch_t) ? sizeof(lz_t) : sizeof(patch_t);
+  }
+  return 0;
+}
+
+static uint32_t static_ram(uint8_t buffers)
+{
+  uint32_t bytes = 0;
+
+  for (uint8_t i = 0; i < sizeof(buffer_names) / sizeof(buffer_names[0]); i++)
+  {
+    if (buffers & (1 << i))
+    {
+      bytes += buffer_bytes(i);
+    }
+  }
+  return bytes;
+}
+
+/*
+ * The host
+ */
+
+static void fail(run_t *run, const char *what)
+{
+  if (!run->failed)
+  {
+    fprintf(stderr, "%s\n", what);
+  }
+  run->failed = true;
+}
+
+static bool timed_out(run_t *run)
+{
+  if (sim_now() - run->start > RUN_TIMEOUT_US || sim_state() != SIM_RUNNING)
+  {
+    fail(run, "no answer");
+    return true;
+  }
+  return false;
+}
+
+static void put(run_t *run, uint16_t uuid, const uint8_t *cmd, uint16_t len)
+{
+  while (!sim_write_space() && !timed_out(run))
+  {
+    sim_step();
+  }
+
+  if (sim_write(uuid, cmd, len) != NRF_SUCCESS)
+  {
+    fail(run, "write refused");
+  }
+  run->sent += len;
+}
+
+/* Next reply, waiting for it if there is none yet. 0 on timeout */
+static uint16_t get(run_t *run, uint8_t *reply)
+{
+  uint16_t len = sim_notification(reply);
+
+  if (len)
+  {
+    return len;
+  }
+
+  run->round_trips++;
+  while (!run->failed && !timed_out(run))
+  {
+    sim_step();
+    len = sim_notification(reply);
+    if (len)
+    {
+      return len;
+    }
+  }
+  return 0;
+}
+
+/* Wait for one particular reply, counting commits on the way */
+static bool expect(run_t *run, char what, uint8_t *reply)
+{
+  while (!run->failed)
+  {
+    uint16_t len = get(run, reply);
+
+    if (len && reply[0] == what)
+    {
+      return true;
+    }
+
+    if (len && reply[0] == 'c')
+    {
+      run->commits++;
+    }
+    else if (len && reply[0] != 'Z' && reply[0] != 'P' && reply[0] != 'a')
+    {
+      reply[len < GATT_MTU_SIZE_DEFAULT ? len : GATT_MTU_SIZE_DEFAULT - 1] = 0;
+      fail(run, (const char *)reply);
+    }
+  }
+  return false;
+}
+
+static void session(run_t *run, uint8_t flags, uint8_t window)
+{
+  uint8_t cmd[3] = { 's', flags, window };
+  uint8_t reply[GATT_MTU_SIZE_DEFAULT];
+
+  put(run, BLE_UUID_DFUS_CTRL_CHAR, cmd, window ? 3 : 2);
+  expect(run, 's', reply);
+}
+
+static void chunk(run_t *run, uint16_t index)
+{
+  uint8_t cmd[19] = { 'w', FIRST_PAGE + index / 64, index % 64 };
+
+  memcpy(&cmd[3], &run->image[index * 16], 16);
+  put(run, BLE_UUID_DFUS_DATA_CHAR, cmd, sizeof(cmd));
+}
+
+static void all_committed(run_t *run)
+{
+  uint8_t reply[GATT_MTU_SIZE_DEFAULT];
+
+  while (!run->failed && run->commits < run->pages)
+  {
+    expect(run, 'c', reply);
+    run->commits++;
+  }
+}
+
+/* 'd' and 'w' one at a time, every one answered */
+static void mode_plain(run_t *run)
+{
+  uint8_t reply[GATT_MTU_SIZE_DEFAULT];
+
+  for (uint8_t page = 0; page < run->pages && !run->failed; page++)
+  {
+    uint8_t erase[2] = { 'd', FIRST_PAGE + page };
+    put(run, BLE_UUID_DFUS_CTRL_CHAR, erase, sizeof(erase));
+    expect(run, 'd', reply);
+
+    for (uint8_t i = 0; i < 64 && !run->failed; i++)
+    {
+      chunk(run, page * 64 + i);
+      expect(run, 'w', reply);
+    }
+  }
+}
+
+/* Staged with auto erase, STAGED_WINDOW chunks in flight, busy ones again */
+static void mode_staged(run_t *run)
+{
+  uint16_t total = run->pages * 64;
+  uint16_t next = 0;
+  uint16_t flight[STAGED_WINDOW];
+  uint8_t  flying = 0;
+  uint16_t again[STAGED_WINDOW];
+  uint8_t  retries = 0;
+  uint8_t  reply[GATT_MTU_SIZE_DEFAULT];
+
+  session(run, 0x09, 0);
+
+  while (!run->failed && (next < total || flying || retries))
+  {
+    while (flying < STAGED_WINDOW && (retries || next < total))
+    {
+      uint16_t index = retries ? again[--retries] : next++;
+      chunk(run, index);
+      flight[flying++] = index;
+    }
+
+    uint16_t len = get(run, reply);
+    if (!len)
+    {
+      break;
+    }
+
+    if (reply[0] == 'c')
+    {
+      run->commits++;
+      continue;
+    }
+
+    /* 'w' and "! stage busy" come back in the order the chunks went out */
+    if (reply[0] == '!' && len == 12 && !memcmp(reply, "! stage busy", 12))
+    {
+      again[retries++] = flight[0];
+    }
+    else if (reply[0] != 'w')
+    {
+      fail(run, "unexpected reply");
+      break;
+    }
+    memmove(flight, flight + 1, --flying * sizeof(flight[0]));
+  }
+
+  all_committed(run);
+}
+
+/* Windowed with auto erase, a page at a time, one bitmap each */
+static void mode_windowed(run_t *run)
+{
+  uint8_t reply[GATT_MTU_SIZE_DEFAULT];
+
+  session(run, 0x0A, 64);
+
+  for (uint8_t page = 0; page < run->pages && !run->failed; page++)
+  {
+    uint64_t have = 0;
+
+    for (uint8_t i = 0; i < 64; i++)
+    {
+      chunk(run, page * 64 + i);
+    }
+
+    while (!run->failed && have != UINT64_MAX)
+    {
+      if (!expect(run, 'a', reply) || reply[1] != FIRST_PAGE + page)
+      {
+        continue;
+      }
+
+      uint64_t bitmap = 0;
+      for (uint8_t i = 0; i < 8; i++)
+      {
+        bitmap |= (uint64_t)reply[2 + i] << (8 * i);
+      }
+      have |= bitmap;
+
+      if (have != UINT64_MAX)
+      {
+        for (uint8_t i = 0; i < 64; i++)
+        {
+          if (!(have & (1ULL << i)))
+          {
+            chunk(run, page * 64 + i);
+          }
+        }
+
+        uint8_t query[2] = { 'q', FIRST_PAGE + page };
+        put(run, BLE_UUID_DFUS_CTRL_CHAR, query, sizeof(query));
+      }
+    }
+  }
+
+  all_committed(run);
+}
+
+/* 'z' or 'p' stream, as far ahead as the device's credit allows */
+static void stream(run_t *run, char cmd, const uint8_t *data, size_t len)
+{
+  uint8_t  reply[GATT_MTU_SIZE_DEFAULT];
+  uint8_t  start[2] = { cmd, FIRST_PAGE };
+  uint32_t acked = 0;
+  uint32_t fifo;
+  size_t   sent = 0;
+
+  put(run, BLE_UUID_DFUS_CTRL_CHAR, start, sizeof(start));
+  if (!expect(run, cmd, reply))
+  {
+    return;
+  }
+  fifo = reply[4] | (reply[5] << 8);
+
+  while (!run->failed && sent < len)
+  {
+    size_t n = len - sent < STREAM_PAYLOAD ? len - sent : STREAM_PAYLOAD;
+
+    if (sent + n - acked <= fifo)
+    {
+      uint8_t packet[GATT_MTU_SIZE_DEFAULT];
+
+      packet[0] = cmd - 'a' + 'A';
+      memcpy(&packet[1], &data[sent], n);
+      put(run, BLE_UUID_DFUS_DATA_CHAR, packet, n + 1);
+      sent += n;
+      continue;
+    }
+
+    uint16_t got = get(run, reply);
+    if (got == 5 && reply[0] == cmd - 'a' + 'A')
+    {
+      memcpy(&acked, &reply[1], 4);
+    }
+    else if (got && reply[0] == 'c')
+    {
+      run->commits++;
+    }
+    else
+    {
+      fail(run, "unexpected reply");
+    }
+  }
+
+  uint8_t end[1] = { cmd };
+  put(run, BLE_UUID_DFUS_CTRL_CHAR, end, sizeof(end));
+  while (expect(run, cmd, reply) && reply[1] != 'E')
+  {
+  }
+
+  all_committed(run);
+}
+
+static void mode_lz(run_t *run)
+{
+  uint8_t *packed = malloc(ENCODE_MAX(run->len));
+  size_t   len = encode_lz(run->image, run->len, packed);
+
+  session(run, 0x08, 0);
+  stream(run, 'z', packed, len);
+  free(packed);
+}
+
+static void mode_patch(run_t *run)
+{
+  uint8_t *packed = malloc(ENCODE_MAX(run->len));
+  size_t   len = encode_patch(run->old, REGION_SIZE, run->image, run->len, packed);
+
+  stream(run, 'p', packed, len);
+  free(packed);
+}
+
+#define RAM_COMMON (RAM_TX_RING | RAM_RX_HOLD | RAM_FLASH_QUEUE)
+
+typedef struct
+{
+  const char *name;
+  void      (*run)(run_t *run);
+  uint8_t     ram; /* RAM_ buffers it needs */
+} protocol_t;
+
+static const protocol_t modes[] =
+{
+  { "plain",    mode_plain,    RAM_COMMON },
+  { "staged",   mode_staged,   RAM_COMMON | RAM_STAGE },
+  { "windowed", mode_windowed, RAM_COMMON | RAM_STAGE },
+  { "lz",       mode_lz,       RAM_COMMON | RAM_STAGE | RAM_STREAM_FIFO | RAM_DECODER },
+  { "patch",    mode_patch,    RAM_COMMON | RAM_STAGE | RAM_STREAM_FIFO | RAM_DECODER },
+};
+
+/* The record that lets the application start, retried while flash is busy */
+static void finalize(run_t *run)
+{
+  uint8_t  cmd[9] = { 'f' };
+  uint8_t  reply[GATT_MTU_SIZE_DEFAULT];
+  uint32_t crc = crc32(0, run->image, run->pages * 1024);
+
+  memcpy(&cmd[1], &run->len, 4);
+  memcpy(&cmd[5], &crc, 4);
+
+  while (!run->failed)
+  {
+    put(run, BLE_UUID_DFUS_CTRL_CHAR, cmd, sizeof(cmd));
+    uint16_t len = get(run, reply);
+
+    if (len == 3 && !memcmp(reply, "fOK", 3))
+    {
+      return;
+    }
+
+    if (len != 12 || memcmp(reply, "! flash busy", 12))
+    {
+      fail(run, "finalize failed");
+      return;
+    }
+    sim_run(SIM_FLASH_ERASE_US);
+  }
+}
+
+/*
+ * One run, in the child
+ */
+
+static void bench(int out, const char *flash_path, const image_t *image, const protocol_t *mode)
+{
+  uint8_t *old = malloc(REGION_SIZE);
+  uint8_t *data = malloc(IMAGE_SIZE);
+  run_t    run;
+
+  memset(&run, 0, sizeof(run));
+  memset(old, 0xFF, REGION_SIZE);
+  memset(data, 0xFF, IMAGE_SIZE);
+  installed(old);
+  random_state = 0x5EED1234;
+  image->make(old, data);
+
+  run.image = data;
+  run.old = old;
+  run.len = IMAGE_SIZE;
+  run.pages = (IMAGE_SIZE + 1023) / 1024;
+
+  if (!sim_flash_open(flash_path))
+  {
+    exit(1);
+  }
+  memcpy(sim_flash + APP_ADDR, old, REGION_SIZE);
+
+  NRF_POWER->GPREGRET = DFU_REQUEST_GPREGRET;
+  sim_boot();
+  sim_connect();
+  sim_subscribe(BLE_UUID_DFUS_CTRL_CHAR, true);
+  sim_settle();
+
+  sim_flash_stats_t flash_before = *sim_flash_stats();
+  uint64_t          cpu_before = sim_cpu_ns();
+
+  run.start = sim_now();
+  mode->run(&run);
+  finalize(&run);
+
+  bool ok = !run.failed && !memcmp(sim_flash + APP_ADDR, data, run.pages * 1024);
+  uint64_t time_us = sim_now() - run.start;
+  const sim_link_stats_t *link = sim_link_stats();
+  const sim_flash_stats_t *flash = sim_flash_stats();
+  uint32_t packets = link->up + link->down;
+
+  dprintf(out,
+      "    {\"image\": \"%s\", \"mode\": \"%s\", \"ok\": %s, \"bytes\": %u, \"sent_bytes\": %u, "
+      "\"time_us\": %llu, \"bytes_per_s\": %llu, \"round_trips\": %u, "
+      "\"packets_up\": %u, \"packets_down\": %u, \"connection_events\": %u, "
+      "\"flash_busy_us\": %llu, \"erases\": %u, \"words_written\": %u, "
+      "\"cpu_ns_per_packet\": %llu, \"static_ram_bytes\": %u, \"stack_peak_bytes\": %u, "
+      "\"ram_bytes\": %u}",
+      image->name, mode->name, ok ? "true" : "false", run.len, run.sent,
+      (unsigned long long)time_us,
+      (unsigned long long)(time_us ? (uint64_t)run.len * 1000000 / time_us : 0),
+      run.round_trips, link->up, link->down, link->events,
+      (unsigned long long)(flash->busy_us - flash_before.busy_us),
+      flash->erases - flash_before.erases, flash->words - flash_before.words,
+      (unsigned long long)(packets ? (sim_cpu_ns() - cpu_before) / packets : 0),
+      static_ram(mode->ram), sim_stack_peak(), static_ram(mode->ram) + sim_stack_peak());
+
+  exit(ok ? 0 : 1);
+}
+
+int main(int argc, char **argv)
+{
+  char        path[] = "/tmp/tinydfu_bench_XXXXXX";
+  const char *out_path = NULL;
+  int         failed = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "-v"))
+    {
+      steady_state_test = true;
+    }
+    else
+    {
+      out_path = argv[i];
+    }
+  }
+
+  FILE *out = out_path ? fopen(out_path, "w") : stdout;
+  if (!out)
+  {
+    perror(out_path);
+    return 1;
+  }
+
+  int fd = mkstemp(path);
+  if (fd < 0)
+  {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  fprintf(out, "{\n  \"link\": {\"interval_us\": %u, \"min_interval_us\": %u, "
+      "\"up_per_event\": %u, \"down_per_event\": %u, \"tx_buffers\": %u, "
+      "\"loss_permille\": %u, \"latency_us\": %u},\n",
+      sim_link.interval_us, sim_link.min_interval_us, sim_link.up_per_event,
+      sim_link.down_per_event, sim_link.tx_buffers, sim_link.loss_permille,
+      sim_link.latency_us);
+  fprintf(out, "  \"flash\": {\"erase_us\": %u, \"word_us\": %u, \"op_us\": %u},\n",
+      sim_flash_timing.erase_us, sim_flash_timing.word_us, sim_flash_timing.op_us);
+  fprintf(out, "  \"ram\": {");
+  for (uint8_t i = 0; i < sizeof(buffer_names) / sizeof(buffer_names[0]); i++)
+  {
+    fprintf(out, "%s\"%s\": %u", i ? ", " : "", buffer_names[i], buffer_bytes(i));
+  }
+  fprintf(out, "},\n");
+  fprintf(out, "  \"runs\": [\n");
+
+  bool first = true;
+  for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); i++)
+  {
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+      int result[2];
+
+      if (truncate(path, 0) || pipe(result))
+      {
+        perror("bench");
+        return 1;
+      }
+
+      fflush(stdout);
+      fflush(out);
+      pid_t pid = fork();
+      if (pid == 0)
+      {
+        close(result[0]);
+        bench(result[1], path, &images[i], &modes[m]);
+      }
+      close(result[1]);
+
+      char    record[1024];
+      ssize_t got = 0;
+      ssize_t n;
+      while ((n = read(result[0], record + got, sizeof(record) - 1 - got)) > 0)
+      {
+        got += n;
+      }
+      close(result[0]);
+      record[got] = 0;
+
+      int status = 1;
+      waitpid(pid, &status, 0);
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+      {
+        fprintf(stderr, "%s/%s failed\n", images[i].name, modes[m].name);
+        failed++;
+      }
+
+      if (got)
+      {
+        fprintf(out, "%s%s", first ? "" : ",\n", record);
+        first = false;
+      }
+    }
+  }
+
+  fprintf(out, "\n  ]\n}\n");
+  if (out != stdout)
+  {
+    fclose(out);
+  }
+  unlink(path);
+  return failed ? 1 : 0;
+}
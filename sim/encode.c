@@ -0,0 +1,220 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "encode.h"
+#include "lz.h"
+#include "patch.h"
+
+/*
+ * LZSS: the longest match in the window at every position, a literal if
+ * there is none of LZ_MIN_MATCH bytes.
+ */
+size_t encode_lz(const uint8_t *in, size_t len, uint8_t *out)
+{
+  size_t  o = 0;
+  size_t  flag_at = 0;
+  uint8_t items = 8;
+
+  for (size_t i = 0; i < len; )
+  {
+    if (items == 8)
+    {
+      flag_at = o++;
+      out[flag_at] = 0;
+      items = 0;
+    }
+
+    size_t best_len = 0;
+    size_t best_dist = 0;
+    size_t max = len - i < LZ_MAX_MATCH ? len - i : LZ_MAX_MATCH;
+
+    for (size_t dist = 1; dist <= LZ_WINDOW && dist <= i && best_len < max; dist++)
+    {
+      size_t n = 0;
+
+      /* overlapping is fine, the decoder copies byte by byte */
+      while (n < max && in[i + n - dist] == in[i + n])
+      {
+        n++;
+      }
+      if (n > best_len)
+      {
+        best_len = n;
+        best_dist = dist;
+      }
+    }
+
+    if (best_len >= LZ_MIN_MATCH)
+    {
+      uint16_t token = (best_dist - 1) | ((best_len - LZ_MIN_MATCH) << 10);
+
+      out[o++] = token & 0xFF;
+      out[o++] = token >> 8;
+      i += best_len;
+    }
+    else
+    {
+      out[flag_at] |= 1 << items;
+      out[o++] = in[i++];
+    }
+    items++;
+  }
+
+  return o;
+}
+
+/*
+ * Patch
+ *
+ * Copy along with the current shift while the old image agrees, otherwise
+ * look the next bytes up in the old image and move there if that gives a
+ * run worth the header, otherwise a literal. Sources behind the page
+ * before the one being built are gone on the device and never used.
+ */
+
+#define PATCH_MAX_COPY  16384
+#define PATCH_MAX_LIT   128
+#define PATCH_KEY       4
+#define PATCH_HASH      (1 << 16)
+#define PATCH_CHAIN     64  /* candidates looked at per lookup */
+#define PATCH_MIN_COPY  4   /* along the current shift */
+#define PATCH_MIN_MOVE  12  /* with a move first */
+
+typedef struct
+{
+  const uint8_t *old;
+  size_t         old_len;
+  const uint8_t *in;
+  size_t         len;
+  uint8_t       *out;
+  size_t         o;
+} patch_enc_t;
+
+static uint32_t patch_hash(const uint8_t *p)
+{
+  uint32_t key = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  return (key * 2654435761u) >> 16;
+}
+
+static size_t patch_run(const patch_enc_t *enc, size_t i, long shift)
+{
+  size_t n = 0;
+
+  while (i + n < enc->len && n < PATCH_MAX_COPY)
+  {
+    long src = (long)(i + n) + shift;
+
+    if (src < 0 || (size_t)src >= enc->old_len ||
+        src / PATCH_PAGE_SIZE < (long)((i + n) / PATCH_PAGE_SIZE) - 1 ||
+        enc->old[src] != enc->in[i + n])
+    {
+      break;
+    }
+    n++;
+  }
+  return n;
+}
+
+static void patch_literals(patch_enc_t *enc, size_t from, size_t to)
+{
+  while (from < to)
+  {
+    size_t n = to - from < PATCH_MAX_LIT ? to - from : PATCH_MAX_LIT;
+
+    enc->out[enc->o++] = n - 1;
+    memcpy(&enc->out[enc->o], &enc->in[from], n);
+    enc->o += n;
+    from += n;
+  }
+}
+
+static void patch_copy(patch_enc_t *enc, size_t n, bool move, int16_t delta)
+{
+  enc->out[enc->o++] = (move ? 0xC0 : 0x80) | ((n - 1) >> 8);
+  enc->out[enc->o++] = (n - 1) & 0xFF;
+  if (move)
+  {
+    enc->out[enc->o++] = (uint16_t)delta & 0xFF;
+    enc->out[enc->o++] = (uint16_t)delta >> 8;
+  }
+}
+
+size_t encode_patch(const uint8_t *old, size_t old_len, const uint8_t *in, size_t len,
+    uint8_t *out)
+{
+  patch_enc_t enc = { old, old_len, in, len, out, 0 };
+  int32_t *head = malloc(PATCH_HASH * sizeof(int32_t));
+  int32_t *prev = malloc((old_len + 1) * sizeof(int32_t));
+  long     shift = 0;
+  size_t   lit = 0;
+
+  memset(head, 0xFF, PATCH_HASH * sizeof(int32_t));
+  for (size_t p = 0; p + PATCH_KEY <= old_len; p++)
+  {
+    uint32_t h = patch_hash(&old[p]);
+    prev[p] = head[h];
+    head[h] = p;
+  }
+
+  for (size_t i = 0; i < len; )
+  {
+    size_t n = patch_run(&enc, i, shift);
+
+    if (n >= PATCH_MIN_COPY || (n && i + n == len))
+    {
+      patch_literals(&enc, lit, i);
+      patch_copy(&enc, n, false, 0);
+      i += n;
+      lit = i;
+      continue;
+    }
+
+    size_t best = 0;
+    long   best_shift = 0;
+
+    if (i + PATCH_KEY <= len)
+    {
+      int32_t cand = head[patch_hash(&in[i])];
+
+      for (uint8_t tries = 0; cand >= 0 && tries < PATCH_CHAIN; tries++, cand = prev[cand])
+      {
+        long s = (long)cand - (long)i;
+
+        if (s - shift < INT16_MIN || s - shift > INT16_MAX)
+        {
+          continue;
+        }
+
+        size_t run = patch_run(&enc, i, s);
+        if (run > best)
+        {
+          best = run;
+          best_shift = s;
+        }
+      }
+    }
+
+    if (best >= PATCH_MIN_MOVE)
+    {
+      patch_literals(&enc, lit, i);
+      patch_copy(&enc, best, true, best_shift - shift);
+      shift = best_shift;
+      i += best;
+      lit = i;
+      continue;
+    }
+
+    i++;
+  }
+  patch_literals(&enc, lit, len);
+
+  free(head);
+  free(prev);
+  return enc.o;
+}
@@ -0,0 +1,33 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#ifndef _encode_h
+#define _encode_h
+
+/*
+ * Host side of the 'z' and 'p' streams
+ *
+ * Encoders for the formats in lz.h and patch.h, so the simulator can feed
+ * the bootloader what a real uploader would. Greedy, not the best ratio
+ * there is, but every stream they make decodes.
+ */
+
+/* Room out needs for len bytes of input, either encoder */
+#define ENCODE_MAX(len) ((len) + (len) / 8 + 16)
+
+size_t encode_lz(const uint8_t *in, size_t len, uint8_t *out);
+
+/*
+ * old is the application region as it is now, from the first page of the
+ * patch on; in is the image that is to replace it from the same page.
+ */
+size_t encode_patch(const uint8_t *old, size_t old_len, const uint8_t *in, size_t len,
+    uint8_t *out);
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/* Host simulator stand-in for the SDK header of the same name */
+#ifndef APP_SCHEDULER_H__
+#define APP_SCHEDULER_H__
+#include <stdint.h>
+#include "app_error.h"
+#include "app_util.h"
+#define APP_SCHED_EVENT_HEADER_SIZE 8
+#define APP_SCHED_BUF_SIZE(EVENT_SIZE, QUEUE_SIZE) (((EVENT_SIZE) + APP_SCHED_EVENT_HEADER_SIZE) * ((QUEUE_SIZE) + 1))
+typedef void (*app_sched_event_handler_t)(void * p_event_data, uint16_t event_size);
+#define APP_SCHED_INIT(EVENT_SIZE, QUEUE_SIZE) \
+  do \
+  { \
+    static uint32_t APP_SCHED_BUF[CEIL_DIV(APP_SCHED_BUF_SIZE((EVENT_SIZE), (QUEUE_SIZE)), sizeof(uint32_t))]; \
+    uint32_t ERR_CODE = app_sched_init((EVENT_SIZE), (QUEUE_SIZE), APP_SCHED_BUF); \
+    APP_ERROR_CHECK(ERR_CODE); \
+  } while (0)
+uint32_t app_sched_init(uint16_t max_event_size, uint16_t queue_size, void * p_evt_buffer);
+void app_sched_execute(void);
+uint32_t app_sched_event_put(void * p_event_data, uint16_t event_size, app_sched_event_handler_t handler);
+#endif
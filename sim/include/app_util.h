@@ -0,0 +1,17 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/* Host simulator stand-in for the SDK header of the same name */
+#ifndef APP_UTIL_H__
+#define APP_UTIL_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include "nordic_common.h"
+#define CEIL_DIV(A, B) (((A) + (B) - 1) / (B))
+#define ALIGN_NUM(alignment, number) ((number - 1) + alignment - ((number - 1) % alignment))
+#define STATIC_ASSERT(EXPR) typedef char static_assert_failed[(EXPR) ? 1 : -1]
+#endif
@@ -0,0 +1,76 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/* Host simulator stand-in for the SDK header of the same name */
+#ifndef BLE_H__
+#define BLE_H__
+#include <stdint.h>
+#include <string.h>
+#include "ble_types.h"
+#include "ble_gap.h"
+#include "ble_gatt.h"
+#include "ble_gatts.h"
+#include "nrf_error.h"
+
+#define BLE_ERROR_NOT_ENABLED            (NRF_ERROR_STK_BASE_NUM+0x001)
+#define BLE_ERROR_INVALID_CONN_HANDLE    (NRF_ERROR_STK_BASE_NUM+0x002)
+#define BLE_ERROR_INVALID_ATTR_HANDLE    (NRF_ERROR_STK_BASE_NUM+0x003)
+#define BLE_ERROR_NO_TX_BUFFERS          (NRF_ERROR_STK_BASE_NUM+0x004)
+#define BLE_ERROR_INVALID_ROLE           (NRF_ERROR_STK_BASE_NUM+0x005)
+#define BLE_ERROR_GATTS_SYS_ATTR_MISSING (NRF_ERROR_STK_BASE_NUM+0x401)
+
+enum BLE_COMMON_EVTS
+{
+  BLE_EVT_TX_COMPLETE = 0x01,
+  BLE_EVT_USER_MEM_REQUEST,
+  BLE_EVT_USER_MEM_RELEASE,
+};
+
+typedef struct
+{
+  uint8_t count;
+} ble_evt_tx_complete_t;
+
+typedef struct
+{
+  uint16_t conn_handle;
+  union
+  {
+    ble_evt_tx_complete_t tx_complete;
+  } params;
+} ble_common_evt_t;
+
+typedef struct
+{
+  uint16_t evt_id;
+  uint16_t evt_len;
+} ble_evt_hdr_t;
+
+typedef struct
+{
+  ble_evt_hdr_t header;
+  union
+  {
+    ble_common_evt_t common_evt;
+    ble_gap_evt_t    gap_evt;
+    ble_gatts_evt_t  gatts_evt;
+  } evt;
+} ble_evt_t;
+
+typedef struct
+{
+  struct
+  {
+    uint8_t service_changed : 1;
+    uint32_t attr_tab_size;
+  } gatts_enable_params;
+} ble_enable_params_t;
+
+uint32_t sd_ble_enable(ble_enable_params_t * p_ble_enable_params);
+uint32_t sd_ble_uuid_vs_add(ble_uuid128_t const * p_vs_uuid, uint8_t * p_uuid_type);
+uint32_t sd_ble_tx_buffer_count_get(uint8_t * p_count);
+#endif
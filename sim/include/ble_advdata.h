@@ -0,0 +1,28 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/* Host simulator stand-in for the SDK header of the same name */
+#ifndef BLE_ADVDATA_H__
+#define BLE_ADVDATA_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ble.h"
+#include "app_util.h"
+typedef enum { BLE_ADVDATA_NO_NAME, BLE_ADVDATA_SHORT_NAME, BLE_ADVDATA_FULL_NAME } ble_advdata_name_type_t;
+typedef struct { uint16_t uuid_cnt; ble_uuid_t * p_uuids; } ble_advdata_uuid_list_t;
+typedef struct
+{
+  ble_advdata_name_type_t name_type;
+  uint8_t                 short_name_len;
+  bool                    include_appearance;
+  uint8_t                 flags;
+  ble_advdata_uuid_list_t uuids_more_available;
+  ble_advdata_uuid_list_t uuids_complete;
+  ble_advdata_uuid_list_t uuids_solicited;
+} ble_advdata_t;
+#endif
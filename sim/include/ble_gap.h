@@ -0,0 +1,102 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/* Host simulator stand-in for the SDK header of the same name */
+#ifndef BLE_GAP_H__
+#define BLE_GAP_H__
+#include <stdint.h>
+#include "ble_types.h"
+#include "nrf_error.h"
+
+enum BLE_GAP_EVTS
+{
+  BLE_GAP_EVT_CONNECTED = 0x10,
+  BLE_GAP_EVT_DISCONNECTED,
+  BLE_GAP_EVT_CONN_PARAM_UPDATE,
+  BLE_GAP_EVT_SEC_PARAMS_REQUEST,
+  BLE_GAP_EVT_SEC_INFO_REQUEST,
+  BLE_GAP_EVT_PASSKEY_DISPLAY,
+  BLE_GAP_EVT_AUTH_KEY_REQUEST,
+  BLE_GAP_EVT_AUTH_STATUS,
+  BLE_GAP_EVT_CONN_SEC_UPDATE,
+  BLE_GAP_EVT_TIMEOUT,
+  BLE_GAP_EVT_RSSI_CHANGED,
+  BLE_GAP_EVT_ADV_REPORT,
+  BLE_GAP_EVT_SEC_REQUEST,
+  BLE_GAP_EVT_CONN_PARAM_UPDATE_REQUEST,
+  BLE_GAP_EVT_SCAN_REQ_REPORT,
+};
+
+#define BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP 0x85
+#define BLE_GAP_ADV_FLAGS_LE_ONLY_LIMITED_DISC_MODE 0x05
+#define BLE_GAP_CP_MIN_CONN_INTVL_MIN 0x0006
+#define BLE_GAP_CP_MAX_CONN_INTVL_MAX 0x0C80
+
+typedef struct
+{
+  uint8_t sm : 4;
+  uint8_t lv : 4;
+} ble_gap_conn_sec_mode_t;
+
+#define BLE_GAP_CONN_SEC_MODE_SET_OPEN(ptr) do {(ptr)->sm = 1; (ptr)->lv = 1;} while(0)
+
+typedef struct
+{
+  uint16_t min_conn_interval;
+  uint16_t max_conn_interval;
+  uint16_t slave_latency;
+  uint16_t conn_sup_timeout;
+} ble_gap_conn_params_t;
+
+typedef struct
+{
+  uint8_t addr_type;
+  uint8_t addr[6];
+} ble_gap_addr_t;
+
+typedef struct
+{
+  ble_gap_addr_t        peer_addr;
+  ble_gap_addr_t        own_addr;
+  uint8_t               irk_match :1;
+  uint8_t               irk_match_idx  :7;
+  ble_gap_conn_params_t conn_params;
+} ble_gap_evt_connected_t;
+
+typedef struct
+{
+  uint8_t reason;
+} ble_gap_evt_disconnected_t;
+
+typedef struct
+{
+  ble_gap_conn_params_t conn_params;
+} ble_gap_evt_conn_param_update_t;
+
+typedef struct
+{
+  uint8_t src;
+} ble_gap_evt_timeout_t;
+
+typedef struct
+{
+  uint16_t conn_handle;
+  union
+  {
+    ble_gap_evt_connected_t         connected;
+    ble_gap_evt_disconnected_t      disconnected;
+    ble_gap_evt_conn_param_update_t conn_param_update;
+    ble_gap_evt_timeout_t           timeout;
+  } params;
+} ble_gap_evt_t;
+
+uint32_t sd_ble_gap_device_name_set(ble_gap_conn_sec_mode_t const * p_write_perm, uint8_t const * p_dev_name, uint16_t len);
+uint32_t sd_ble_gap_ppcp_set(ble_gap_conn_params_t const * p_conn_params);
+uint32_t sd_ble_gap_conn_param_update(uint16_t conn_handle, ble_gap_conn_params_t const * p_conn_params);
+uint32_t sd_ble_gap_disconnect(uint16_t conn_handle, uint8_t hci_status_code);
+uint32_t sd_ble_gap_sec_params_reply(uint16_t conn_handle, uint8_t sec_status, void const * p_sec_params, void const * p_sec_keyset);
+#endif
@@ -0,0 +1,32 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/* Host simulator stand-in for the SDK header of the same name */
+#ifndef BLE_GATT_H__
+#define BLE_GATT_H__
+#include <stdint.h>
+#define GATT_MTU_SIZE_DEFAULT 23
+#define BLE_GATT_HANDLE_INVALID 0x0000
+#define BLE_GATT_HVX_INVALID      0x00
+#define BLE_GATT_HVX_NOTIFICATION 0x01
+#define BLE_GATT_HVX_INDICATION   0x02
+typedef struct
+{
+  uint8_t broadcast       :1;
+  uint8_t read            :1;
+  uint8_t write_wo_resp   :1;
+  uint8_t write           :1;
+  uint8_t notify          :1;
+  uint8_t indicate        :1;
+  uint8_t auth_signed_wr  :1;
+} ble_gatt_char_props_t;
+typedef struct
+{
+  uint8_t reliable_wr     :1;
+  uint8_t wr_aux          :1;
+} ble_gatt_char_ext_props_t;
+#endif
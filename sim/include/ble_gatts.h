@@ -0,0 +1,131 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/* Host simulator stand-in for the SDK header of the same name */
+#ifndef BLE_GATTS_H__
+#define BLE_GATTS_H__
+#include <stdint.h>
+#include "ble_types.h"
+#include "ble_gatt.h"
+#include "ble_gap.h"
+
+#define BLE_GATTS_SRVC_TYPE_INVALID   0x00
+#define BLE_GATTS_SRVC_TYPE_PRIMARY   0x01
+#define BLE_GATTS_SRVC_TYPE_SECONDARY 0x02
+
+#define BLE_GATTS_VLOC_INVALID 0x00
+#define BLE_GATTS_VLOC_STACK   0x01
+#define BLE_GATTS_VLOC_USER    0x02
+
+#define BLE_GATTS_OP_INVALID           0x00
+#define BLE_GATTS_OP_WRITE_REQ         0x01
+#define BLE_GATTS_OP_WRITE_CMD         0x02
+#define BLE_GATTS_OP_SIGN_WRITE_CMD    0x03
+#define BLE_GATTS_OP_PREP_WRITE_REQ    0x04
+#define BLE_GATTS_OP_EXEC_WRITE_REQ_CANCEL 0x05
+#define BLE_GATTS_OP_EXEC_WRITE_REQ_NOW    0x06
+
+enum BLE_GATTS_EVTS
+{
+  BLE_GATTS_EVT_WRITE = 0x50,
+  BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST,
+  BLE_GATTS_EVT_SYS_ATTR_MISSING,
+  BLE_GATTS_EVT_HVC,
+  BLE_GATTS_EVT_SC_CONFIRM,
+  BLE_GATTS_EVT_TIMEOUT,
+};
+
+typedef struct
+{
+  ble_gap_conn_sec_mode_t read_perm;
+  ble_gap_conn_sec_mode_t write_perm;
+  uint8_t                 vlen       :1;
+  uint8_t                 vloc       :2;
+  uint8_t                 rd_auth    :1;
+  uint8_t                 wr_auth    :1;
+} ble_gatts_attr_md_t;
+
+typedef struct
+{
+  ble_uuid_t          *p_uuid;
+  ble_gatts_attr_md_t *p_attr_md;
+  uint16_t             init_len;
+  uint16_t             init_offs;
+  uint16_t             max_len;
+  uint8_t             *p_value;
+} ble_gatts_attr_t;
+
+typedef struct
+{
+  ble_gatt_char_props_t       char_props;
+  ble_gatt_char_ext_props_t   char_ext_props;
+  uint8_t                    *p_char_user_desc;
+  uint16_t                    char_user_desc_max_size;
+  uint16_t                    char_user_desc_size;
+  void                       *p_char_pf;
+  ble_gatts_attr_md_t        *p_user_desc_md;
+  ble_gatts_attr_md_t        *p_cccd_md;
+  ble_gatts_attr_md_t        *p_sccd_md;
+} ble_gatts_char_md_t;
+
+typedef struct
+{
+  uint16_t value_handle;
+  uint16_t user_desc_handle;
+  uint16_t cccd_handle;
+  uint16_t sccd_handle;
+} ble_gatts_char_handles_t;
+
+typedef struct
+{
+  uint16_t          handle;
+  uint8_t           type;
+  uint16_t          offset;
+  uint16_t         *p_len;
+  uint8_t const    *p_data;
+} ble_gatts_hvx_params_t;
+
+typedef struct
+{
+  ble_uuid_t                  srvc_uuid;
+  ble_uuid_t                  char_uuid;
+  ble_uuid_t                  desc_uuid;
+  uint16_t                    srvc_handle;
+  uint16_t                    value_handle;
+  uint8_t                     type;
+} ble_gatts_attr_context_t;
+
+typedef struct
+{
+  uint16_t                    handle;
+  uint8_t                     op;
+  ble_gatts_attr_context_t    context;
+  uint16_t                    offset;
+  uint16_t                    len;
+  uint8_t                     data[1];
+} ble_gatts_evt_write_t;
+
+typedef struct
+{
+  uint8_t hint;
+} ble_gatts_evt_sys_attr_missing_t;
+
+typedef struct
+{
+  uint16_t conn_handle;
+  union
+  {
+    ble_gatts_evt_write_t            write;
+    ble_gatts_evt_sys_attr_missing_t sys_attr_missing;
+  } params;
+} ble_gatts_evt_t;
+
+uint32_t sd_ble_gatts_service_add(uint8_t type, ble_uuid_t const * p_uuid, uint16_t * p_handle);
+uint32_t sd_ble_gatts_characteristic_add(uint16_t service_handle, ble_gatts_char_md_t const * p_char_md, ble_gatts_attr_t const * p_attr_char_value, ble_gatts_char_handles_t * p_handles);
+uint32_t sd_ble_gatts_hvx(uint16_t conn_handle, ble_gatts_hvx_params_t const * p_hvx_params);
+uint32_t sd_ble_gatts_sys_attr_set(uint16_t conn_handle, uint8_t const * p_sys_attr_data, uint16_t len, uint32_t flags);
+#endif
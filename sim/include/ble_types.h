@@ -0,0 +1,25 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/* Host simulator stand-in for the SDK header of the same name */
+#ifndef BLE_TYPES_H__
+#define BLE_TYPES_H__
+#include <stdint.h>
+#define BLE_CONN_HANDLE_INVALID 0xFFFF
+#define BLE_UUID_TYPE_UNKNOWN       0x00
+#define BLE_UUID_TYPE_BLE           0x01
+#define BLE_UUID_TYPE_VENDOR_BEGIN  0x02
+typedef struct
+{
+  uint8_t uuid128[16];
+} ble_uuid128_t;
+typedef struct
+{
+  uint16_t uuid;
+  uint8_t  type;
+} ble_uuid_t;
+#endif
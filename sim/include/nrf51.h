@@ -0,0 +1,40 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/*
+ * Host simulator: the real register layout from include/nrf51.h, but the
+ * peripherals the bootloader touches outside hw.c live in ordinary memory
+ * (sim/softdevice.c) instead of at their bus addresses.
+ */
+#include_next "nrf51.h"
+#ifndef _sim_nrf51_h
+#define _sim_nrf51_h
+
+extern NRF_POWER_Type  sim_power;
+extern NRF_CLOCK_Type  sim_clock;
+extern NRF_NVMC_Type   sim_nvmc;
+extern NRF_FICR_Type   sim_ficr;
+extern NRF_UICR_Type   sim_uicr;
+extern NRF_GPIO_Type   sim_gpio;
+extern NRF_GPIOTE_Type sim_gpiote;
+
+#undef NRF_POWER
+#undef NRF_CLOCK
+#undef NRF_NVMC
+#undef NRF_FICR
+#undef NRF_UICR
+#undef NRF_GPIO
+#undef NRF_GPIOTE
+#define NRF_POWER  (&sim_power)
+#define NRF_CLOCK  (&sim_clock)
+#define NRF_NVMC   (&sim_nvmc)
+#define NRF_FICR   (&sim_ficr)
+#define NRF_UICR   (&sim_uicr)
+#define NRF_GPIO   (&sim_gpio)
+#define NRF_GPIOTE (&sim_gpiote)
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/* Host simulator stand-in for the SDK header of the same name */
+#ifndef NRF_MBR_H__
+#define NRF_MBR_H__
+#include <stdint.h>
+#include "nrf_error.h"
+enum NRF_MBR_COMMANDS
+{
+  SD_MBR_COMMAND_COPY_BL,
+  SD_MBR_COMMAND_COPY_SD,
+  SD_MBR_COMMAND_INIT_SD,
+  SD_MBR_COMMAND_COMPARE,
+  SD_MBR_COMMAND_VECTOR_TABLE_BASE_SET,
+};
+typedef struct
+{
+  uint32_t command;
+  uint32_t params[3];
+} sd_mbr_command_t;
+uint32_t sd_mbr_command(sd_mbr_command_t * param);
+#endif
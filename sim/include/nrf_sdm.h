@@ -0,0 +1,32 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/* Host simulator stand-in for the SDK header of the same name */
+#ifndef NRF_SDM_H__
+#define NRF_SDM_H__
+#include <stdint.h>
+#include "nrf_error.h"
+typedef enum
+{
+  NRF_CLOCK_LFCLKSRC_SYNTH_250_PPM,
+  NRF_CLOCK_LFCLKSRC_XTAL_500_PPM,
+  NRF_CLOCK_LFCLKSRC_XTAL_250_PPM,
+  NRF_CLOCK_LFCLKSRC_XTAL_150_PPM,
+  NRF_CLOCK_LFCLKSRC_XTAL_100_PPM,
+  NRF_CLOCK_LFCLKSRC_XTAL_75_PPM,
+  NRF_CLOCK_LFCLKSRC_XTAL_50_PPM,
+  NRF_CLOCK_LFCLKSRC_XTAL_30_PPM,
+  NRF_CLOCK_LFCLKSRC_XTAL_20_PPM,
+  NRF_CLOCK_LFCLKSRC_RC_250_PPM_250MS_CALIBRATION,
+  NRF_CLOCK_LFCLKSRC_RC_250_PPM_500MS_CALIBRATION,
+  NRF_CLOCK_LFCLKSRC_RC_250_PPM_1000MS_CALIBRATION,
+  NRF_CLOCK_LFCLKSRC_RC_250_PPM_2000MS_CALIBRATION,
+  NRF_CLOCK_LFCLKSRC_RC_250_PPM_4000MS_CALIBRATION,
+  NRF_CLOCK_LFCLKSRC_RC_250_PPM_8000MS_CALIBRATION,
+} nrf_clock_lfclksrc_t;
+uint32_t sd_softdevice_vector_table_base_set(uint32_t address);
+#endif
@@ -0,0 +1,53 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/* Host simulator stand-in for the SDK header of the same name */
+#ifndef NRF_SOC_H__
+#define NRF_SOC_H__
+#include <stdint.h>
+#include "nrf_error.h"
+#include "nrf.h"
+
+enum NRF_SOC_EVTS
+{
+  NRF_EVT_HFCLKSTARTED,
+  NRF_EVT_POWER_FAILURE_WARNING,
+  NRF_EVT_FLASH_OPERATION_SUCCESS,
+  NRF_EVT_FLASH_OPERATION_ERROR,
+  NRF_EVT_RADIO_BLOCKED,
+  NRF_EVT_RADIO_CANCELED,
+  NRF_EVT_RADIO_SIGNAL_CALLBACK_INVALID_RETURN,
+  NRF_EVT_RADIO_SESSION_IDLE,
+  NRF_EVT_RADIO_SESSION_CLOSED,
+  NRF_EVT_NUMBER_OF_EVTS
+};
+
+typedef enum
+{
+  NRF_APP_PRIORITY_HIGH = 1,
+  NRF_APP_PRIORITY_LOW = 3
+} nrf_app_irq_priority_t;
+
+typedef enum
+{
+  NRF_RADIO_NOTIFICATION_DISTANCE_NONE = 0,
+  NRF_RADIO_NOTIFICATION_DISTANCE_800US,
+  NRF_RADIO_NOTIFICATION_DISTANCE_1740US,
+  NRF_RADIO_NOTIFICATION_DISTANCE_2680US,
+  NRF_RADIO_NOTIFICATION_DISTANCE_3620US,
+  NRF_RADIO_NOTIFICATION_DISTANCE_4560US,
+  NRF_RADIO_NOTIFICATION_DISTANCE_5500US
+} nrf_radio_notification_distance_t;
+
+uint32_t sd_flash_write(uint32_t * const p_dst, uint32_t const * const p_src, uint32_t size);
+uint32_t sd_flash_page_erase(uint32_t page_number);
+uint32_t sd_app_evt_wait(void);
+uint32_t sd_evt_get(uint32_t * p_evt_id);
+uint32_t sd_power_gpregret_get(uint32_t * p_gpregret);
+uint32_t sd_power_gpregret_set(uint32_t gpregret_msk);
+uint32_t sd_power_gpregret_clr(uint32_t gpregret_msk);
+#endif
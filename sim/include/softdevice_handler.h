@@ -0,0 +1,31 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+/* Host simulator stand-in for the SDK header of the same name */
+#ifndef SOFTDEVICE_HANDLER_H__
+#define SOFTDEVICE_HANDLER_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include "nrf_sdm.h"
+#include "nrf_soc.h"
+#include "app_error.h"
+#include "app_util.h"
+#include "ble.h"
+#define BLE_STACK_HANDLER_SCHED_EVT_SIZE 0
+typedef uint32_t (*softdevice_evt_schedule_func_t)(void);
+typedef void (*ble_evt_handler_t)(ble_evt_t * p_ble_evt);
+typedef void (*sys_evt_handler_t)(uint32_t evt_id);
+#define SOFTDEVICE_HANDLER_INIT(CLOCK_SOURCE, EVT_HANDLER) \
+  do \
+  { \
+    uint32_t ERR_CODE = softdevice_handler_init((CLOCK_SOURCE), NULL, 0, EVT_HANDLER); \
+    APP_ERROR_CHECK(ERR_CODE); \
+  } while (0)
+uint32_t softdevice_handler_init(nrf_clock_lfclksrc_t clock_source, void * p_ble_evt_buffer, uint16_t ble_evt_buffer_size, softdevice_evt_schedule_func_t evt_schedule_func);
+uint32_t softdevice_ble_evt_handler_set(ble_evt_handler_t ble_evt_handler);
+uint32_t softdevice_sys_evt_handler_set(sys_evt_handler_t sys_evt_handler);
+#endif
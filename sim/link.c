@@ -0,0 +1,399 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "sim.h"
+#include "debug.h"
+
+/*
+ * The air between the central and the softdevice
+ *
+ * Packets only move in connection events, one every interval. In each the
+ * central and the peripheral take turns, a packet (or an empty one) each,
+ * 150 us apart, for as long as either has something left and its per event
+ * limit allows. A lost packet ends the event and goes again in the next.
+ * Writes the softdevice has no room for are not acknowledged either, they
+ * wait while the application is behind, e.g. stopped by an erase.
+ *
+ * The peripheral sleeps through up to slave latency events while it has
+ * nothing to send, the central's writes wait meanwhile. Before every event
+ * it attends the radio notification says so, after it says it is over and
+ * the buffers the notifications took come back with TX_COMPLETE.
+ *
+ * Connection parameter updates take LINK_UPDATE_EVENTS to come into force.
+ * The central picks the shortest interval asked for that it allows, or
+ * ignores the request if it allows none.
+ */
+
+#define LINK_QUEUE         256
+#define LINK_TX_MAX        16
+#define LINK_IFS_US        150
+#define LINK_EMPTY_US      80                           /* preamble, address, header, crc */
+#define LINK_ATT_BYTES     7                            /* l2cap and att headers */
+#define LINK_PACKET_MAX_US (LINK_EMPTY_US + 8 * (LINK_ATT_BYTES + GATT_MTU_SIZE_DEFAULT - 3))
+#define LINK_UPDATE_EVENTS 8                            /* l2cap request, response, instant */
+#define LINK_UNIT_US       1250                         /* connection interval unit */
+
+sim_link_t sim_link =
+{
+  .interval_us     = SIM_LINK_INTERVAL_US,
+  .min_interval_us = SIM_LINK_MIN_INTERVAL_US,
+  .up_per_event    = SIM_LINK_PER_EVENT,
+  .down_per_event  = SIM_LINK_PER_EVENT,
+  .tx_buffers      = SIM_LINK_TX_BUFFERS,
+  .loss_permille   = 0,
+  .latency_us      = 0,
+  .seed            = 1,
+};
+
+typedef struct
+{
+  uint16_t handle;
+  uint8_t  len;
+  uint8_t  data[GATT_MTU_SIZE_DEFAULT];
+  uint64_t ready; /* when the central's stack has it */
+} link_packet_t;
+
+typedef enum
+{
+  LINK_NOTIFY, /* radio notification distance before the event */
+  LINK_EVENT,  /* the packets */
+  LINK_END,    /* radio off, buffers back */
+} link_phase_t;
+
+static sim_link_stats_t link_stats;
+static bool             connected = false;
+static uint32_t         interval = 0;   /* us */
+static uint16_t         latency = 0;    /* slave latency */
+static uint16_t         slept = 0;      /* events slept through in a row */
+static uint64_t         anchor = 0;     /* start of the next event */
+static link_phase_t     phase;
+static sim_event_t      tick;
+static uint32_t         random_state;
+
+static link_packet_t up[LINK_QUEUE];   /* central's writes */
+static uint16_t      up_head = 0;
+static uint16_t      up_count = 0;
+static link_packet_t down[LINK_TX_MAX]; /* notifications in softdevice buffers */
+static uint8_t       down_head = 0;
+static uint8_t       down_count = 0;
+static uint8_t       down_sent = 0;     /* in the event going on */
+
+static bool                  update_pending = false;
+static uint16_t              update_in = 0; /* events to the instant */
+static ble_gap_conn_params_t update;
+
+static void link_tick(void *context);
+
+static uint8_t tx_buffers(void)
+{
+  return sim_link.tx_buffers > LINK_TX_MAX ? LINK_TX_MAX : sim_link.tx_buffers;
+}
+
+/* xorshift32, so a seed always loses the same packets */
+static bool link_lost(void)
+{
+  if (!sim_link.loss_permille)
+  {
+    return false;
+  }
+
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  if (random_state % 1000 < sim_link.loss_permille)
+  {
+    link_stats.lost++;
+    return true;
+  }
+  return false;
+}
+
+static bool up_ready(uint64_t at)
+{
+  return up_count && up[up_head].ready <= at;
+}
+
+/* Settling waits for packets, not for idle connection events */
+static void link_schedule(uint64_t at, link_phase_t next)
+{
+  phase = next;
+  sim_at(&tick, at, link_tick, NULL);
+  tick.quiet = !up_count && !down_count && !update_pending && !(next == LINK_END && down_sent);
+}
+
+static void link_deliver_up(const link_packet_t *packet)
+{
+  union
+  {
+    ble_evt_t evt;
+    uint8_t   raw[sizeof(ble_evt_t) + GATT_MTU_SIZE_DEFAULT];
+  } buf;
+
+  memset(&buf, 0, sizeof(buf));
+  buf.evt.header.evt_id = BLE_GATTS_EVT_WRITE;
+  buf.evt.header.evt_len = sizeof(ble_gatts_evt_t) + packet->len;
+  buf.evt.evt.gatts_evt.conn_handle = 0;
+  buf.evt.evt.gatts_evt.params.write.handle = packet->handle;
+  buf.evt.evt.gatts_evt.params.write.op = BLE_GATTS_OP_WRITE_CMD;
+  buf.evt.evt.gatts_evt.params.write.len = packet->len;
+  memcpy(buf.evt.evt.gatts_evt.params.write.data, packet->data, packet->len);
+
+  sd_post_ble(&buf.evt, sizeof(ble_evt_t) + packet->len);
+}
+
+/* One connection event, worked off at its anchor */
+static uint64_t link_exchange(void)
+{
+  uint64_t t = anchor;
+  uint8_t  up_sent = 0;
+
+  down_sent = 0;
+  while (t + 2 * (LINK_PACKET_MAX_US + LINK_IFS_US) <= anchor + interval)
+  {
+    /* central */
+    if (up_ready(t) && up_sent < sim_link.up_per_event && sd_write_room())
+    {
+      const link_packet_t *packet = &up[up_head];
+
+      t += LINK_EMPTY_US + 8 * (LINK_ATT_BYTES + packet->len) + LINK_IFS_US;
+      if (link_lost())
+      {
+        break;
+      }
+      link_deliver_up(packet);
+      up_head = (up_head + 1) % LINK_QUEUE;
+      up_count--;
+      up_sent++;
+    }
+    else
+    {
+      t += LINK_EMPTY_US + LINK_IFS_US;
+      if (link_lost())
+      {
+        break;
+      }
+    }
+
+    /* peripheral */
+    if (down_count > down_sent && down_sent < sim_link.down_per_event)
+    {
+      const link_packet_t *packet = &down[(down_head + down_sent) % LINK_TX_MAX];
+
+      t += LINK_EMPTY_US + 8 * (LINK_ATT_BYTES + packet->len) + LINK_IFS_US;
+      if (link_lost())
+      {
+        break;
+      }
+      sim_notified(packet->data, packet->len, t + sim_link.latency_us);
+      down_sent++;
+    }
+    else
+    {
+      t += LINK_EMPTY_US + LINK_IFS_US;
+      if (link_lost())
+      {
+        break;
+      }
+    }
+
+    bool up_more = up_ready(t) && up_sent < sim_link.up_per_event;
+    bool down_more = down_count > down_sent && down_sent < sim_link.down_per_event;
+    if (!up_more && !down_more)
+    {
+      break;
+    }
+  }
+
+  link_stats.events++;
+  link_stats.up += up_sent;
+  link_stats.down += down_sent;
+  link_stats.radio_us += t - anchor;
+  return t;
+}
+
+static void link_updated(void)
+{
+  ble_evt_t evt;
+
+  interval = update.min_conn_interval * LINK_UNIT_US;
+  latency = update.slave_latency;
+  update_pending = false;
+  _debug_printf("link: interval %d us, latency %d", interval, latency);
+
+  memset(&evt, 0, sizeof(evt));
+  evt.header.evt_id = BLE_GAP_EVT_CONN_PARAM_UPDATE;
+  evt.header.evt_len = sizeof(ble_gap_evt_t);
+  evt.evt.gap_evt.conn_handle = 0;
+  evt.evt.gap_evt.params.conn_param_update.conn_params = update;
+  sd_post_ble(&evt, sizeof(evt));
+}
+
+/* On to the next connection event, the instant of an update included */
+static void link_advance(void)
+{
+  if (update_pending && !--update_in)
+  {
+    link_updated();
+  }
+
+  anchor += interval;
+  uint64_t distance = sd_radio_distance();
+  link_schedule(anchor > distance ? anchor - distance : 0, LINK_NOTIFY);
+}
+
+static void link_tick(void *context)
+{
+  switch (phase)
+  {
+    case LINK_NOTIFY:
+      if (!down_count && slept < latency && !(update_pending && update_in == 1))
+      {
+        slept++;
+        link_stats.slept++;
+        link_advance();
+        break;
+      }
+      slept = 0;
+      sd_radio(true);
+      link_schedule(anchor, LINK_EVENT);
+      break;
+
+    case LINK_EVENT:
+      link_schedule(link_exchange(), LINK_END);
+      break;
+
+    case LINK_END:
+      sd_radio(false);
+      if (down_sent)
+      {
+        down_head = (down_head + down_sent) % LINK_TX_MAX;
+        down_count -= down_sent;
+        sd_tx_complete(down_sent);
+        down_sent = 0;
+      }
+      link_advance();
+      break;
+  }
+}
+
+/* Connected now, the first event one interval later */
+uint32_t link_connect(void)
+{
+  memset(&link_stats, 0, sizeof(link_stats));
+  connected = true;
+  interval = sim_link.interval_us;
+  latency = 0;
+  slept = 0;
+  random_state = sim_link.seed ? sim_link.seed : 1;
+  up_count = 0;
+  down_count = 0;
+  down_sent = 0;
+  update_pending = false;
+
+  anchor = sim_now();
+  link_advance();
+  return interval;
+}
+
+void link_disconnect(void)
+{
+  connected = false;
+  sim_cancel(&tick);
+}
+
+/* The central's stack takes a write, it goes out once latency_us passed */
+uint32_t link_write(uint16_t handle, const uint8_t *data, uint16_t len)
+{
+  if (up_count == LINK_QUEUE)
+  {
+    return BLE_ERROR_NO_TX_BUFFERS;
+  }
+
+  link_packet_t *packet = &up[(up_head + up_count++) % LINK_QUEUE];
+  packet->handle = handle;
+  packet->len = len;
+  memcpy(packet->data, data, len);
+  packet->ready = sim_now() + sim_link.latency_us;
+  tick.quiet = false;
+  return NRF_SUCCESS;
+}
+
+/* sd_ble_gatts_hvx: into a TX buffer, if there is one */
+uint32_t link_notify(const uint8_t *data, uint16_t len)
+{
+  if (down_count == tx_buffers())
+  {
+    return BLE_ERROR_NO_TX_BUFFERS;
+  }
+
+  link_packet_t *packet = &down[(down_head + down_count++) % LINK_TX_MAX];
+  packet->len = len;
+  memcpy(packet->data, data, len);
+  tick.quiet = false;
+  return NRF_SUCCESS;
+}
+
+/* sd_ble_gap_conn_param_update: what the central does about it */
+uint32_t link_params(const ble_gap_conn_params_t *params)
+{
+  if (!connected)
+  {
+    return BLE_ERROR_INVALID_CONN_HANDLE;
+  }
+
+  link_stats.requests++;
+  if (update_pending || sim_link.busy_updates)
+  {
+    if (sim_link.busy_updates)
+    {
+      sim_link.busy_updates--;
+    }
+    return NRF_ERROR_BUSY;
+  }
+
+  uint32_t shortest = params->min_conn_interval * LINK_UNIT_US;
+  if (shortest < sim_link.min_interval_us)
+  {
+    shortest = sim_link.min_interval_us;
+  }
+
+  if (shortest > params->max_conn_interval * LINK_UNIT_US)
+  {
+    _debug_printf("link: central refuses interval %d-%d", params->min_conn_interval,
+        params->max_conn_interval);
+    return NRF_SUCCESS;
+  }
+
+  update = *params;
+  update.min_conn_interval = update.max_conn_interval = (shortest + LINK_UNIT_US - 1) / LINK_UNIT_US;
+  update_pending = true;
+  update_in = LINK_UPDATE_EVENTS;
+  tick.quiet = false;
+  return NRF_SUCCESS;
+}
+
+uint8_t link_tx_buffers(void)
+{
+  return tx_buffers();
+}
+
+/* Writes the central's stack can still take */
+uint16_t sim_write_space(void)
+{
+  return LINK_QUEUE - up_count;
+}
+
+uint32_t sim_interval(void)
+{
+  return interval;
+}
+
+const sim_link_stats_t *sim_link_stats(void)
+{
+  return &link_stats;
+}
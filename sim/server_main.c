@@ -0,0 +1,459 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "sim.h"
+#include "ble_dfus.h"
+
+/*
+ * The simulated device for other processes
+ *
+ * Boots the bootloader on a flash file and lets a host reach it the way a
+ * real one would through a BLE bridge: over a Unix socket, where a host
+ * connecting is the central connecting (one at a time), or over a pty that
+ * stands for a UART bridge and is always connected.
+ *
+ * Both carry SLIP frames (RFC 1055). The first byte of a frame is the
+ * characteristic, 0 the control point and 1 the data characteristic, the
+ * rest is the write; frames back are notifications of the control point.
+ *
+ * Virtual time follows the wall clock, -x runs it that many times faster.
+ * -e and -l make the flash slower and the link lossy, see sim.h.
+ * The DFU pins are held at boot, so the bootloader stays whatever is in
+ * the flash file.
+ */
+
+bool steady_state_test = false; /* debug.h: print _debug_printf */
+
+#define SLIP_END     0xC0
+#define SLIP_ESC     0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
+
+#define FRAME_MAX    (1 + GATT_MTU_SIZE_DEFAULT)
+#define POLL_MAX_MS  100
+
+typedef struct
+{
+  uint8_t  data[FRAME_MAX];
+  uint16_t len;
+  bool     escaped;
+  bool     overrun;  /* too long, dropped at its end */
+  bool     ready;    /* complete, waiting for the link */
+} frame_t;
+
+static int     host_fd = -1;
+static frame_t frame;
+static uint8_t rx[256];
+static uint16_t rx_pos = 0;
+static uint16_t rx_len = 0;
+static double  speed = 1;
+static uint64_t wall_start;
+static volatile sig_atomic_t stopping = 0;
+
+/* SIGTERM, SIGINT: leave the loops, so the socket goes away too */
+static void stop(int sig)
+{
+  stopping = 1;
+}
+
+static uint64_t wall_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Where virtual time should be by now */
+static uint64_t due(void)
+{
+  return (uint64_t)((wall_us() - wall_start) * speed);
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t len)
+{
+  while (len)
+  {
+    ssize_t n = write(fd, data, len);
+
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN)
+    {
+      struct pollfd out = { fd, POLLOUT, 0 };
+      poll(&out, 1, POLL_MAX_MS);
+      continue;
+    }
+    if (n <= 0)
+    {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* A notification to the host */
+static bool slip_send(const uint8_t *data, uint16_t len)
+{
+  uint8_t out[2 * FRAME_MAX + 2];
+  uint16_t o = 0;
+
+  out[o++] = SLIP_END;
+  out[o++] = 0;
+  for (uint16_t i = 0; i < len; i++)
+  {
+    if (data[i] == SLIP_END)
+    {
+      out[o++] = SLIP_ESC;
+      out[o++] = SLIP_ESC_END;
+    }
+    else if (data[i] == SLIP_ESC)
+    {
+      out[o++] = SLIP_ESC;
+      out[o++] = SLIP_ESC_ESC;
+    }
+    else
+    {
+      out[o++] = data[i];
+    }
+  }
+  out[o++] = SLIP_END;
+  return write_all(host_fd, out, o);
+}
+
+/* Feed one byte from the host, true once a frame is complete */
+static bool slip_byte(uint8_t byte)
+{
+  if (byte == SLIP_END)
+  {
+    bool complete = frame.len && !frame.overrun;
+
+    frame.escaped = false;
+    frame.overrun = false;
+    if (!complete)
+    {
+      frame.len = 0;
+    }
+    return complete;
+  }
+
+  if (byte == SLIP_ESC)
+  {
+    frame.escaped = true;
+    return false;
+  }
+
+  if (frame.escaped)
+  {
+    byte = byte == SLIP_ESC_END ? SLIP_END : byte == SLIP_ESC_ESC ? SLIP_ESC : byte;
+    frame.escaped = false;
+  }
+
+  if (frame.len == FRAME_MAX)
+  {
+    frame.overrun = true;
+    return false;
+  }
+  frame.data[frame.len++] = byte;
+  return false;
+}
+
+/* Hand a complete frame to the central, false while its stack is full */
+static bool frame_deliver(void)
+{
+  uint16_t uuid = frame.data[0] ? BLE_UUID_DFUS_DATA_CHAR : BLE_UUID_DFUS_CTRL_CHAR;
+
+  if (!sim_write_space())
+  {
+    return false;
+  }
+
+  if (frame.len > 1 && frame.data[0] <= 1)
+  {
+    uint32_t err = sim_write(uuid, &frame.data[1], frame.len - 1);
+    if (err != NRF_SUCCESS)
+    {
+      fprintf(stderr, "write refused: %u\n", err);
+    }
+  }
+  frame.len = 0;
+  frame.ready = false;
+  return true;
+}
+
+/* Take what the host sent, false once it is gone */
+static bool host_read(void)
+{
+  while (!frame.ready)
+  {
+    if (rx_pos == rx_len)
+    {
+      ssize_t n = read(host_fd, rx, sizeof(rx));
+
+      if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      {
+        return true;
+      }
+      if (n <= 0)
+      {
+        return false;
+      }
+      rx_pos = 0;
+      rx_len = n;
+    }
+
+    if (slip_byte(rx[rx_pos++]))
+    {
+      frame.ready = true;
+      frame_deliver();
+    }
+  }
+  return true;
+}
+
+/* Virtual time up to the wall clock */
+static void catch_up(void)
+{
+  uint64_t target = due();
+
+  if (target > sim_now())
+  {
+    sim_run(target - sim_now());
+  }
+}
+
+/*
+ * Run the device while the host is there: virtual time up to the wall
+ * clock, its writes in, notifications out, sleep until the next event
+ */
+static void serve(void)
+{
+  uint8_t reply[GATT_MTU_SIZE_DEFAULT];
+
+  memset(&frame, 0, sizeof(frame));
+  rx_pos = rx_len = 0;
+
+  while (sim_state() == SIM_RUNNING && !stopping)
+  {
+    catch_up();
+
+    if (frame.ready && frame_deliver())
+    {
+      host_read();
+    }
+
+    uint16_t len;
+    while ((len = sim_notification(reply)))
+    {
+      if (!slip_send(reply, len))
+      {
+        return;
+      }
+    }
+
+    uint64_t next = sim_next();
+    int timeout = POLL_MAX_MS;
+    if (next != UINT64_MAX)
+    {
+      uint64_t wait = next > sim_now() ? (uint64_t)((next - sim_now()) / speed / 1000) : 0;
+      timeout = wait < POLL_MAX_MS ? (int)wait : POLL_MAX_MS;
+    }
+
+    struct pollfd in = { host_fd, frame.ready ? 0 : POLLIN, 0 };
+    if (poll(&in, 1, timeout) > 0 && (in.revents & (POLLIN | POLLHUP | POLLERR)))
+    {
+      if (!host_read())
+      {
+        return;
+      }
+    }
+  }
+}
+
+static void nonblocking(int fd)
+{
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* A UART bridge that never lets go; the slave end stays open so the master never hangs up */
+static int serve_pty(void)
+{
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+  if (master < 0 || grantpt(master) || unlockpt(master))
+  {
+    perror("pty");
+    return 1;
+  }
+
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  struct termios tio;
+  if (slave < 0 || tcgetattr(slave, &tio))
+  {
+    perror("pty");
+    return 1;
+  }
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  printf("%s\n", ptsname(master));
+  fflush(stdout);
+
+  host_fd = master;
+  nonblocking(host_fd);
+  sim_connect();
+  sim_subscribe(BLE_UUID_DFUS_CTRL_CHAR, true);
+  serve();
+  return sim_state() == SIM_LAUNCHED || stopping ? 0 : 1;
+}
+
+static int serve_socket(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "%s: path too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) || listen(listener, 1))
+  {
+    perror(path);
+    return 1;
+  }
+  printf("%s\n", path);
+  fflush(stdout);
+
+  while (sim_state() == SIM_RUNNING && !stopping)
+  {
+    struct pollfd in = { listener, POLLIN, 0 };
+
+    /* time goes on without a host too */
+    if (poll(&in, 1, POLL_MAX_MS) <= 0)
+    {
+      catch_up();
+      continue;
+    }
+
+    host_fd = accept(listener, NULL, NULL);
+    if (host_fd < 0)
+    {
+      continue;
+    }
+    nonblocking(host_fd);
+    catch_up();
+
+    sim_connect();
+    sim_subscribe(BLE_UUID_DFUS_CTRL_CHAR, true);
+    serve();
+    if (sim_connected())
+    {
+      sim_disconnect();
+    }
+    close(host_fd);
+    host_fd = -1;
+  }
+
+  close(listener);
+  unlink(path);
+  return 0;
+}
+
+static int usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-v] [-f flash] [-x speed] [-e erase_us] [-l loss_permille] "
+      "(-u socket | -t)\n", name);
+  return 2;
+}
+
+int main(int argc, char **argv)
+{
+  const char *flash_path = NULL;
+  const char *socket_path = NULL;
+  bool pty = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "vf:x:e:l:u:t")) != -1)
+  {
+    switch (opt)
+    {
+      case 'v':
+        steady_state_test = true;
+        break;
+      case 'f':
+        flash_path = optarg;
+        break;
+      case 'x':
+        speed = atof(optarg);
+        break;
+      case 'e':
+        sim_flash_timing.erase_us = atoi(optarg);
+        break;
+      case 'l':
+        sim_link.loss_permille = atoi(optarg);
+        break;
+      case 'u':
+        socket_path = optarg;
+        break;
+      case 't':
+        pty = true;
+        break;
+      default:
+        return usage(argv[0]);
+    }
+  }
+
+  if (speed <= 0 || pty == (socket_path != NULL))
+  {
+    return usage(argv[0]);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  struct sigaction quit = { .sa_handler = stop }; /* no SA_RESTART, poll has to return */
+  sigaction(SIGTERM, &quit, NULL);
+  sigaction(SIGINT, &quit, NULL);
+
+  if (!sim_flash_open(flash_path))
+  {
+    perror(flash_path);
+    return 1;
+  }
+
+  /* DFU pins held, so a finished image does not start instead */
+  sim_pins(~((1 << 25) | (1 << 28)));
+  sim_boot();
+  if (sim_state() != SIM_RUNNING)
+  {
+    fprintf(stderr, "bootloader did not stay, application at %x\n", sim_launched());
+    return 1;
+  }
+  wall_start = wall_us();
+
+  return pty ? serve_pty() : serve_socket(socket_path);
+}
@@ -0,0 +1,401 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+#include "sim.h"
+#include "debug.h"
+#include "ble_hci.h"
+
+/*
+ * Running the bootloader
+ *
+ * The bootloader gets a stack of its own and runs until sd_app_evt_wait
+ * finds nothing to do, then hands back to whoever called sim_run. Events
+ * fire on the caller's stack, like interrupts, and sim_interrupt makes the
+ * bootloader's next wait return.
+ *
+ * The host CPU time spent on the bootloader's stack is counted, and the
+ * stack is painted so its deepest use can be read back.
+ */
+
+#define FIRMWARE_STACK (256 * 1024)
+#define STACK_PAINT    0xA5
+
+static ucontext_t  host_context;
+static ucontext_t  firmware_context;
+static sim_state_t state = SIM_OFF;
+static bool        irq = false;
+static uint64_t    halted = 0; /* CPU stopped until then */
+static uint32_t    launched = 0;
+static uint8_t    *stack = NULL;
+static uint64_t    cpu_ns = 0;
+
+static uint64_t     now = 0;
+static sim_event_t *events = NULL;
+
+uint64_t sim_now(void)
+{
+  return now;
+}
+
+/* Queue (or move) an event, same times fire in the order they were queued */
+void sim_at(sim_event_t *event, uint64_t at, sim_fn_t fn, void *context)
+{
+  sim_cancel(event);
+
+  event->at = at < now ? now : at;
+  event->fn = fn;
+  event->context = context;
+  event->queued = true;
+
+  sim_event_t **link = &events;
+  while (*link && (*link)->at <= event->at)
+  {
+    link = &(*link)->next;
+  }
+  event->next = *link;
+  *link = event;
+}
+
+void sim_cancel(sim_event_t *event)
+{
+  if (!event->queued)
+  {
+    return;
+  }
+
+  for (sim_event_t **link = &events; *link; link = &(*link)->next)
+  {
+    if (*link == event)
+    {
+      *link = event->next;
+      break;
+    }
+  }
+  event->queued = false;
+}
+
+void sim_interrupt(void)
+{
+  irq = true;
+}
+
+/*
+ * The CPU stops while the NVMC works. Interrupts in the meantime are
+ * remembered and taken once it is over, the event that ends the halt is
+ * expected to come at until or later.
+ */
+void sim_halt(uint64_t until)
+{
+  if (until > halted)
+  {
+    halted = until;
+  }
+}
+
+/* sd_app_evt_wait: sleep unless something happened since the last one */
+void sim_wait(void)
+{
+  if (!irq)
+  {
+    swapcontext(&firmware_context, &host_context);
+  }
+  irq = false;
+}
+
+/* hw_start_application: the bootloader is done, never resumed */
+void sim_launch(uint32_t vector_table)
+{
+  _debug_printf("launching application at %x", vector_table);
+  launched = vector_table;
+  state = SIM_LAUNCHED;
+  swapcontext(&firmware_context, &host_context);
+  abort();
+}
+
+static void firmware_entry(void)
+{
+  bootloader_main();
+  state = SIM_RETURNED;
+}
+
+static uint64_t thread_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void enter(void)
+{
+  uint64_t start = thread_ns();
+
+  swapcontext(&host_context, &firmware_context);
+  cpu_ns += thread_ns() - start;
+}
+
+/* Let the bootloader work off whatever woke it */
+static void resume(void)
+{
+  while (state == SIM_RUNNING && irq && now >= halted)
+  {
+    enter();
+  }
+}
+
+static void fire(void)
+{
+  sim_event_t *event = events;
+
+  events = event->next;
+  event->queued = false;
+  now = event->at;
+  event->fn(event->context);
+}
+
+void sim_boot(void)
+{
+  if (!sim_flash)
+  {
+    sim_flash_open(NULL);
+  }
+
+  stack = malloc(FIRMWARE_STACK);
+  memset(stack, STACK_PAINT, FIRMWARE_STACK);
+
+  getcontext(&firmware_context);
+  firmware_context.uc_stack.ss_sp = stack;
+  firmware_context.uc_stack.ss_size = FIRMWARE_STACK;
+  firmware_context.uc_link = &host_context;
+  makecontext(&firmware_context, firmware_entry, 0);
+
+  state = SIM_RUNNING;
+  enter();
+  resume();
+}
+
+/* Let us microseconds pass */
+void sim_run(uint64_t us)
+{
+  uint64_t end = now + us;
+
+  resume();
+  while (events && events->at <= end)
+  {
+    fire();
+    resume();
+  }
+  now = end;
+}
+
+/* Run until nothing has happened for SIM_SETTLE_US, quiet events aside */
+void sim_settle(void)
+{
+  uint64_t busy = now;
+
+  resume();
+  while (events && events->at <= busy + SIM_SETTLE_US)
+  {
+    bool quiet = events->quiet;
+
+    fire();
+    if (!quiet)
+    {
+      busy = now;
+    }
+    resume();
+  }
+}
+
+/* Fire the next event and let the bootloader react, false if there is none */
+bool sim_step(void)
+{
+  resume();
+  if (!events)
+  {
+    return false;
+  }
+
+  fire();
+  resume();
+  return true;
+}
+
+/* When the next event is due, UINT64_MAX if there is none */
+uint64_t sim_next(void)
+{
+  return events ? events->at : UINT64_MAX;
+}
+
+sim_state_t sim_state(void)
+{
+  return state;
+}
+
+/* Vector table the bootloader jumped to, 0 if it did not */
+uint32_t sim_launched(void)
+{
+  return launched;
+}
+
+/* Host CPU time the bootloader took since boot */
+uint64_t sim_cpu_ns(void)
+{
+  return cpu_ns;
+}
+
+/* Deepest the bootloader's stack has been (on the host) */
+uint32_t sim_stack_peak(void)
+{
+  uint32_t untouched = 0;
+
+  while (stack && untouched < FIRMWARE_STACK && stack[untouched] == STACK_PAINT)
+  {
+    untouched++;
+  }
+  return FIRMWARE_STACK - untouched;
+}
+
+/*
+ * The central
+ *
+ * Writes go to its stack and out over the link, notifications land in the
+ * inbox once they have crossed it.
+ */
+
+#define INBOX_SIZE 256
+
+typedef struct
+{
+  uint8_t  len;
+  uint8_t  data[GATT_MTU_SIZE_DEFAULT];
+  uint64_t at; /* when the central's application sees it */
+} sim_packet_t;
+
+static sim_packet_t inbox[INBOX_SIZE];
+static uint16_t     inbox_head = 0;
+static uint16_t     inbox_count = 0;
+static bool         connected = false;
+
+void sim_connect(void)
+{
+  ble_evt_t evt;
+
+  connected = true;
+  inbox_count = 0;
+  sd_link(true);
+  uint16_t interval = link_connect() / 1250;
+
+  memset(&evt, 0, sizeof(evt));
+  evt.header.evt_id = BLE_GAP_EVT_CONNECTED;
+  evt.header.evt_len = sizeof(ble_gap_evt_t);
+  evt.evt.gap_evt.conn_handle = 0;
+  evt.evt.gap_evt.params.connected.conn_params.min_conn_interval = interval;
+  evt.evt.gap_evt.params.connected.conn_params.max_conn_interval = interval;
+  sd_post_ble(&evt, sizeof(evt));
+}
+
+void sim_disconnect(void)
+{
+  ble_evt_t evt;
+
+  memset(&evt, 0, sizeof(evt));
+  evt.header.evt_id = BLE_GAP_EVT_DISCONNECTED;
+  evt.header.evt_len = sizeof(ble_gap_evt_t);
+  evt.evt.gap_evt.conn_handle = 0;
+  evt.evt.gap_evt.params.disconnected.reason = BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION;
+
+  connected = false;
+  link_disconnect();
+  sd_link(false);
+  sd_post_ble(&evt, sizeof(evt));
+}
+
+bool sim_connected(void)
+{
+  return connected;
+}
+
+static uint32_t write_handle(uint16_t handle, const uint8_t *data, uint16_t len)
+{
+  if (!connected)
+  {
+    return BLE_ERROR_INVALID_CONN_HANDLE;
+  }
+
+  if (!handle)
+  {
+    return BLE_ERROR_INVALID_ATTR_HANDLE;
+  }
+
+  if (len > GATT_MTU_SIZE_DEFAULT - 3)
+  {
+    return NRF_ERROR_DATA_SIZE;
+  }
+
+  return link_write(handle, data, len);
+}
+
+/* Turn notifications of a characteristic on or off */
+void sim_subscribe(uint16_t uuid, bool on)
+{
+  uint8_t cccd[2] = { on ? BLE_GATT_HVX_NOTIFICATION : 0, 0 };
+  write_handle(sd_handle(uuid, true), cccd, sizeof(cccd));
+}
+
+/* Write to the value of a characteristic */
+uint32_t sim_write(uint16_t uuid, const uint8_t *data, uint16_t len)
+{
+  return write_handle(sd_handle(uuid, false), data, len);
+}
+
+/* A notification made it across, the application gets it at at */
+void sim_notified(const uint8_t *data, uint16_t len, uint64_t at)
+{
+  if (inbox_count == INBOX_SIZE || len > GATT_MTU_SIZE_DEFAULT)
+  {
+    _debug_printf("inbox full, notification lost");
+    return;
+  }
+
+  sim_packet_t *packet = &inbox[(inbox_head + inbox_count) % INBOX_SIZE];
+  packet->len = len;
+  packet->at = at;
+  memcpy(packet->data, data, len);
+  inbox_count++;
+}
+
+/* Next notification the central has, its length or 0 if none */
+uint16_t sim_notification(uint8_t *data)
+{
+  if (!inbox_count || inbox[inbox_head].at > now)
+  {
+    return 0;
+  }
+
+  sim_packet_t *packet = &inbox[inbox_head];
+  uint16_t len = packet->len;
+
+  memcpy(data, packet->data, len);
+  inbox_head = (inbox_head + 1) % INBOX_SIZE;
+  inbox_count--;
+  return len;
+}
+
+void sim_ble_event(const ble_evt_t *evt, uint16_t len)
+{
+  sd_post_ble(evt, len);
+}
+
+void sim_sys_event(uint32_t evt)
+{
+  sd_post_sys(evt);
+}
@@ -0,0 +1,177 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble.h"
+#ifndef _sim_h
+#define _sim_h
+
+/*
+ * Host simulator
+ *
+ * source/main.c built for Linux against a stand-in softdevice. The
+ * bootloader runs on its own stack and gets control whenever something
+ * would have woken it on the chip; the rest of the time the caller plays
+ * the central and the passing of time.
+ *
+ * Time is virtual, in microseconds, and only moves in sim_run, sim_settle
+ * and sim_step. Everything that happens later (flash done, packets, timers)
+ * is a sim_event_t at some point in that time. Flash operations take as
+ * long as on the chip and halt the bootloader meanwhile, packets only move
+ * in connection events (sim/link.c).
+ *
+ * One boot per process: the bootloader's globals are not set up again, so
+ * tests that reset fork first and keep the flash in a file.
+ */
+
+#define SIM_FLASH_SIZE   (256 * 1024)
+#define SIM_SETTLE_US    100000 /* this long without events counts as idle */
+
+/* nRF51 NVMC, product specification typical values */
+#define SIM_FLASH_ERASE_US    21000 /* t_ERASEPAGE, per page */
+#define SIM_FLASH_WORD_US     46    /* t_WRITE, per word */
+#define SIM_FLASH_WORD_WRITES 2     /* n_WRITE, writes to a word between erases */
+#define SIM_FLASH_OP_US       300   /* softdevice getting a timeslot, per operation */
+
+/* The central the link starts out with */
+#define SIM_LINK_INTERVAL_US     30000 /* what phones tend to connect with */
+#define SIM_LINK_MIN_INTERVAL_US 7500  /* the shortest it agrees to */
+#define SIM_LINK_PER_EVENT       6     /* packets per direction and connection event */
+#define SIM_LINK_TX_BUFFERS      7     /* S110's notification buffers */
+
+typedef void (*sim_fn_t)(void *context);
+
+typedef struct sim_event_s
+{
+  struct sim_event_s *next;
+  uint64_t            at;
+  sim_fn_t            fn;
+  void               *context;
+  bool                queued;
+  bool                quiet;   /* does not keep sim_settle going */
+} sim_event_t;
+
+typedef enum
+{
+  SIM_OFF,       /* not booted yet */
+  SIM_RUNNING,   /* in the bootloader */
+  SIM_LAUNCHED,  /* jumped to the application */
+  SIM_RETURNED,  /* main() came back, should never happen */
+} sim_state_t;
+
+/* What the flash costs, 0 for instant operations */
+typedef struct
+{
+  uint32_t erase_us;
+  uint32_t word_us;
+  uint32_t op_us;
+  uint8_t  word_writes;
+  uint8_t  failures;    /* operations still to end in FLASH_OPERATION_ERROR */
+} sim_flash_timing_t;
+
+/* What the flash went through since sim_flash_open */
+typedef struct
+{
+  uint32_t erases;
+  uint32_t writes;     /* sd_flash_write calls */
+  uint32_t words;      /* words written */
+  uint64_t busy_us;    /* CPU halted for flash */
+  uint32_t set_bits;   /* words written with a 1 where the flash had a 0 */
+  uint32_t overwrites; /* words written more than word_writes times */
+} sim_flash_stats_t;
+
+/* How the link behaves, read on connect and per connection event */
+typedef struct
+{
+  uint32_t interval_us;     /* connection interval the central starts with */
+  uint32_t min_interval_us; /* shortest one it agrees to on an update */
+  uint8_t  up_per_event;    /* writes the central gets out per event */
+  uint8_t  down_per_event;  /* notifications the peripheral gets out per event */
+  uint8_t  tx_buffers;      /* softdevice notification buffers, up to 16 */
+  uint16_t loss_permille;   /* packets that have to go again */
+  uint32_t latency_us;      /* central's stack, each way */
+  uint32_t seed;            /* which packets get lost */
+  uint8_t  busy_updates;    /* parameter updates refused as busy before one goes through */
+} sim_link_t;
+
+/* What the link carried since sim_connect */
+typedef struct
+{
+  uint32_t events;   /* connection events the peripheral was in */
+  uint32_t slept;    /* ones it slept through on slave latency */
+  uint32_t up;       /* writes delivered */
+  uint32_t down;     /* notifications delivered */
+  uint32_t lost;     /* packets lost, empty ones included */
+  uint64_t radio_us; /* spent in connection events */
+  uint32_t requests; /* parameter updates asked for, refused ones included */
+} sim_link_stats_t;
+
+extern uint8_t *sim_flash;
+extern sim_flash_timing_t sim_flash_timing;
+extern sim_link_t sim_link;
+
+/* time and events */
+uint64_t sim_now(void);
+void sim_at(sim_event_t *event, uint64_t at, sim_fn_t fn, void *context);
+void sim_cancel(sim_event_t *event);
+void sim_interrupt(void);
+void sim_halt(uint64_t until);
+
+/* the device */
+bool sim_flash_open(const char *path);
+const sim_flash_stats_t *sim_flash_stats(void);
+void sim_pins(uint32_t in);
+void sim_boot(void);
+void sim_run(uint64_t us);
+void sim_settle(void);
+bool sim_step(void);
+uint64_t sim_next(void);
+sim_state_t sim_state(void);
+uint32_t sim_launched(void);
+uint64_t sim_cpu_ns(void);
+uint32_t sim_stack_peak(void);
+
+/* the central */
+void sim_connect(void);
+void sim_disconnect(void);
+bool sim_connected(void);
+void sim_subscribe(uint16_t uuid, bool on);
+uint32_t sim_write(uint16_t uuid, const uint8_t *data, uint16_t len);
+uint16_t sim_write_space(void);
+uint16_t sim_notification(uint8_t *data);
+uint32_t sim_interval(void);
+const sim_link_stats_t *sim_link_stats(void);
+
+/* anything else the softdevice might say */
+void sim_ble_event(const ble_evt_t *evt, uint16_t len);
+void sim_sys_event(uint32_t evt);
+
+/* sim/softdevice.c to sim/sim.c and back */
+void sim_wait(void);
+void sim_launch(uint32_t vector_table);
+void sim_notified(const uint8_t *data, uint16_t len, uint64_t at);
+void sd_post_ble(const ble_evt_t *evt, uint16_t len);
+void sd_post_sys(uint32_t evt);
+bool sd_write_room(void);
+uint16_t sd_handle(uint16_t uuid, bool cccd);
+void sd_link(bool up);
+void sd_radio(bool active);
+uint32_t sd_radio_distance(void);
+void sd_tx_complete(uint8_t count);
+
+/* sim/link.c */
+uint32_t link_connect(void);
+void link_disconnect(void);
+uint32_t link_write(uint16_t handle, const uint8_t *data, uint16_t len);
+uint32_t link_notify(const uint8_t *data, uint16_t len);
+uint32_t link_params(const ble_gap_conn_params_t *params);
+uint8_t link_tx_buffers(void);
+
+int bootloader_main(void); /* sim/bootloader.c */
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include "hw.h"
+#include "timers.h"
+#include "sim.h"
+#include "nrf.h"
+
+/*
+ * hw.h for the host simulator
+ *
+ * RTC1 counts virtual time from hw_rtc_start. Its compare is one sim event
+ * for whatever timers_next picks, and fires like RTC1_IRQHandler does: from
+ * interrupt context, waking the event loop.
+ */
+
+gpioIntFnPtr gpioFn = NULL;
+
+static bool           rtc_running = false;
+static uint64_t       rtc_base = 0;
+static timers_clock_t rtc_clock;
+static sim_event_t    rtc_compare;
+
+static uint64_t rtc_time(uint32_t ticks)
+{
+  return rtc_base + ((uint64_t)ticks * 1000000 + RTC_TICK_HZ - 1) / RTC_TICK_HZ;
+}
+
+static void rtc_fire(void *context);
+
+static void rtc_arm(void)
+{
+  uint32_t due;
+
+  if (timers_next(&rtc_clock, &due) && rtc_running)
+  {
+    sim_at(&rtc_compare, rtc_time(due), rtc_fire, NULL);
+  }
+  else
+  {
+    sim_cancel(&rtc_compare);
+  }
+}
+
+static void rtc_fire(void *context)
+{
+  timers_fire(&rtc_clock, hw_rtc_value());
+  rtc_arm();
+  sim_interrupt();
+}
+
+void hw_init(void)
+{
+}
+
+void hw_clear_port_event()
+{
+  NRF_GPIOTE->EVENTS_PORT = 0;
+}
+
+void hw_latch_interrupt(bool enable)
+{
+}
+
+void hw_rtc_start(void)
+{
+  if (!rtc_running)
+  {
+    rtc_running = true;
+    rtc_base = sim_now();
+    rtc_arm();
+  }
+}
+
+void hw_rtc_stop(void)
+{
+  rtc_running = false;
+  rtc_arm();
+}
+
+void hw_rtc_clear(void)
+{
+  rtc_base = sim_now();
+  rtc_arm();
+}
+
+uint32_t hw_rtc_value(void)
+{
+  if (!rtc_running)
+  {
+    return 0;
+  }
+  return (uint32_t)((sim_now() - rtc_base) * RTC_TICK_HZ / 1000000);
+}
+
+uint32_t hw_rtc_ms(void)
+{
+  return (uint32_t)((uint64_t)hw_rtc_value() * 1000 / RTC_TICK_HZ);
+}
+
+void hw_rtc_wakeup(uint32_t ms)
+{
+  timers_wakeup(&rtc_clock, hw_rtc_value(), ms);
+  rtc_arm();
+}
+
+bool hw_rtc_fired(void)
+{
+  return rtc_clock.wakeup_fired;
+}
+
+void hw_timer_start(hw_timer_t *timer, uint32_t ms, hw_timer_fn_t fn, void *context)
+{
+  hw_timer_stop(timer);
+
+  timer->due = hw_rtc_value() + timers_ticks(ms);
+  timer->fn = fn;
+  timer->context = context;
+
+  timers_insert(&rtc_clock.list, timer);
+  rtc_arm();
+}
+
+void hw_timer_stop(hw_timer_t *timer)
+{
+  timers_remove(&rtc_clock.list, timer);
+  rtc_arm();
+}
+
+void hw_start_application(uint32_t vector_table)
+{
+  sim_launch(vector_table);
+}
@@ -0,0 +1,736 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sim.h"
+#include "debug.h"
+#include "nrf.h"
+#include "nrf_soc.h"
+#include "nrf_mbr.h"
+#include "softdevice_handler_appsh.h"
+#include "app_scheduler.h"
+#include "ble_advertising.h"
+#include "ble_srv_common.h"
+#include "ble_radio_notification.h"
+#include "pstorage_platform.h"
+
+/*
+ * Stand-in softdevice
+ *
+ * Just enough of S110 and the SDK libraries around it for the bootloader:
+ * flash in a file, the GATT table as a list of handles, events through the
+ * scheduler exactly as softdevice_handler_appsh would hand them over. The
+ * radio side of the connection is sim/link.c.
+ */
+
+/* Peripherals main.c reads directly, see sim/include/nrf51.h */
+NRF_POWER_Type  sim_power;
+NRF_CLOCK_Type  sim_clock;
+NRF_NVMC_Type   sim_nvmc = { .READY = NVMC_READY_READY_Ready };
+NRF_FICR_Type   sim_ficr = { .CONFIGID = 0x00000072, .DEVICEID = { 0x51D0F1CE, 0x7E570001 } };
+NRF_UICR_Type   sim_uicr = { .XTALFREQ = 0xFFFFFF00 }; /* already set up for 32 MHz */
+NRF_GPIO_Type   sim_gpio = { .IN = 0xFFFFFFFF };       /* everything pulled up */
+NRF_GPIOTE_Type sim_gpiote;
+
+/* DETECT: some pin is at the level it senses for */
+static bool pins_detect(uint32_t in)
+{
+  for (uint8_t pin = 0; pin < 32; pin++)
+  {
+    uint32_t sense = (sim_gpio.PIN_CNF[pin] & GPIO_PIN_CNF_SENSE_Msk) >> GPIO_PIN_CNF_SENSE_Pos;
+    bool high = in >> pin & 1;
+
+    if ((sense == GPIO_PIN_CNF_SENSE_Low && !high) || (sense == GPIO_PIN_CNF_SENSE_High && high))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Levels on the pins, bit n for pin n. DETECT going high is a PORT event */
+void sim_pins(uint32_t in)
+{
+  bool before = pins_detect(sim_gpio.IN);
+
+  *(uint32_t *)&sim_gpio.IN = in;
+  if (!before && pins_detect(in))
+  {
+    sim_gpiote.EVENTS_PORT = 1;
+    sim_interrupt();
+  }
+}
+
+/*
+ * Flash
+ *
+ * 256 KB, mapped from a file so a test can reboot into what the last run
+ * left behind. An operation keeps the flash and the CPU busy for as long
+ * as the NVMC would, plus what the softdevice takes to schedule it, lands
+ * when that is over and is followed by its event.
+ * The source has to stay valid until then, as with the real softdevice.
+ *
+ * Writes can only clear bits, and only so often per word between erases.
+ * Going against either is counted rather than refused, the chip would not
+ * refuse either.
+ */
+
+#define SD_FLASH_PAGE   1024
+#define SD_APP_START    0x18000 /* below is MBR and softdevice */
+#define SD_FLASH_WORDS  (SIM_FLASH_SIZE / 4)
+
+uint8_t *sim_flash = NULL;
+sim_flash_timing_t sim_flash_timing =
+{
+  .erase_us    = SIM_FLASH_ERASE_US,
+  .word_us     = SIM_FLASH_WORD_US,
+  .op_us       = SIM_FLASH_OP_US,
+  .word_writes = SIM_FLASH_WORD_WRITES,
+};
+
+static sim_flash_stats_t flash_stats;
+static uint8_t           flash_writes[SD_FLASH_WORDS]; /* per word since its erase */
+static bool              flash_busy = false;
+static sim_event_t       flash_event;
+
+static struct
+{
+  bool            erase;
+  uint32_t        page;
+  uint32_t        dst;
+  const uint32_t *src;
+  uint32_t        size;
+} flash_op;
+
+bool sim_flash_open(const char *path)
+{
+  bool fresh = true;
+  int  fd = -1;
+
+  if (path)
+  {
+    struct stat st;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+      return false;
+    }
+    fresh = fstat(fd, &st) || st.st_size != SIM_FLASH_SIZE;
+    if (fresh && ftruncate(fd, SIM_FLASH_SIZE))
+    {
+      close(fd);
+      return false;
+    }
+  }
+
+  void *map = mmap(NULL, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE,
+      path ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS, fd, 0);
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  if (map == MAP_FAILED)
+  {
+    return false;
+  }
+
+  sim_flash = map;
+  if (fresh)
+  {
+    memset(sim_flash, 0xFF, SIM_FLASH_SIZE);
+  }
+  memset(&flash_stats, 0, sizeof(flash_stats));
+  memset(flash_writes, 0, sizeof(flash_writes));
+  return true;
+}
+
+const sim_flash_stats_t *sim_flash_stats(void)
+{
+  return &flash_stats;
+}
+
+static void flash_done(void *context)
+{
+  if (sim_flash_timing.failures)
+  {
+    /* took its time, changed nothing */
+    sim_flash_timing.failures--;
+    flash_busy = false;
+    sd_post_sys(NRF_EVT_FLASH_OPERATION_ERROR);
+    return;
+  }
+
+  if (flash_op.erase)
+  {
+    memset(sim_flash + flash_op.page * SD_FLASH_PAGE, 0xFF, SD_FLASH_PAGE);
+    memset(&flash_writes[flash_op.page * SD_FLASH_PAGE / 4], 0, SD_FLASH_PAGE / 4);
+  }
+  else
+  {
+    uint32_t *word = (uint32_t *)(sim_flash + flash_op.dst);
+    uint8_t  *writes = &flash_writes[flash_op.dst / 4];
+
+    for (uint32_t i = 0; i < flash_op.size; i++)
+    {
+      if ((word[i] & flash_op.src[i]) != flash_op.src[i])
+      {
+        _debug_printf("flash word %x: writing %x over %x", flash_op.dst + i * 4,
+            flash_op.src[i], word[i]);
+        flash_stats.set_bits++;
+      }
+
+      if (writes[i]++ >= sim_flash_timing.word_writes)
+      {
+        _debug_printf("flash word %x: written %d times", flash_op.dst + i * 4, writes[i]);
+        flash_stats.overwrites++;
+      }
+
+      word[i] &= flash_op.src[i];
+    }
+  }
+
+  flash_busy = false;
+  sd_post_sys(NRF_EVT_FLASH_OPERATION_SUCCESS);
+}
+
+static void flash_start(uint32_t us)
+{
+  flash_busy = true;
+  flash_stats.busy_us += us;
+  sim_halt(sim_now() + us);
+  sim_at(&flash_event, sim_now() + us, flash_done, NULL);
+}
+
+uint32_t sd_flash_write(uint32_t * const p_dst, uint32_t const * const p_src, uint32_t size)
+{
+  uintptr_t dst = (uintptr_t)p_dst;
+
+  if (flash_busy)
+  {
+    return NRF_ERROR_BUSY;
+  }
+
+  if (dst % 4 || (uintptr_t)p_src % 4 || !size || size > SD_FLASH_PAGE / 4)
+  {
+    return NRF_ERROR_INVALID_ADDR;
+  }
+
+  if (dst < SD_APP_START || dst + size * 4 > SIM_FLASH_SIZE)
+  {
+    return NRF_ERROR_FORBIDDEN;
+  }
+
+  flash_op.erase = false;
+  flash_op.dst = dst;
+  flash_op.src = p_src;
+  flash_op.size = size;
+  flash_stats.writes++;
+  flash_stats.words += size;
+  flash_start(sim_flash_timing.op_us + size * sim_flash_timing.word_us);
+  return NRF_SUCCESS;
+}
+
+uint32_t sd_flash_page_erase(uint32_t page_number)
+{
+  if (flash_busy)
+  {
+    return NRF_ERROR_BUSY;
+  }
+
+  if (page_number * SD_FLASH_PAGE < SD_APP_START || page_number >= SIM_FLASH_SIZE / SD_FLASH_PAGE)
+  {
+    return NRF_ERROR_FORBIDDEN;
+  }
+
+  flash_op.erase = true;
+  flash_op.page = page_number;
+  flash_stats.erases++;
+  flash_start(sim_flash_timing.op_us + sim_flash_timing.erase_us);
+  return NRF_SUCCESS;
+}
+
+/*
+ * Events
+ *
+ * Everything the softdevice has to say waits here until the scheduled
+ * fetch hands it to the handlers, system events first.
+ */
+
+#define SD_QUEUE_SIZE 64
+#define SD_SYS_RESERVE 4 /* writes never take the last ones */
+#define SD_EVT_MAX    (sizeof(ble_evt_t) + GATT_MTU_SIZE_DEFAULT)
+
+typedef struct
+{
+  bool     sys;
+  uint32_t id;
+  union
+  {
+    ble_evt_t ble;
+    uint8_t   raw[SD_EVT_MAX];
+  } evt;
+} sd_evt_t;
+
+static sd_evt_t sd_queue[SD_QUEUE_SIZE];
+static uint8_t  sd_head = 0;
+static uint8_t  sd_count = 0;
+static bool     sd_fetching = false;
+
+static softdevice_evt_schedule_func_t evt_schedule = NULL;
+static ble_evt_handler_t ble_handler = NULL;
+static sys_evt_handler_t sys_handler = NULL;
+
+/*
+ * Room for one more write from the peer. Once the application falls
+ * behind, the link layer holds further writes back rather than dropping
+ * them, and flash events always find a place.
+ */
+bool sd_write_room(void)
+{
+  return sd_count < SD_QUEUE_SIZE - SD_SYS_RESERVE;
+}
+
+/* SWI2: tell the application there is something to fetch */
+static void sd_raise(void)
+{
+  if (sd_count && evt_schedule && !sd_fetching)
+  {
+    sd_fetching = true;
+    evt_schedule();
+    sim_interrupt();
+  }
+}
+
+static sd_evt_t *sd_push(void)
+{
+  if (sd_count == SD_QUEUE_SIZE)
+  {
+    _debug_printf("softdevice queue full, event lost");
+    return NULL;
+  }
+  return &sd_queue[(sd_head + sd_count++) % SD_QUEUE_SIZE];
+}
+
+void sd_post_sys(uint32_t evt)
+{
+  sd_evt_t *slot = sd_push();
+
+  if (slot)
+  {
+    slot->sys = true;
+    slot->id = evt;
+    sd_raise();
+  }
+}
+
+/* GATT table, cccds get their value stored like the real stack does */
+#define SD_CHARS 8
+
+typedef struct
+{
+  uint16_t uuid;
+  uint16_t value_handle;
+  uint16_t cccd_handle;
+  uint16_t cccd;
+} sd_char_t;
+
+static sd_char_t sd_chars[SD_CHARS];
+static uint8_t   sd_char_count = 0;
+static uint16_t  sd_next_handle = 0x000C;
+
+void sd_post_ble(const ble_evt_t *evt, uint16_t len)
+{
+  if (len > SD_EVT_MAX)
+  {
+    return;
+  }
+
+  if (evt->header.evt_id == BLE_GATTS_EVT_WRITE)
+  {
+    const ble_gatts_evt_write_t *write = &evt->evt.gatts_evt.params.write;
+
+    for (uint8_t i = 0; i < sd_char_count; i++)
+    {
+      if (sd_chars[i].cccd_handle && write->handle == sd_chars[i].cccd_handle && write->len == 2)
+      {
+        sd_chars[i].cccd = write->data[0] | (write->data[1] << 8);
+      }
+    }
+  }
+
+  sd_evt_t *slot = sd_push();
+  if (slot)
+  {
+    slot->sys = false;
+    memcpy(slot->evt.raw, evt, len);
+    sd_raise();
+  }
+}
+
+/* Value or cccd handle of a characteristic, 0 if there is none */
+uint16_t sd_handle(uint16_t uuid, bool cccd)
+{
+  for (uint8_t i = 0; i < sd_char_count; i++)
+  {
+    if (sd_chars[i].uuid == uuid)
+    {
+      return cccd ? sd_chars[i].cccd_handle : sd_chars[i].value_handle;
+    }
+  }
+  return 0;
+}
+
+/* Scheduled by sd_raise, what softdevice_handler does in thread mode */
+static void sd_fetch(void *data, uint16_t size)
+{
+  sd_fetching = false;
+
+  while (sd_count)
+  {
+    sd_evt_t evt = sd_queue[sd_head];
+
+    sd_head = (sd_head + 1) % SD_QUEUE_SIZE;
+    sd_count--;
+
+    if (evt.sys && sys_handler)
+    {
+      sys_handler(evt.id);
+    }
+    else if (!evt.sys && ble_handler)
+    {
+      ble_handler(&evt.evt.ble);
+    }
+  }
+}
+
+uint32_t softdevice_handler_init(nrf_clock_lfclksrc_t clock_source, void * p_ble_evt_buffer,
+    uint16_t ble_evt_buffer_size, softdevice_evt_schedule_func_t evt_schedule_func)
+{
+  evt_schedule = evt_schedule_func;
+  sd_raise();
+  return NRF_SUCCESS;
+}
+
+uint32_t softdevice_evt_schedule(void)
+{
+  return app_sched_event_put(NULL, 0, sd_fetch);
+}
+
+uint32_t softdevice_ble_evt_handler_set(ble_evt_handler_t ble_evt_handler)
+{
+  ble_handler = ble_evt_handler;
+  return NRF_SUCCESS;
+}
+
+uint32_t softdevice_sys_evt_handler_set(sys_evt_handler_t sys_evt_handler)
+{
+  sys_handler = sys_evt_handler;
+  return NRF_SUCCESS;
+}
+
+uint32_t sd_app_evt_wait(void)
+{
+  sim_wait();
+  return NRF_SUCCESS;
+}
+
+/*
+ * Connection and notifications
+ *
+ * The link (sim/link.c) holds the notifications while they take up TX
+ * buffers and hands the buffers back after each connection event.
+ */
+
+static bool link_up = false;
+
+static ble_radio_notification_evt_handler_t radio_handler = NULL;
+static uint32_t                             radio_distance = 0; /* us */
+
+void sd_link(bool up)
+{
+  link_up = up;
+
+  if (!up)
+  {
+    for (uint8_t i = 0; i < sd_char_count; i++)
+    {
+      sd_chars[i].cccd = 0;
+    }
+  }
+}
+
+void sd_tx_complete(uint8_t count)
+{
+  ble_evt_t evt;
+
+  memset(&evt, 0, sizeof(evt));
+  evt.header.evt_id = BLE_EVT_TX_COMPLETE;
+  evt.header.evt_len = sizeof(ble_common_evt_t);
+  evt.evt.common_evt.params.tx_complete.count = count;
+  sd_post_ble(&evt, sizeof(evt));
+}
+
+/* SWI1: the radio is about to start or has just stopped */
+void sd_radio(bool active)
+{
+  if (radio_handler)
+  {
+    radio_handler(active);
+    sim_interrupt();
+  }
+}
+
+uint32_t sd_radio_distance(void)
+{
+  return radio_distance;
+}
+
+uint32_t sd_ble_tx_buffer_count_get(uint8_t * p_count)
+{
+  *p_count = link_tx_buffers();
+  return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_hvx(uint16_t conn_handle, ble_gatts_hvx_params_t const * p_hvx_params)
+{
+  if (!link_up || conn_handle != 0)
+  {
+    return BLE_ERROR_INVALID_CONN_HANDLE;
+  }
+
+  const sd_char_t *chr = NULL;
+  for (uint8_t i = 0; i < sd_char_count; i++)
+  {
+    if (sd_chars[i].value_handle == p_hvx_params->handle)
+    {
+      chr = &sd_chars[i];
+    }
+  }
+
+  if (!chr || !chr->cccd_handle)
+  {
+    return BLE_ERROR_INVALID_ATTR_HANDLE;
+  }
+
+  if (!(chr->cccd & BLE_GATT_HVX_NOTIFICATION))
+  {
+    return NRF_ERROR_INVALID_STATE;
+  }
+
+  if (*p_hvx_params->p_len > GATT_MTU_SIZE_DEFAULT - 3)
+  {
+    return NRF_ERROR_DATA_SIZE;
+  }
+
+  return link_notify(p_hvx_params->p_data, *p_hvx_params->p_len);
+}
+
+uint32_t sd_ble_uuid_vs_add(ble_uuid128_t const * p_vs_uuid, uint8_t * p_uuid_type)
+{
+  *p_uuid_type = BLE_UUID_TYPE_VENDOR_BEGIN;
+  return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_service_add(uint8_t type, ble_uuid_t const * p_uuid, uint16_t * p_handle)
+{
+  *p_handle = sd_next_handle++;
+  return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_characteristic_add(uint16_t service_handle, ble_gatts_char_md_t const * p_char_md,
+    ble_gatts_attr_t const * p_attr_char_value, ble_gatts_char_handles_t * p_handles)
+{
+  if (sd_char_count == SD_CHARS)
+  {
+    return NRF_ERROR_NO_MEM;
+  }
+
+  sd_char_t *chr = &sd_chars[sd_char_count++];
+
+  memset(p_handles, 0, sizeof(*p_handles));
+  sd_next_handle++; /* declaration */
+  chr->uuid = p_attr_char_value->p_uuid->uuid;
+  chr->value_handle = p_handles->value_handle = sd_next_handle++;
+  if (p_char_md->char_props.notify)
+  {
+    chr->cccd_handle = p_handles->cccd_handle = sd_next_handle++;
+  }
+  chr->cccd = 0;
+  return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_sys_attr_set(uint16_t conn_handle, uint8_t const * p_sys_attr_data, uint16_t len, uint32_t flags)
+{
+  return NRF_SUCCESS;
+}
+
+bool ble_srv_is_notification_enabled(uint8_t * p_encoded_data)
+{
+  uint16_t cccd = p_encoded_data[0] | (p_encoded_data[1] << 8);
+  return (cccd & BLE_GATT_HVX_NOTIFICATION) != 0;
+}
+
+uint32_t sd_ble_gap_device_name_set(ble_gap_conn_sec_mode_t const * p_write_perm, uint8_t const * p_dev_name, uint16_t len)
+{
+  return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_ppcp_set(ble_gap_conn_params_t const * p_conn_params)
+{
+  return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_conn_param_update(uint16_t conn_handle, ble_gap_conn_params_t const * p_conn_params)
+{
+  if (!link_up || conn_handle != 0)
+  {
+    return BLE_ERROR_INVALID_CONN_HANDLE;
+  }
+  return link_params(p_conn_params);
+}
+
+uint32_t sd_ble_gap_disconnect(uint16_t conn_handle, uint8_t hci_status_code)
+{
+  if (!link_up)
+  {
+    return BLE_ERROR_INVALID_CONN_HANDLE;
+  }
+  sim_disconnect();
+  return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_sec_params_reply(uint16_t conn_handle, uint8_t sec_status, void const * p_sec_params, void const * p_sec_keyset)
+{
+  return NRF_SUCCESS;
+}
+
+/* The rest of the stack, nothing to simulate */
+
+uint32_t sd_mbr_command(sd_mbr_command_t * param)
+{
+  return NRF_SUCCESS;
+}
+
+uint32_t sd_softdevice_vector_table_base_set(uint32_t address)
+{
+  return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_enable(ble_enable_params_t * p_ble_enable_params)
+{
+  return NRF_SUCCESS;
+}
+
+uint32_t ble_advertising_init(ble_advdata_t const * p_advdata, ble_advdata_t const * p_srdata,
+    ble_adv_modes_config_t const * p_config, ble_advertising_evt_handler_t const evt_handler,
+    ble_advertising_error_handler_t const error_handler)
+{
+  return NRF_SUCCESS;
+}
+
+uint32_t ble_advertising_start(ble_adv_mode_t advertising_mode)
+{
+  return NRF_SUCCESS;
+}
+
+void ble_advertising_on_ble_evt(ble_evt_t const * const p_ble_evt)
+{
+}
+
+uint32_t ble_radio_notification_init(nrf_app_irq_priority_t irq_priority,
+    nrf_radio_notification_distance_t distance, ble_radio_notification_evt_handler_t evt_handler)
+{
+  static const uint16_t distance_us[] = { 0, 800, 1740, 2680, 3620, 4560, 5500 };
+
+  if (distance > NRF_RADIO_NOTIFICATION_DISTANCE_5500US)
+  {
+    return NRF_ERROR_INVALID_PARAM;
+  }
+
+  radio_handler = evt_handler;
+  radio_distance = distance_us[distance];
+  return NRF_SUCCESS;
+}
+
+void pstorage_sys_event_handler(uint32_t sys_evt)
+{
+}
+
+/*
+ * Scheduler
+ *
+ * app_scheduler's queue with its limits: no event larger than configured,
+ * none more than the queue size.
+ */
+
+#define SCHED_SLOTS    32
+#define SCHED_DATA_MAX 16
+
+typedef struct
+{
+  app_sched_event_handler_t handler;
+  uint16_t                  size;
+  uint8_t                   data[SCHED_DATA_MAX];
+} sched_evt_t;
+
+static sched_evt_t sched_queue[SCHED_SLOTS];
+static uint16_t    sched_head = 0;
+static uint16_t    sched_count = 0;
+static uint16_t    sched_size = 0;
+static uint16_t    sched_max = 0;
+
+uint32_t app_sched_init(uint16_t max_event_size, uint16_t queue_size, void * p_evt_buffer)
+{
+  if (max_event_size > SCHED_DATA_MAX || queue_size > SCHED_SLOTS)
+  {
+    return NRF_ERROR_INVALID_PARAM;
+  }
+
+  sched_max = max_event_size;
+  sched_size = queue_size;
+  return NRF_SUCCESS;
+}
+
+uint32_t app_sched_event_put(void * p_event_data, uint16_t event_size, app_sched_event_handler_t handler)
+{
+  if (event_size > sched_max)
+  {
+    return NRF_ERROR_INVALID_LENGTH;
+  }
+
+  if (sched_count == sched_size)
+  {
+    return NRF_ERROR_NO_MEM;
+  }
+
+  sched_evt_t *evt = &sched_queue[(sched_head + sched_count) % SCHED_SLOTS];
+  evt->handler = handler;
+  evt->size = event_size;
+  if (p_event_data && event_size)
+  {
+    memcpy(evt->data, p_event_data, event_size);
+  }
+  sched_count++;
+  return NRF_SUCCESS;
+}
+
+void app_sched_execute(void)
+{
+  while (sched_count)
+  {
+    sched_evt_t evt = sched_queue[sched_head];
+
+    sched_head = (sched_head + 1) % SCHED_SLOTS;
+    sched_count--;
+    evt.handler(evt.size ? evt.data : NULL, evt.size);
+  }
+}
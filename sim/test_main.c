@@ -0,0 +1,1526 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sim.h"
+#include "ble_dfus.h"
+#include "crc32.h"
+#include "dfu_request.h"
+#include "encode.h"
+#include "flash.h"
+#include "stream.h"
+#include "timers.h"
+#include "nrf.h"
+
+/*
+ * Protocol regression tests against the simulated bootloader
+ *
+ * Every test runs in a child of its own (one boot per process), on a
+ * flash file that is erased first unless the test continues where the
+ * previous one left off.
+ */
+
+extern volatile uint32_t m_dfu_request; /* source/main.c, .noinit */
+bool steady_state_test = false; /* debug.h: print _debug_printf */
+
+static const char *flash_path = NULL;
+
+#define CHECK(cond) \
+do \
+{ \
+  if (!(cond)) \
+  { \
+    fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+    exit(1); \
+  } \
+} while (0)
+
+#define PAGE      96           /* first application page */
+#define PAGE_ADDR (PAGE * 1024)
+
+/* Boot on the test's flash, connect and listen */
+static void device(void)
+{
+  CHECK(sim_flash_open(flash_path));
+  sim_boot();
+  CHECK(sim_state() == SIM_RUNNING);
+
+  sim_connect();
+  sim_subscribe(BLE_UUID_DFUS_CTRL_CHAR, true);
+  sim_settle();
+}
+
+static void send(const void *cmd, uint16_t len)
+{
+  CHECK(sim_write(BLE_UUID_DFUS_CTRL_CHAR, cmd, len) == NRF_SUCCESS);
+  sim_settle();
+}
+
+static void send_data(const void *cmd, uint16_t len)
+{
+  CHECK(sim_write(BLE_UUID_DFUS_DATA_CHAR, cmd, len) == NRF_SUCCESS);
+}
+
+/* The next notification has to be exactly this */
+static void expect(const void *want, uint16_t len)
+{
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+  uint16_t got_len = sim_notification(got);
+
+  if (got_len != len || memcmp(got, want, len))
+  {
+    fprintf(stderr, "expected %u bytes, got %u:", len, got_len);
+    for (uint16_t i = 0; i < got_len; i++)
+    {
+      fprintf(stderr, " %02x", got[i]);
+    }
+    fprintf(stderr, "\n");
+  }
+  CHECK(got_len == len && !memcmp(got, want, len));
+}
+
+static void nothing_else(void)
+{
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+  CHECK(sim_notification(got) == 0);
+}
+
+/* A page that looks like the start of an application */
+static void image_page(uint8_t *page)
+{
+  for (uint16_t i = 0; i < 1024; i++)
+  {
+    page[i] = i * 7 + 3;
+  }
+  uint32_t vectors[2] = { 0x20004000, PAGE_ADDR + 0xC1 };
+  memcpy(page, vectors, sizeof(vectors));
+}
+
+static uint8_t timer_order[8];
+static uint8_t timer_count = 0;
+
+static void timer_fired(void *context)
+{
+  timer_order[timer_count++] = (uint8_t)(uintptr_t)context;
+}
+
+/* source/timers.c: soonest first across the wrap, expired in that order */
+static void test_timer_list(void)
+{
+  uint32_t due[5] = { 0xFFFFFFF0, 20, 0xFFFFFFF0, 5, 30 };
+  hw_timer_t timer[5];
+  hw_timer_t *list = NULL;
+
+  for (uint8_t i = 0; i < 5; i++)
+  {
+    timer[i].due = due[i];
+    timer[i].fn = timer_fired;
+    timer[i].context = (void *)(uintptr_t)i;
+    timers_insert(&list, &timer[i]);
+  }
+
+  /* the ones before the wrap first, equal ones in the order they came */
+  uint8_t order[5] = { 0, 2, 3, 1, 4 };
+  hw_timer_t *at = list;
+  for (uint8_t i = 0; i < 5; i++, at = at->next)
+  {
+    CHECK(at == &timer[order[i]]);
+  }
+  CHECK(!at);
+
+  timers_remove(&list, &timer[3]);
+  CHECK(!timer[3].next);
+  timers_remove(&list, &timer[3]); /* not in the list, nothing happens */
+
+  timers_expire(&list, 0xFFFFFFFF);
+  CHECK(timer_count == 2 && timer_order[0] == 0 && timer_order[1] == 2);
+  timers_expire(&list, 25);
+  CHECK(timer_count == 3 && timer_order[2] == 1 && list == &timer[4]);
+  timers_expire(&list, 29);
+  CHECK(timer_count == 3);
+  timers_expire(&list, 30);
+  CHECK(timer_count == 4 && timer_order[3] == 4 && !list);
+}
+
+/* source/timers.c: ticks round up, the compare goes to the sooner of the two */
+static void test_timer_clock(void)
+{
+  timers_clock_t clock = { 0 };
+  hw_timer_t timer = { .fn = timer_fired, .context = (void *)7 };
+  uint32_t due;
+
+  CHECK(timers_ticks(0) == 0);
+  CHECK(timers_ticks(1) == (RTC_TICK_HZ + 999) / 1000);
+  CHECK(timers_ticks(1000) == RTC_TICK_HZ);
+  CHECK(!timers_next(&clock, &due));
+
+  /* the wakeup just before the wrap, the timer just after it */
+  timers_wakeup(&clock, 0xFFFFFFE0 - timers_ticks(100), 100);
+  CHECK(timers_next(&clock, &due) && due == 0xFFFFFFE0);
+  timer.due = 0x10;
+  timers_insert(&clock.list, &timer);
+  CHECK(timers_next(&clock, &due) && due == 0xFFFFFFE0);
+
+  timers_fire(&clock, due);
+  CHECK(clock.wakeup_fired && !clock.wakeup_armed && clock.list == &timer);
+  CHECK(timers_next(&clock, &due) && due == 0x10);
+
+  /* a wakeup again, now later than the timer */
+  timers_wakeup(&clock, 0xFFFFFFF0, 1000);
+  CHECK(!clock.wakeup_fired);
+  CHECK(timers_next(&clock, &due) && due == 0x10);
+  timer_count = 0;
+  timers_fire(&clock, 0x10);
+  CHECK(!clock.wakeup_fired && timer_count == 1 && timer_order[0] == 7 && !clock.list);
+  CHECK(timers_next(&clock, &due) && due == 0xFFFFFFF0 + timers_ticks(1000));
+}
+
+/* The same list behind hw_timer_start, on the RTC's virtual time */
+static void test_timer_expiry(void)
+{
+  hw_timer_t timer[3];
+  uint32_t ms[3] = { 30, 10, 20 };
+
+  device();
+  uint64_t start = sim_now();
+
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    hw_timer_start(&timer[i], ms[i], timer_fired, (void *)(uintptr_t)i);
+  }
+  hw_timer_start(&timer[1], 40, timer_fired, (void *)1); /* moves it */
+  hw_timer_stop(&timer[0]);
+
+  sim_run(25000);
+  CHECK(timer_count == 1 && timer_order[0] == 2);
+  CHECK(sim_now() - start >= 20000);
+  sim_run(20000);
+  CHECK(timer_count == 2 && timer_order[1] == 1);
+  sim_run(100000);
+  CHECK(timer_count == 2);
+}
+
+static void test_blank_enters_bootloader(void)
+{
+  CHECK(sim_flash_open(flash_path));
+  sim_boot();
+  CHECK(sim_state() == SIM_RUNNING);
+  CHECK(!sim_launched());
+}
+
+static void test_info_and_errors(void)
+{
+  device();
+
+  send("i", 1);
+  uint8_t info[13] = { 'i', 0x00, 0x00, 0x00, 0x72, 0x51, 0xD0, 0xF1, 0xCE, 0x7E, 0x57, 0x00, 0x01 };
+  expect(info, sizeof(info));
+
+  send("ehello", 6);
+  expect("hello", 5);
+
+  send("x", 1);
+  expect("! Unknown Cmd", 13);
+
+  send("d\x10", 2);
+  expect("! invalid page", 14);
+
+  send("d", 1);
+  expect("! invalid args", 14);
+  nothing_else();
+}
+
+static void test_erase_write_read(void)
+{
+  device();
+
+  uint8_t erase[2] = { 'd', PAGE };
+  send(erase, sizeof(erase));
+  uint8_t erased[5] = { 'd', PAGE, 'O', 'K', 1 }; /* was blank */
+  expect(erased, sizeof(erased));
+
+  uint8_t write[19] = { 'w', PAGE, 5 };
+  for (uint8_t i = 0; i < 16; i++)
+  {
+    write[3 + i] = i < 12 ? 0x10 + i : 0xFF;
+  }
+  send(write, sizeof(write));
+  uint8_t written[6] = { 'w', PAGE, 5, 'O', 'K', 1 }; /* last word all 0xFF */
+  expect(written, sizeof(written));
+  CHECK(!memcmp(sim_flash + PAGE_ADDR + 5 * 16, &write[3], 16));
+
+  uint8_t read[3] = { 'r', PAGE, 5 };
+  send(read, sizeof(read));
+  uint8_t readback[19] = { 'r', PAGE, 5 };
+  memcpy(&readback[3], &write[3], 16);
+  expect(readback, sizeof(readback));
+
+  send(erase, sizeof(erase));
+  erased[4] = 0;
+  expect(erased, sizeof(erased));
+  CHECK(sim_flash[PAGE_ADDR + 5 * 16] == 0xFF);
+  nothing_else();
+}
+
+static bool page_is(uint8_t page, uint8_t value)
+{
+  for (uint16_t i = 0; i < 1024; i++)
+  {
+    if (sim_flash[page * 1024 + i] != value)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Erase ahead only ever touches pages inside the range the host gave */
+static void test_erase_ahead(void)
+{
+  device();
+  memset(sim_flash + PAGE_ADDR + 1024, 0x5A, 3 * 1024);
+
+  uint8_t no_range[2] = { 's', 0x04 };
+  send(no_range, sizeof(no_range));
+  expect("! invalid args", 14);
+
+  uint8_t outside[5] = { 's', 0x04, 16, 238, 3 };
+  send(outside, sizeof(outside));
+  expect("! invalid page", 14);
+
+  uint8_t session[5] = { 's', 0x04, 16, PAGE, 2 };
+  send(session, sizeof(session));
+  uint8_t ok[4] = { 's', 0x04, 'O', 'K' };
+  expect(ok, sizeof(ok));
+
+  uint8_t erase[2] = { 'd', PAGE };
+  send(erase, sizeof(erase));
+  uint8_t erased[5] = { 'd', PAGE, 'O', 'K', 1 };
+  expect(erased, sizeof(erased));
+
+  uint8_t write[19] = { 'w', PAGE, 0 };
+  memset(&write[3], 0x42, 16);
+  send(write, sizeof(write));
+  uint8_t written[6] = { 'w', PAGE, 0, 'O', 'K', 0 };
+  expect(written, sizeof(written));
+  CHECK(page_is(PAGE + 1, 0xFF));
+  CHECK(page_is(PAGE + 2, 0x5A));
+
+  /* the last page of the range, the one after it is not the host's */
+  write[1] = written[1] = PAGE + 1;
+  send(write, sizeof(write));
+  expect(written, sizeof(written));
+  CHECK(page_is(PAGE + 2, 0x5A));
+  nothing_else();
+}
+
+/* 'D' counts down, and a new range takes over from one still running */
+static void test_range_erase(void)
+{
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+
+  device();
+  memset(sim_flash + PAGE_ADDR, 0x5A, 30 * 1024);
+  memset(sim_flash + PAGE_ADDR + 1024, 0xFF, 1024);
+
+  uint8_t range[3] = { 'D', PAGE, 3 };
+  send(range, sizeof(range));
+  uint8_t progress[3][6] =
+  {
+    { 'D', PAGE,     'O', 'K', 0, 2 },
+    { 'D', PAGE + 1, 'O', 'K', 1, 1 }, /* was blank */
+    { 'D', PAGE + 2, 'O', 'K', 0, 0 },
+  };
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    expect(progress[i], sizeof(progress[i]));
+  }
+  nothing_else();
+
+  uint8_t old[3] = { 'D', PAGE + 3, 10 };
+  uint8_t replacing[3] = { 'D', PAGE + 20, 2 };
+  CHECK(sim_write(BLE_UUID_DFUS_CTRL_CHAR, old, sizeof(old)) == NRF_SUCCESS);
+  CHECK(sim_write(BLE_UUID_DFUS_CTRL_CHAR, replacing, sizeof(replacing)) == NRF_SUCCESS);
+  sim_settle();
+
+  /* whatever of the old range was queued already finishes, counting for it */
+  uint8_t page = PAGE + 3;
+  while (sim_notification(got) == 6 && got[1] < PAGE + 20)
+  {
+    CHECK(got[0] == 'D' && got[1] == page && got[5] == PAGE + 13 - page - 1);
+    page++;
+  }
+  CHECK(page > PAGE + 3 && page < PAGE + 13);
+  for (uint8_t left = page; left < PAGE + 13; left++)
+  {
+    CHECK(page_is(left, 0x5A));
+  }
+
+  uint8_t last[6] = { 'D', PAGE + 21, 'O', 'K', 0, 0 };
+  CHECK(got[0] == 'D' && got[1] == PAGE + 20 && got[5] == 1);
+  expect(last, sizeof(last));
+  CHECK(page_is(PAGE + 20, 0xFF) && page_is(PAGE + 21, 0xFF) && page_is(PAGE + 22, 0x5A));
+  nothing_else();
+}
+
+/* A failed erase stops the range, the page can be erased again later */
+static void test_range_erase_fails(void)
+{
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+
+  device();
+  memset(sim_flash + PAGE_ADDR, 0x5A, 10 * 1024);
+
+  /* the first change drops the image record, get that out of the way */
+  uint8_t touch[2] = { 'd', PAGE + 20 };
+  send(touch, sizeof(touch));
+  uint8_t touched[5] = { 'd', PAGE + 20, 'O', 'K', 1 };
+  expect(touched, sizeof(touched));
+
+  sim_flash_timing.failures = FLASH_RETRIES + 1;
+  uint8_t range[3] = { 'D', PAGE, 10 };
+  send(range, sizeof(range));
+  expect("! erase failed", 14);
+
+  /* what was queued behind it still goes, nothing more */
+  uint8_t page = PAGE + 1;
+  while (sim_notification(got))
+  {
+    CHECK(got[0] == 'D' && got[1] == page && got[5] == PAGE + 10 - page - 1);
+    page++;
+  }
+  CHECK(page > PAGE + 1 && page < PAGE + 10);
+  CHECK(page_is(PAGE, 0x5A) && page_is(PAGE + 9, 0x5A));
+
+  uint8_t erase[2] = { 'd', PAGE };
+  send(erase, sizeof(erase));
+  uint8_t erased[5] = { 'd', PAGE, 'O', 'K', 0 };
+  expect(erased, sizeof(erased));
+  CHECK(page_is(PAGE, 0xFF));
+  nothing_else();
+}
+
+/* Erase and write cost what the NVMC takes, and only ever clear bits */
+static void test_flash_timing(void)
+{
+  const sim_flash_stats_t *stats = sim_flash_stats();
+
+  device();
+
+  /* not blank, so the erase is not skipped */
+  memset(sim_flash + PAGE_ADDR, 0x00, 1024);
+
+  uint64_t start = sim_now();
+  uint8_t erase[2] = { 'd', PAGE };
+  send(erase, sizeof(erase));
+  uint8_t erased[5] = { 'd', PAGE, 'O', 'K', 0 };
+  expect(erased, sizeof(erased));
+  CHECK(stats->erases == 1);
+  CHECK(sim_now() - start >= SIM_FLASH_ERASE_US);
+
+  /* dropping the validity record went along with the first erase */
+  uint32_t words = stats->words;
+  uint8_t write[19] = { 'w', PAGE, 0 };
+  memset(&write[3], 0x42, 16);
+  send(write, sizeof(write));
+  uint8_t written[6] = { 'w', PAGE, 0, 'O', 'K', 0 };
+  expect(written, sizeof(written));
+  CHECK(stats->words == words + 4);
+  CHECK(stats->busy_us == stats->erases * SIM_FLASH_ERASE_US + stats->words * SIM_FLASH_WORD_US +
+      (stats->erases + stats->writes) * SIM_FLASH_OP_US);
+  CHECK(!stats->set_bits && !stats->overwrites);
+  nothing_else();
+}
+
+static void test_windowed_page(void)
+{
+  uint8_t page[1024];
+
+  image_page(page);
+  device();
+
+  /* the page holds junk, auto erase has to clear it first */
+  memset(sim_flash + PAGE_ADDR, 0x5A, 1024);
+
+  uint8_t session[3] = { 's', 0x0A, 64 };
+  send(session, sizeof(session));
+  uint8_t ok[4] = { 's', 0x0B, 'O', 'K' };
+  expect(ok, sizeof(ok));
+
+  for (uint8_t chunk = 0; chunk < 64; chunk++)
+  {
+    uint8_t write[19] = { 'w', PAGE, chunk };
+    memcpy(&write[3], &page[chunk * 16], 16);
+    send_data(write, sizeof(write));
+  }
+  sim_settle();
+
+  uint8_t ack[10] = { 'a', PAGE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+  expect(ack, sizeof(ack));
+  uint8_t committed[6] = { 'c', PAGE, 'O', 'K', 0, 0 };
+  expect(committed, sizeof(committed));
+  CHECK(!memcmp(sim_flash + PAGE_ADDR, page, 1024));
+
+  /* a late copy of a chunk must not open the page again */
+  uint8_t late[19] = { 'w', PAGE, 5 };
+  memcpy(&late[3], &page[5 * 16], 16);
+  send_data(late, sizeof(late));
+  uint8_t query[2] = { 'q', PAGE };
+  send(query, sizeof(query));
+  expect(ack, sizeof(ack));
+  nothing_else();
+
+  /* staged: still acked, and both slots stay free for the next pages */
+  uint8_t staged_session[2] = { 's', 0x09 };
+  send(staged_session, sizeof(staged_session));
+  uint8_t staged_ok[4] = { 's', 0x09, 'O', 'K' };
+  expect(staged_ok, sizeof(staged_ok));
+
+  for (uint8_t chunk = 0; chunk < 64; chunk++)
+  {
+    uint8_t write[19] = { 'w', PAGE + 1, chunk };
+    memcpy(&write[3], &page[chunk * 16], 16);
+    send_data(write, sizeof(write));
+  }
+  late[1] = PAGE + 1;
+  send_data(late, sizeof(late));
+  sim_settle();
+
+  for (uint8_t chunk = 0; chunk < 64; chunk++)
+  {
+    uint8_t staged[5] = { 'w', PAGE + 1, chunk, 'O', 'K' };
+    expect(staged, sizeof(staged));
+  }
+  uint8_t again[5] = { 'w', PAGE + 1, 5, 'O', 'K' }; /* while the page is on its way */
+  expect(again, sizeof(again));
+  committed[1] = PAGE + 1;
+  expect(committed, sizeof(committed));
+
+  for (uint8_t p = PAGE + 2; p < PAGE + 4; p++)
+  {
+    uint8_t write[19] = { 'w', p, 0 };
+    send(write, sizeof(write));
+    uint8_t staged[5] = { 'w', p, 0, 'O', 'K' };
+    expect(staged, sizeof(staged));
+  }
+  nothing_else();
+}
+
+/* Scattered 0xFF words go along with the rest, only a long run is left out */
+static void test_scattered_blanks(void)
+{
+  const sim_flash_stats_t *stats = sim_flash_stats();
+  uint8_t page[1024];
+
+  image_page(page);
+  for (uint16_t word = 3; word < 128; word += 4)
+  {
+    memset(&page[word * 4], 0xFF, 4);
+  }
+  memset(&page[512], 0xFF, 512);
+  device();
+
+  uint8_t session[3] = { 's', 0x0A, 64 };
+  send(session, sizeof(session));
+  uint8_t ok[4] = { 's', 0x0B, 'O', 'K' };
+  expect(ok, sizeof(ok));
+
+  uint32_t writes = stats->writes;
+  for (uint8_t chunk = 0; chunk < 64; chunk++)
+  {
+    uint8_t write[19] = { 'w', PAGE, chunk };
+    memcpy(&write[3], &page[chunk * 16], 16);
+    send_data(write, sizeof(write));
+  }
+  sim_settle();
+
+  uint8_t ack[10] = { 'a', PAGE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+  expect(ack, sizeof(ack));
+  uint8_t committed[6] = { 'c', PAGE, 'O', 'K', 129, 0 }; /* the tail from word 127 on */
+  expect(committed, sizeof(committed));
+  CHECK(stats->writes == writes + 2); /* the page, and the word dropping the image record */
+  CHECK(!memcmp(sim_flash + PAGE_ADDR, page, 1024));
+  nothing_else();
+}
+
+/* Writes piling up behind a long erase must not crowd out its event */
+static void test_erase_backlog(void)
+{
+  uint8_t page[1024];
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+  uint8_t commits = 0;
+
+  image_page(page);
+  sim_flash_timing.erase_us = 300000;
+  device();
+
+  memset(sim_flash + PAGE_ADDR, 0x5A, 3 * 1024);
+
+  uint8_t session[3] = { 's', 0x0A, 64 };
+  send(session, sizeof(session));
+  uint8_t ok[4] = { 's', 0x0B, 'O', 'K' };
+  expect(ok, sizeof(ok));
+
+  for (uint8_t p = 0; p < 3; p++)
+  {
+    for (uint8_t chunk = 0; chunk < 64; chunk++)
+    {
+      uint8_t write[19] = { 'w', PAGE + p, chunk };
+      memcpy(&write[3], &page[chunk * 16], 16);
+      send_data(write, sizeof(write));
+    }
+  }
+  sim_run(3 * 300000); /* both erases, settling alone would stop during one */
+  sim_settle();
+
+  uint16_t len;
+  while ((len = sim_notification(got)))
+  {
+    if (got[0] == 'c')
+    {
+      CHECK(len == 6 && got[2] == 'O' && got[1] == PAGE + commits);
+      commits++;
+    }
+  }
+  CHECK(commits == 2); /* the third page found no room, the host sends it again */
+  CHECK(!memcmp(sim_flash + PAGE_ADDR, page, 1024));
+  CHECK(!memcmp(sim_flash + PAGE_ADDR + 1024, page, 1024));
+}
+
+/*
+ * 'z' and 'p' streams, sent the way a host does: packets as long as they
+ * go, never more than the FIFO beyond the last credit
+ */
+
+#define STREAM_PAYLOAD (BLE_DFUS_MAX_DATA_LEN - 1)
+
+static uint32_t stream_sent;
+static uint32_t stream_acked;
+static uint8_t  stream_commits;
+
+/* The next notification, waiting for it */
+static uint16_t next_reply(uint8_t *got)
+{
+  uint64_t until = sim_now() + 10000000;
+  uint16_t len;
+
+  while (!(len = sim_notification(got)))
+  {
+    CHECK(sim_now() < until && sim_step());
+  }
+  return len;
+}
+
+/* Credit and commits are taken note of, false for anything else */
+static bool stream_progress(char cmd, const uint8_t *got, uint16_t len)
+{
+  if (len == 5 && got[0] == cmd - 'a' + 'A')
+  {
+    memcpy(&stream_acked, &got[1], 4);
+    return true;
+  }
+  if (len == 6 && got[0] == 'c')
+  {
+    stream_commits++;
+    return true;
+  }
+  return false;
+}
+
+/* The next reply that is neither credit nor a commit */
+static uint16_t stream_reply(char cmd, uint8_t *got)
+{
+  uint16_t len;
+
+  while (stream_progress(cmd, got, len = next_reply(got)))
+  {
+  }
+  return len;
+}
+
+static void stream_open(char cmd, uint8_t page)
+{
+  uint8_t start[2] = { cmd, page };
+  send(start, sizeof(start));
+  uint8_t ok[6] = { cmd, page, 'O', 'K', STREAM_FIFO_SIZE & 0xFF, STREAM_FIFO_SIZE >> 8 };
+  expect(ok, sizeof(ok));
+
+  stream_sent = 0;
+  stream_acked = 0;
+  stream_commits = 0;
+}
+
+static void stream_data(char cmd, const uint8_t *data, size_t len)
+{
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+
+  for (size_t sent = 0; sent < len; )
+  {
+    size_t n = len - sent < STREAM_PAYLOAD ? len - sent : STREAM_PAYLOAD;
+
+    while (stream_sent + n - stream_acked > STREAM_FIFO_SIZE)
+    {
+      uint16_t got_len = next_reply(got);
+
+      if (!stream_progress(cmd, got, got_len))
+      {
+        got[got_len < sizeof(got) ? got_len : sizeof(got) - 1] = 0;
+        fprintf(stderr, "unexpected reply mid-stream: %s\n", got);
+        exit(1);
+      }
+    }
+
+    while (!sim_write_space())
+    {
+      CHECK(sim_step());
+    }
+
+    uint8_t packet[GATT_MTU_SIZE_DEFAULT] = { cmd - 'a' + 'A' };
+    memcpy(&packet[1], &data[sent], n);
+    send_data(packet, n + 1);
+    sent += n;
+    stream_sent += n;
+  }
+}
+
+/* End the stream, the reply to that */
+static uint16_t stream_end(char cmd, uint8_t *got)
+{
+  CHECK(sim_write(BLE_UUID_DFUS_CTRL_CHAR, (const uint8_t *)&cmd, 1) == NRF_SUCCESS);
+  return stream_reply(cmd, got);
+}
+
+/* The page a failed stream had started is free again */
+static void page_dropped(uint8_t page)
+{
+  uint8_t query[2] = { 'q', page };
+  send(query, sizeof(query));
+  uint8_t none[10] = { 'a', page };
+  expect(none, sizeof(none));
+}
+
+/* Hard to compress, with long matches from at on */
+static void stream_image(uint8_t *image, size_t len, size_t at)
+{
+  uint32_t seed = 1;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    image[i] = seed >> 16;
+  }
+  memcpy(&image[at], &image[at - 700], len - at);
+}
+
+/* Several times the FIFO, so credit and data wrap around it */
+static void test_lz_stream(void)
+{
+  uint8_t image[4 * 1024 + 20];
+  uint8_t packed[ENCODE_MAX(sizeof(image))];
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+
+  stream_image(image, sizeof(image), 4 * 1024 - 40); /* one last match, across a page */
+  size_t len = encode_lz(image, sizeof(image), packed);
+  CHECK(len > 4 * STREAM_FIFO_SIZE);
+  device();
+  memset(sim_flash + PAGE_ADDR, 0x5A, 5 * 1024);
+
+  uint8_t session[2] = { 's', 0x08 }; /* auto erase */
+  send(session, sizeof(session));
+  uint8_t ok[4] = { 's', 0x08, 'O', 'K' };
+  expect(ok, sizeof(ok));
+
+  stream_open('z', PAGE);
+  stream_data('z', packed, len);
+  uint8_t done[6] = { 'z', 'E' };
+  uint32_t written = sizeof(image);
+  memcpy(&done[2], &written, 4);
+  CHECK(stream_end('z', got) == 6 && !memcmp(got, done, 6));
+
+  while (stream_commits < 5)
+  {
+    uint16_t got_len = next_reply(got);
+    CHECK(stream_progress('z', got, got_len));
+  }
+  CHECK(stream_acked == len);
+  CHECK(!memcmp(sim_flash + PAGE_ADDR, image, sizeof(image)));
+  nothing_else();
+}
+
+/* A match reaching back before the first byte */
+static void test_lz_bad_reference(void)
+{
+  uint8_t stream[21] = { 0xFF };
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+
+  memset(&stream[1], 'A', 8);
+  stream[9] = 0xFF;
+  memset(&stream[10], 'B', 8);
+  stream[18] = 0x00;
+  stream[19] = 99; /* distance 100, 16 bytes out so far */
+  stream[20] = 0x00;
+
+  device();
+  stream_open('z', PAGE);
+  stream_data('z', stream, sizeof(stream));
+  CHECK(stream_reply('z', got) == 12 && !memcmp(got, "! bad stream", 12));
+  page_dropped(PAGE);
+
+  uint8_t more[2] = { 'Z', 0xFF };
+  send(more, sizeof(more));
+  expect("! no stream", 11);
+  nothing_else();
+}
+
+/* The end comes with half a match token still to go */
+static void test_lz_ends_mid_token(void)
+{
+  uint8_t stream[20] = { 0xFF };
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+
+  memset(&stream[1], 'A', 8);
+  stream[9] = 0xFF;
+  memset(&stream[10], 'B', 8);
+  stream[18] = 0x00;
+  stream[19] = 0x02; /* low byte only */
+
+  device();
+  stream_open('z', PAGE);
+  stream_data('z', stream, sizeof(stream));
+  CHECK(stream_end('z', got) == 12 && !memcmp(got, "! bad stream", 12));
+  CHECK(stream_acked == sizeof(stream));
+  page_dropped(PAGE);
+  nothing_else();
+}
+
+/* Packets with no stream bytes, or for the other stream, change nothing */
+static void test_lz_missing_bytes(void)
+{
+  uint8_t image[1024];
+  uint8_t packed[ENCODE_MAX(sizeof(image))];
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+
+  stream_image(image, sizeof(image), sizeof(image) - 200);
+  size_t len = encode_lz(image, sizeof(image), packed);
+  device();
+
+  stream_open('z', PAGE);
+  stream_data('z', packed, 100);
+  send("Z", 1);
+  CHECK(stream_reply('z', got) == 14 && !memcmp(got, "! invalid args", 14));
+  uint8_t patch[2] = { 'P', 0x00 };
+  send(patch, sizeof(patch));
+  CHECK(stream_reply('z', got) == 11 && !memcmp(got, "! no stream", 11));
+
+  stream_data('z', packed + 100, len - 100);
+  uint8_t done[6] = { 'z', 'E' };
+  uint32_t written = sizeof(image);
+  memcpy(&done[2], &written, 4);
+  CHECK(stream_end('z', got) == 6 && !memcmp(got, done, 6));
+  while (stream_commits < 1)
+  {
+    uint16_t got_len = next_reply(got);
+    CHECK(stream_progress('z', got, got_len));
+  }
+  CHECK(!memcmp(sim_flash + PAGE_ADDR, image, sizeof(image)));
+  nothing_else();
+}
+
+/* Waits until the stream's pages have all been committed */
+static void stream_committed(char cmd, uint8_t pages)
+{
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+
+  while (stream_commits < pages)
+  {
+    uint16_t len = next_reply(got);
+    CHECK(stream_progress(cmd, got, len));
+  }
+}
+
+/* Two pages with contents of their own, the installed application */
+static void installed_pages(uint8_t *old)
+{
+  for (uint16_t i = 0; i < 2048; i++)
+  {
+    old[i] = i < 1024 ? 'A' + i % 7 : 'a' + i % 11;
+  }
+  memcpy(sim_flash + PAGE_ADDR, old, 2048);
+}
+
+/* The pages swap places: the second copies the first from the scratch page */
+static void test_patch_swap(void)
+{
+  uint8_t old[2048];
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+  uint8_t patch[8] =
+  {
+    0xC3, 0xFF, 0x00, 0x04, /* 1024 bytes from one page on */
+    0xC3, 0xFF, 0x00, 0xF8, /* 1024 bytes from two pages back */
+  };
+
+  device();
+  installed_pages(old);
+
+  stream_open('p', PAGE);
+  stream_data('p', patch, 4);
+  stream_committed('p', 1); /* the first page is rewritten in flash by now */
+  stream_data('p', patch + 4, 4);
+  uint8_t done[6] = { 'p', 'E', 0x00, 0x08 };
+  CHECK(stream_end('p', got) == 6 && !memcmp(got, done, 6));
+  stream_committed('p', 2);
+  CHECK(!memcmp(sim_flash + PAGE_ADDR, old + 1024, 1024));
+  CHECK(!memcmp(sim_flash + PAGE_ADDR + 1024, old, 1024));
+  nothing_else();
+}
+
+/* One copy op of three pages: the output goes on with the FIFO empty */
+static void test_patch_long_copy(void)
+{
+  uint8_t old[4096];
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+  uint8_t patch[4] = { 0xCB, 0xFF, 0x00, 0x04 }; /* 3072 bytes from one page on */
+
+  stream_image(old, sizeof(old), sizeof(old));
+  device();
+  memcpy(sim_flash + PAGE_ADDR, old, sizeof(old));
+
+  stream_open('p', PAGE);
+  stream_data('p', patch, sizeof(patch));
+  uint8_t done[6] = { 'p', 'E', 0x00, 0x0C };
+  CHECK(stream_end('p', got) == 6 && !memcmp(got, done, 6));
+  stream_committed('p', 3);
+  CHECK(!memcmp(sim_flash + PAGE_ADDR, old + 1024, 3072));
+  CHECK(!memcmp(sim_flash + PAGE_ADDR + 3072, old + 3072, 1024));
+  nothing_else();
+}
+
+/* Sources before the application, or in a page already rebuilt, are refused */
+static void test_patch_bad_source(void)
+{
+  uint8_t old[2048];
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+  uint8_t before[4] = { 0xC0, 0x0F, 0x00, 0xF8 }; /* 16 bytes from two pages back */
+  uint8_t rebuilt[8] =
+  {
+    0x83, 0xFF,             /* the first page as it was */
+    0x83, 0xFF,             /* the second one too */
+    0xC0, 0x0F, 0x00, 0xF8, /* the first one again, overwritten by now */
+  };
+
+  device();
+  installed_pages(old);
+  memset(sim_flash + PAGE_ADDR + 2048, 0x5A, 1024);
+
+  stream_open('p', PAGE);
+  stream_data('p', before, sizeof(before));
+  CHECK(stream_reply('p', got) == 12 && !memcmp(got, "! bad stream", 12));
+
+  stream_open('p', PAGE);
+  stream_data('p', rebuilt, sizeof(rebuilt));
+  CHECK(stream_reply('p', got) == 12 && !memcmp(got, "! bad stream", 12));
+  page_dropped(PAGE + 2);
+  CHECK(!memcmp(sim_flash + PAGE_ADDR, old, 2048));
+  CHECK(page_is(PAGE + 2, 0x5A));
+  nothing_else();
+}
+
+/* The end comes in the middle of a literal, or of an op header */
+static void test_patch_ends_mid_op(void)
+{
+  uint8_t old[2048];
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+  uint8_t literal[21] = { 0x7F }; /* 128 bytes announced, 20 come */
+  uint8_t header[3] = { 0x80, 0x0F, 0xC0 };
+
+  memset(&literal[1], 0x42, 20);
+  device();
+  installed_pages(old);
+
+  stream_open('p', PAGE);
+  stream_data('p', literal, sizeof(literal));
+  CHECK(stream_end('p', got) == 12 && !memcmp(got, "! bad stream", 12));
+  page_dropped(PAGE);
+
+  stream_open('p', PAGE);
+  stream_data('p', header, sizeof(header));
+  CHECK(stream_end('p', got) == 12 && !memcmp(got, "! bad stream", 12));
+  page_dropped(PAGE);
+  CHECK(!memcmp(sim_flash + PAGE_ADDR, old, 2048));
+  nothing_else();
+}
+
+/* 'z' and 'p' share their decoder's RAM, each start has to begin afresh */
+static void test_stream_switch(void)
+{
+  uint8_t old[2048];
+  uint8_t image[1024];
+  uint8_t packed[ENCODE_MAX(sizeof(image))];
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+  uint8_t swap[8] = { 0xC3, 0xFF, 0x00, 0x04, 0xC3, 0xFF, 0x00, 0xF8 };
+
+  stream_image(image, sizeof(image), sizeof(image) - 200);
+  size_t packed_len = encode_lz(image, sizeof(image), packed);
+  size_t len;
+  device();
+  installed_pages(old);
+  memset(sim_flash + PAGE_ADDR + 2048, 0xFF, 1024);
+
+  /* a 'z' left halfway for a patch */
+  stream_open('z', PAGE + 2);
+  stream_data('z', packed, 150);
+  sim_settle();
+  while ((len = sim_notification(got)))
+  {
+    CHECK(len == 5 && got[0] == 'Z');
+  }
+  stream_open('p', PAGE);
+  stream_data('p', swap, sizeof(swap));
+  uint8_t patched[6] = { 'p', 'E', 0x00, 0x08 };
+  CHECK(stream_end('p', got) == 6 && !memcmp(got, patched, 6));
+  stream_committed('p', 2);
+  CHECK(page_is(PAGE + 2, 0xFF));
+
+  /* then the whole 'z', then the patch once more, swapping back */
+  stream_open('z', PAGE + 2);
+  stream_data('z', packed, packed_len);
+  uint8_t unpacked[6] = { 'z', 'E', 0x00, 0x04 };
+  CHECK(stream_end('z', got) == 6 && !memcmp(got, unpacked, 6));
+  stream_committed('z', 1);
+
+  stream_open('p', PAGE);
+  stream_data('p', swap, sizeof(swap));
+  CHECK(stream_end('p', got) == 6 && !memcmp(got, patched, 6));
+  stream_committed('p', 2);
+  CHECK(!memcmp(sim_flash + PAGE_ADDR, old, 2048));
+  CHECK(!memcmp(sim_flash + PAGE_ADDR + 2048, image, 1024));
+  nothing_else();
+}
+
+/* With the TX ring full, commands wait rather than lose their replies */
+static void test_tx_backpressure(void)
+{
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+  uint8_t hashes = 0;
+  uint8_t echoes = 0;
+  uint16_t len;
+
+  sim_link.down_per_event = 1;
+  device();
+
+  /* 36 replies of hashes take the ring down to its reserve */
+  uint8_t hash[3] = { 'h', 96, 239 };
+  CHECK(sim_write(BLE_UUID_DFUS_CTRL_CHAR, hash, sizeof(hash)) == NRF_SUCCESS);
+  for (uint8_t i = 0; i < 16; i++)
+  {
+    uint8_t echo[2] = { 'e', i };
+    CHECK(sim_write(BLE_UUID_DFUS_CTRL_CHAR, echo, sizeof(echo)) == NRF_SUCCESS);
+  }
+  sim_settle();
+
+  while ((len = sim_notification(got)))
+  {
+    if (got[0] == 'h')
+    {
+      CHECK(len == 2 + 4 * 4 && got[1] == 96 + 4 * hashes);
+      hashes++;
+      continue;
+    }
+    CHECK(len == 1 && got[0] == echoes);
+    echoes++;
+  }
+  CHECK(hashes == 36 && echoes == 16);
+}
+
+/* The next 'r' of a read-back has to match flash, chunk after chunk */
+static void read_chunk(const uint8_t *got, uint16_t len, uint32_t addr)
+{
+  CHECK(len == 19 && got[0] == 'r' && got[1] == addr / 1024 && got[2] == addr % 1024 / 16);
+  CHECK(!memcmp(&got[3], sim_flash + addr, 16));
+}
+
+/* A range reads back as the 'r' replies of all its chunks */
+static void test_range_read(void)
+{
+  uint8_t image[2048];
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+
+  stream_image(image, sizeof(image), sizeof(image));
+  device();
+  memcpy(sim_flash + PAGE_ADDR, image, sizeof(image));
+
+  uint8_t read[3] = { 'R', PAGE, PAGE + 1 };
+  send(read, sizeof(read));
+  for (uint32_t addr = PAGE_ADDR; addr < PAGE_ADDR + 2048; addr += 16)
+  {
+    read_chunk(got, sim_notification(got), addr);
+  }
+  nothing_else();
+}
+
+/* 'R' on its own stops a range halfway */
+static void test_range_read_cancel(void)
+{
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+  uint32_t addr = PAGE_ADDR;
+  uint16_t len;
+
+  sim_link.down_per_event = 1;
+  device();
+
+  uint8_t read[3] = { 'R', PAGE, PAGE + 9 };
+  CHECK(sim_write(BLE_UUID_DFUS_CTRL_CHAR, read, sizeof(read)) == NRF_SUCCESS);
+  sim_run(100000);
+  send("R", 1);
+  while ((len = sim_notification(got)))
+  {
+    read_chunk(got, len, addr);
+    addr += 16;
+  }
+  CHECK(addr > PAGE_ADDR && addr < PAGE_ADDR + 1024);
+
+  /* and a new one starts from its own beginning */
+  read[2] = PAGE;
+  send(read, sizeof(read));
+  for (addr = PAGE_ADDR; addr < PAGE_ADDR + 1024; addr += 16)
+  {
+    read_chunk(got, sim_notification(got), addr);
+  }
+  nothing_else();
+}
+
+/* Other commands wait for the full ring alongside a read-back */
+static void test_range_read_backpressure(void)
+{
+  uint8_t image[3072];
+  uint8_t got[GATT_MTU_SIZE_DEFAULT];
+  uint32_t addr = PAGE_ADDR;
+  bool hashed = false;
+  bool echoed = false;
+  bool written = false;
+  uint16_t len;
+
+  stream_image(image, sizeof(image), sizeof(image));
+  sim_link.down_per_event = 1;
+  device();
+  memcpy(sim_flash + PAGE_ADDR, image, sizeof(image));
+
+  uint8_t read[3] = { 'R', PAGE, PAGE + 2 };
+  uint8_t hash[2] = { 'h', PAGE + 1 };
+  uint8_t echo[2] = { 'e', 'x' };
+  uint8_t write[19] = { 'w', PAGE + 5, 0 };
+  memset(&write[3], 0x42, 16);
+  CHECK(sim_write(BLE_UUID_DFUS_CTRL_CHAR, read, sizeof(read)) == NRF_SUCCESS);
+  CHECK(sim_write(BLE_UUID_DFUS_CTRL_CHAR, hash, sizeof(hash)) == NRF_SUCCESS);
+  CHECK(sim_write(BLE_UUID_DFUS_CTRL_CHAR, echo, sizeof(echo)) == NRF_SUCCESS);
+  CHECK(sim_write(BLE_UUID_DFUS_CTRL_CHAR, write, sizeof(write)) == NRF_SUCCESS);
+  sim_settle();
+
+  while ((len = sim_notification(got)))
+  {
+    if (got[0] == 'h')
+    {
+      uint8_t want[6] = { 'h', PAGE + 1 };
+      uint32_t crc = crc32(0, image + 1024, 1024);
+      memcpy(&want[2], &crc, 4);
+      CHECK(!hashed && len == 6 && !memcmp(got, want, 6));
+      CHECK(addr < PAGE_ADDR + 3072); /* hashes go before the rest of the range */
+      hashed = true;
+      continue;
+    }
+    if (got[0] == 'x')
+    {
+      CHECK(!echoed && hashed && len == 1);
+      echoed = true;
+      continue;
+    }
+    if (got[0] == 'w')
+    {
+      uint8_t want[6] = { 'w', PAGE + 5, 0, 'O', 'K', 0 };
+      CHECK(!written && echoed && len == 6 && !memcmp(got, want, 6));
+      written = true;
+      continue;
+    }
+    read_chunk(got, len, addr);
+    addr += 16;
+  }
+  CHECK(addr == PAGE_ADDR + 3072 && written);
+  CHECK(!memcmp(sim_flash + PAGE_ADDR + 5 * 1024, &write[3], 16));
+}
+
+/* Writes only go out so many per connection event */
+static void test_link_pacing(void)
+{
+  sim_link.interval_us = 30000;
+  sim_link.min_interval_us = 30000; /* refuses the fast interval */
+  sim_link.up_per_event = 2;
+  device();
+
+  for (uint8_t i = 0; i < 6; i++)
+  {
+    uint8_t echo[2] = { 'e', '0' + i };
+    send_data(echo, sizeof(echo));
+  }
+  sim_run(2 * 30000);
+  CHECK(sim_link_stats()->up == 1 + 4); /* the cccd went earlier */
+
+  sim_settle();
+  for (uint8_t i = 0; i < 6; i++)
+  {
+    uint8_t echoed = '0' + i;
+    expect(&echoed, 1);
+  }
+  nothing_else();
+  CHECK(sim_interval() == 30000);
+}
+
+/* Lost packets go again, nothing gets lost for good */
+static void test_link_loss(void)
+{
+  uint8_t page[1024];
+
+  image_page(page);
+  sim_link.loss_permille = 300;
+  sim_link.seed = 7;
+  device();
+
+  uint8_t session[3] = { 's', 0x0A, 64 };
+  send(session, sizeof(session));
+  uint8_t ok[4] = { 's', 0x0B, 'O', 'K' };
+  expect(ok, sizeof(ok));
+
+  for (uint8_t chunk = 0; chunk < 64; chunk++)
+  {
+    uint8_t write[19] = { 'w', PAGE, chunk };
+    memcpy(&write[3], &page[chunk * 16], 16);
+    send_data(write, sizeof(write));
+  }
+  sim_settle();
+
+  uint8_t ack[10] = { 'a', PAGE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+  expect(ack, sizeof(ack));
+  uint8_t committed[6] = { 'c', PAGE, 'O', 'K', 0, 0 };
+  expect(committed, sizeof(committed));
+  CHECK(!memcmp(sim_flash + PAGE_ADDR, page, 1024));
+  CHECK(sim_link_stats()->lost > 0);
+}
+
+/* Quiet for a while, the bootloader asks for a relaxed interval */
+static void test_link_relaxes(void)
+{
+  device();
+
+  send("ehi", 3);
+  expect("hi", 2);
+  CHECK(sim_interval() == 7500);
+
+  sim_run(5000000);
+  CHECK(sim_interval() == 50000);
+  CHECK(sim_link_stats()->slept > 0);
+}
+
+/* A refused update is asked again from the timer, in either direction */
+static void test_link_retries(void)
+{
+  device();
+
+  send("ehi", 3);
+  expect("hi", 2);
+  CHECK(sim_interval() == 7500);
+
+  sim_link.busy_updates = 3;
+  sim_run(5000000);
+  CHECK(sim_interval() == 50000);
+
+  /* a burst while the central is busy does not ask on every packet */
+  uint32_t requests = sim_link_stats()->requests;
+  sim_link.busy_updates = 2;
+  for (uint8_t i = 0; i < 12; i++)
+  {
+    CHECK(sim_write(BLE_UUID_DFUS_CTRL_CHAR, (const uint8_t *)"ehi", 3) == NRF_SUCCESS);
+  }
+  sim_run(1500000); /* two retries, then the update takes effect */
+  CHECK(sim_interval() == 7500);
+  CHECK(sim_link_stats()->requests == requests + 3);
+  for (uint8_t i = 0; i < 12; i++)
+  {
+    expect("hi", 2);
+  }
+  nothing_else();
+}
+
+static void test_disconnect_drops_page(void)
+{
+  device();
+
+  uint8_t session[2] = { 's', 0x01 };
+  send(session, sizeof(session));
+  uint8_t ok[4] = { 's', 0x01, 'O', 'K' };
+  expect(ok, sizeof(ok));
+
+  for (uint8_t chunk = 0; chunk < 10; chunk++)
+  {
+    uint8_t write[19] = { 'w', PAGE, chunk };
+    send(write, sizeof(write));
+    uint8_t staged[5] = { 'w', PAGE, chunk, 'O', 'K' };
+    expect(staged, sizeof(staged));
+  }
+
+  sim_disconnect();
+  sim_settle();
+  sim_connect();
+  sim_subscribe(BLE_UUID_DFUS_CTRL_CHAR, true);
+  sim_settle();
+
+  uint8_t query[2] = { 'q', PAGE };
+  send(query, sizeof(query));
+  uint8_t none[10] = { 'a', PAGE };
+  expect(none, sizeof(none));
+  CHECK(sim_flash[PAGE_ADDR] == 0xFF);
+}
+
+/* Leaves a valid image behind for the next tests */
+static void test_finalize(void)
+{
+  uint8_t page[1024];
+
+  image_page(page);
+  device();
+
+  uint8_t session[2] = { 's', 0x09 }; /* staged, auto erase */
+  send(session, sizeof(session));
+  uint8_t ok[4] = { 's', 0x09, 'O', 'K' };
+  expect(ok, sizeof(ok));
+
+  for (uint8_t chunk = 0; chunk < 64; chunk++)
+  {
+    uint8_t write[19] = { 'w', PAGE, chunk };
+    memcpy(&write[3], &page[chunk * 16], 16);
+    send_data(write, sizeof(write));
+    sim_settle();
+
+    uint8_t staged[5] = { 'w', PAGE, chunk, 'O', 'K' };
+    expect(staged, sizeof(staged));
+  }
+  uint8_t committed[6] = { 'c', PAGE, 'O', 'K', 0, 0 };
+  expect(committed, sizeof(committed));
+
+  uint32_t length = 1000; /* not a whole page, the crc covers the padding */
+  uint32_t crc = crc32(0, page, 1024);
+  uint8_t finalize[9] = { 'f' };
+  memcpy(&finalize[1], &length, 4);
+  memcpy(&finalize[5], &crc, 4);
+
+  crc ^= 1;
+  memcpy(&finalize[5], &crc, 4);
+  send(finalize, sizeof(finalize));
+  uint8_t wrong[6] = { 'f', '!' };
+  crc ^= 1;
+  memcpy(&wrong[2], &crc, 4);
+  expect(wrong, sizeof(wrong));
+
+  memcpy(&finalize[5], &crc, 4);
+  send(finalize, sizeof(finalize));
+  expect("fOK", 3);
+  nothing_else();
+}
+
+/* Only once the pins have had DFU_SENSE_WINDOW_MS to go low */
+static void test_valid_image_launches(void)
+{
+  CHECK(sim_flash_open(flash_path));
+  sim_boot();
+  sim_run(DFU_SENSE_WINDOW_MS * 1000 - 1000);
+  CHECK(sim_state() == SIM_RUNNING && !sim_launched());
+  sim_run(10000); /* the rest, and a tick or two of rounding */
+  CHECK(sim_state() == SIM_LAUNCHED);
+  CHECK(sim_launched() == PAGE_ADDR);
+}
+
+/* Pins that go low within the window keep us in the bootloader */
+static void test_pins_in_window(void)
+{
+  CHECK(sim_flash_open(flash_path));
+  sim_boot();
+  sim_run(DFU_SENSE_WINDOW_MS * 1000 / 2);
+  CHECK(sim_state() == SIM_RUNNING && !sim_launched());
+
+  sim_pins(~((1 << 25) | (1 << 28)));
+  sim_settle();
+  CHECK(sim_state() == SIM_RUNNING && !sim_launched());
+  CHECK(!(NRF_GPIO->PIN_CNF[25] & GPIO_PIN_CNF_SENSE_Msk)); /* sense off again */
+}
+
+/* One pin, let go, the other and the first again: seen at the last press */
+static void test_pins_staggered(void)
+{
+  uint32_t a = 1 << 25;
+  uint32_t b = 1 << 28;
+
+  CHECK(sim_flash_open(flash_path));
+  sim_boot();
+  sim_run(DFU_SENSE_WINDOW_MS * 1000 / 5);
+  sim_pins(~a);
+  sim_run(DFU_SENSE_WINDOW_MS * 1000 / 5);
+  sim_pins(~0u);
+  sim_run(DFU_SENSE_WINDOW_MS * 1000 / 5);
+  sim_pins(~b);
+  sim_run(DFU_SENSE_WINDOW_MS * 1000 / 5);
+  CHECK(NRF_GPIO->PIN_CNF[28] & GPIO_PIN_CNF_SENSE_Msk); /* still in the window */
+
+  sim_pins(~(a | b));
+  sim_run(1000);
+  CHECK(sim_state() == SIM_RUNNING && !sim_launched());
+  CHECK(!(NRF_GPIO->PIN_CNF[25] & GPIO_PIN_CNF_SENSE_Msk));
+  CHECK(!(NRF_GPIO->PIN_CNF[28] & GPIO_PIN_CNF_SENSE_Msk));
+  CHECK(sim_now() < DFU_SENSE_WINDOW_MS * 1000);
+}
+
+static void test_dfu_request_stays(void)
+{
+  NRF_POWER->GPREGRET = DFU_REQUEST_GPREGRET;
+  CHECK(sim_flash_open(flash_path));
+  sim_boot();
+  CHECK(sim_state() == SIM_RUNNING);
+  CHECK(NRF_POWER->GPREGRET == 0);
+}
+
+static void test_pins_stay(void)
+{
+  sim_pins(~((1 << 25) | (1 << 28)));
+  CHECK(sim_flash_open(flash_path));
+  sim_boot();
+  CHECK(sim_state() == SIM_RUNNING);
+}
+
+/* Touching the application drops the record, the next boot stays */
+static void test_write_invalidates(void)
+{
+  NRF_POWER->GPREGRET = DFU_REQUEST_GPREGRET;
+  device();
+
+  uint8_t erase[2] = { 'd', PAGE + 1 };
+  send(erase, sizeof(erase));
+  uint8_t erased[5] = { 'd', PAGE + 1, 'O', 'K', 1 };
+  expect(erased, sizeof(erased));
+}
+
+/* A request is used up even when the image alone keeps us here */
+static void test_invalid_image_stays(void)
+{
+  NRF_POWER->GPREGRET = DFU_REQUEST_GPREGRET;
+  m_dfu_request = DFU_REQUEST_MAGIC;
+  CHECK(sim_flash_open(flash_path));
+  sim_boot();
+  CHECK(sim_state() == SIM_RUNNING);
+  CHECK(NRF_POWER->GPREGRET == 0 && m_dfu_request == 0);
+}
+
+typedef struct
+{
+  const char *name;
+  void      (*fn)(void);
+  bool        keep_flash; /* continue on the previous test's flash */
+} test_t;
+
+static const test_t tests[] =
+{
+  { "timer_list",              test_timer_list,              false },
+  { "timer_clock",             test_timer_clock,             false },
+  { "timer_expiry",            test_timer_expiry,            false },
+  { "blank_enters_bootloader", test_blank_enters_bootloader, false },
+  { "info_and_errors",         test_info_and_errors,         false },
+  { "erase_write_read",        test_erase_write_read,        false },
+  { "flash_timing",            test_flash_timing,            false },
+  { "erase_ahead",             test_erase_ahead,             false },
+  { "range_erase",             test_range_erase,             false },
+  { "range_erase_fails",       test_range_erase_fails,       false },
+  { "windowed_page",           test_windowed_page,           false },
+  { "scattered_blanks",        test_scattered_blanks,        false },
+  { "erase_backlog",           test_erase_backlog,           false },
+  { "lz_stream",               test_lz_stream,               false },
+  { "lz_bad_reference",        test_lz_bad_reference,        false },
+  { "lz_ends_mid_token",       test_lz_ends_mid_token,       false },
+  { "lz_missing_bytes",        test_lz_missing_bytes,        false },
+  { "patch_swap",              test_patch_swap,              false },
+  { "patch_long_copy",         test_patch_long_copy,         false },
+  { "patch_bad_source",        test_patch_bad_source,        false },
+  { "patch_ends_mid_op",       test_patch_ends_mid_op,       false },
+  { "stream_switch",           test_stream_switch,           false },
+  { "tx_backpressure",         test_tx_backpressure,         false },
+  { "range_read",              test_range_read,              false },
+  { "range_read_cancel",       test_range_read_cancel,       false },
+  { "range_read_backpressure", test_range_read_backpressure, false },
+  { "link_pacing",             test_link_pacing,             false },
+  { "link_loss",               test_link_loss,               false },
+  { "link_relaxes",            test_link_relaxes,            false },
+  { "link_retries",            test_link_retries,            false },
+  { "disconnect_drops_page",   test_disconnect_drops_page,   false },
+  { "finalize",                test_finalize,                false },
+  { "valid_image_launches",    test_valid_image_launches,    true  },
+  { "pins_in_window",          test_pins_in_window,          true  },
+  { "pins_staggered",          test_pins_staggered,          true  },
+  { "dfu_request_stays",       test_dfu_request_stays,       true  },
+  { "pins_stay",               test_pins_stay,               true  },
+  { "write_invalidates",       test_write_invalidates,       true  },
+  { "invalid_image_stays",     test_invalid_image_stays,     true  },
+};
+
+int main(int argc, char **argv)
+{
+  char path[] = "/tmp/tinydfu_flash_XXXXXX";
+  int  failed = 0;
+
+  if (argc > 1 && !strcmp(argv[1], "-v"))
+  {
+    steady_state_test = true;
+  }
+
+  int fd = mkstemp(path);
+  if (fd < 0)
+  {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+  flash_path = path;
+
+  for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+  {
+    if (!tests[i].keep_flash && truncate(path, 0))
+    {
+      perror("truncate");
+      return 1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      tests[i].fn();
+      exit(0);
+    }
+
+    int status = 1;
+    waitpid(pid, &status, 0);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (WIFSIGNALED(status))
+    {
+      fprintf(stderr, "%s: signal %d\n", tests[i].name, WTERMSIG(status));
+    }
+    printf("%s %s\n", ok ? "PASS" : "FAIL", tests[i].name);
+    failed += !ok;
+  }
+
+  unlink(path);
+  printf("%d of %d failed\n", failed, (int)(sizeof(tests) / sizeof(tests[0])));
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "ble_dfus.h"
+#include "debug.h"
+
+/* 6b72xxxx-616c-6e2d-7469-6e7964667521, little endian */
+#define DFUS_BASE_UUID {{0x21, 0x75, 0x66, 0x64, 0x79, 0x6e, 0x69, 0x74, \
+                         0x2d, 0x6e, 0x6c, 0x61, 0x00, 0x00, 0x72, 0x6b}}
+
+static uint32_t char_add(ble_dfus_t *p_dfus, uint16_t uuid, bool ctrl,
+    ble_gatts_char_handles_t *p_handles)
+{
+  ble_gatts_char_md_t char_md;
+  ble_gatts_attr_md_t cccd_md;
+  ble_gatts_attr_t    attr_char_value;
+  ble_uuid_t          ble_uuid;
+  ble_gatts_attr_md_t attr_md;
+
+  memset(&cccd_md, 0, sizeof(cccd_md));
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+  cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+
+  memset(&char_md, 0, sizeof(char_md));
+  if (ctrl)
+  {
+    char_md.char_props.write  = 1;
+    char_md.char_props.notify = 1;
+    char_md.p_cccd_md         = &cccd_md;
+  }
+  else
+  {
+    char_md.char_props.write_wo_resp = 1;
+  }
+
+  ble_uuid.type = p_dfus->uuid_type;
+  ble_uuid.uuid = uuid;
+
+  memset(&attr_md, 0, sizeof(attr_md));
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+  attr_md.vloc = BLE_GATTS_VLOC_STACK;
+  attr_md.vlen = 1;
+
+  memset(&attr_char_value, 0, sizeof(attr_char_value));
+  attr_char_value.p_uuid    = &ble_uuid;
+  attr_char_value.p_attr_md = &attr_md;
+  attr_char_value.init_len  = 1;
+  attr_char_value.max_len   = BLE_DFUS_MAX_DATA_LEN;
+
+  return sd_ble_gatts_characteristic_add(p_dfus->service_handle, &char_md,
+      &attr_char_value, p_handles);
+}
+
+uint32_t ble_dfus_init(ble_dfus_t *p_dfus, const ble_dfus_init_t *p_dfus_init)
+{
+  uint32_t      err_code;
+  ble_uuid_t    ble_uuid;
+  ble_uuid128_t dfus_base_uuid = DFUS_BASE_UUID;
+
+  p_dfus->conn_handle             = BLE_CONN_HANDLE_INVALID;
+  p_dfus->is_notification_enabled = false;
+  p_dfus->data_handler            = p_dfus_init->data_handler;
+
+  err_code = sd_ble_uuid_vs_add(&dfus_base_uuid, &p_dfus->uuid_type);
+  if (err_code != NRF_SUCCESS)
+  {
+    return err_code;
+  }
+
+  ble_uuid.type = p_dfus->uuid_type;
+  ble_uuid.uuid = BLE_UUID_DFUS_SERVICE;
+
+  err_code = sd_ble_gatts_service_add(BLE_GATTS_SRVC_TYPE_PRIMARY, &ble_uuid,
+      &p_dfus->service_handle);
+  if (err_code != NRF_SUCCESS)
+  {
+    return err_code;
+  }
+
+  err_code = char_add(p_dfus, BLE_UUID_DFUS_CTRL_CHAR, true, &p_dfus->ctrl_handles);
+  if (err_code != NRF_SUCCESS)
+  {
+    return err_code;
+  }
+
+  return char_add(p_dfus, BLE_UUID_DFUS_DATA_CHAR, false, &p_dfus->data_handles);
+}
+
+void ble_dfus_on_ble_evt(ble_dfus_t *p_dfus, ble_evt_t *p_ble_evt)
+{
+  switch (p_ble_evt->header.evt_id)
+  {
+    case BLE_GAP_EVT_CONNECTED:
+      p_dfus->conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+      break;
+
+    case BLE_GAP_EVT_DISCONNECTED:
+      p_dfus->conn_handle = BLE_CONN_HANDLE_INVALID;
+      p_dfus->is_notification_enabled = false;
+      break;
+
+    case BLE_GATTS_EVT_WRITE:
+      {
+        ble_gatts_evt_write_t *p_evt_write = &p_ble_evt->evt.gatts_evt.params.write;
+
+        if (p_evt_write->handle == p_dfus->ctrl_handles.cccd_handle && p_evt_write->len == 2)
+        {
+          p_dfus->is_notification_enabled = ble_srv_is_notification_enabled(p_evt_write->data);
+        }
+        else if ((p_evt_write->handle == p_dfus->ctrl_handles.value_handle ||
+                  p_evt_write->handle == p_dfus->data_handles.value_handle) &&
+                 p_dfus->data_handler)
+        {
+          p_dfus->data_handler(p_dfus, p_evt_write->data, p_evt_write->len);
+        }
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+/* Notify on the control point */
+uint32_t ble_dfus_string_send(ble_dfus_t *p_dfus, uint8_t *p_string, uint16_t length)
+{
+  ble_gatts_hvx_params_t hvx_params;
+
+  if (p_dfus->conn_handle == BLE_CONN_HANDLE_INVALID || !p_dfus->is_notification_enabled)
+  {
+    return NRF_ERROR_INVALID_STATE;
+  }
+
+  if (length > BLE_DFUS_MAX_DATA_LEN)
+  {
+    return NRF_ERROR_INVALID_PARAM;
+  }
+
+  memset(&hvx_params, 0, sizeof(hvx_params));
+  hvx_params.handle = p_dfus->ctrl_handles.value_handle;
+  hvx_params.p_data = p_string;
+  hvx_params.p_len  = &length;
+  hvx_params.type   = BLE_GATT_HVX_NOTIFICATION;
+
+  return sd_ble_gatts_hvx(p_dfus->conn_handle, &hvx_params);
+}
@@ -0,0 +1,62 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble.h"
+#include "ble_srv_common.h"
+#ifndef _ble_dfus_h
+#define _ble_dfus_h
+
+/*
+ * Tiny DFU service
+ *
+ * Control point: write with response + notify. Commands go in here and every
+ *                reply comes back as a notification.
+ * Data:          write without response. Bulk 'w' chunks go in here so the
+ *                host can put several of them into one connection event.
+ *
+ * Both characteristics feed the same command handler, the split is only
+ * about how the packets travel.
+ *
+ * A host may have up to 16 commands without their reply yet (RX_HOLD_SIZE
+ * in main.c). While replies are backed up the device holds commands back;
+ * any beyond that many are dropped unanswered. Windowed 'w' chunks count
+ * too, a dropped one just stays 0 in the next 'a' bitmap.
+ */
+
+#define BLE_UUID_DFUS_SERVICE    0x0001
+#define BLE_UUID_DFUS_CTRL_CHAR  0x0002
+#define BLE_UUID_DFUS_DATA_CHAR  0x0003
+
+#define BLE_DFUS_MAX_DATA_LEN    (GATT_MTU_SIZE_DEFAULT - 3)
+
+typedef struct ble_dfus_s ble_dfus_t;
+
+typedef void (*ble_dfus_data_handler_t)(ble_dfus_t *p_dfus, uint8_t *p_data, uint16_t length);
+
+typedef struct
+{
+  ble_dfus_data_handler_t data_handler;
+} ble_dfus_init_t;
+
+struct ble_dfus_s
+{
+  uint8_t                  uuid_type;
+  uint16_t                 service_handle;
+  ble_gatts_char_handles_t ctrl_handles;
+  ble_gatts_char_handles_t data_handles;
+  uint16_t                 conn_handle;
+  bool                     is_notification_enabled;
+  ble_dfus_data_handler_t  data_handler;
+};
+
+uint32_t ble_dfus_init(ble_dfus_t *p_dfus, const ble_dfus_init_t *p_dfus_init);
+void ble_dfus_on_ble_evt(ble_dfus_t *p_dfus, ble_evt_t *p_ble_evt);
+uint32_t ble_dfus_string_send(ble_dfus_t *p_dfus, uint8_t *p_string, uint16_t length);
+
+#endif
@@ -0,0 +1,19 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#ifndef _crc32_h
+#define _crc32_h
+
+/*
+ * CRC-32 (IEEE 802.3, as used by zlib). Start with 0 and feed the result of
+ * one call into the next to checksum data piece by piece.
+ */
+
+uint32_t crc32(uint32_t crc, const uint8_t *data, uint32_t len);
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#ifndef _dfu_request_h
+#define _dfu_request_h
+
+/*
+ * Asking the bootloader for DFU from the application
+ *
+ * Both survive a soft reset. Set either one, then NVIC_SystemReset():
+ *
+ *   NRF_POWER->GPREGRET = DFU_REQUEST_GPREGRET;
+ *
+ * or, with the application keeping its own .noinit RAM at the same place,
+ *
+ *   *(volatile uint32_t *)DFU_REQUEST_ADDRESS = DFU_REQUEST_MAGIC;
+ *
+ * The bootloader clears the request when it sees it. This header has no
+ * bootloader dependencies and can be copied into the application as is.
+ */
+
+#define DFU_REQUEST_GPREGRET 0xB1       /* value for NRF_POWER->GPREGRET */
+#define DFU_REQUEST_ADDRESS  0x20007F80 /* start of the NOINIT region */
+#define DFU_REQUEST_MAGIC    0x51554644 /* "DFUQ" */
+
+#endif
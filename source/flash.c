@@ -0,0 +1,297 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "flash.h"
+#include "debug.h"
+#include "nrf_soc.h"
+
+/*
+ * Flash operation queue
+ *
+ * sd_flash_write and sd_flash_page_erase only schedule work; the softdevice
+ * takes one operation at a time and reports the result later as a system
+ * event. Operations are queued here and issued one after the other, and the
+ * owner only hears about an operation once it has really finished.
+ */
+
+static flash_op_t queue[FLASH_QUEUE_SIZE];
+static uint8_t    queue_head  = 0;
+static uint8_t    queue_count = 0;
+static bool       inflight    = false; /* head is with the softdevice */
+static flash_touch_t touch_handler = NULL;
+
+static flash_op_t *flash_alloc(void)
+{
+  if (queue_count == FLASH_QUEUE_SIZE)
+  {
+    return NULL;
+  }
+
+  flash_op_t *op = &queue[(queue_head + queue_count) % FLASH_QUEUE_SIZE];
+  memset(op, 0, sizeof(*op));
+  return op;
+}
+
+static bool flash_blank(uint8_t page)
+{
+  const uint32_t *word = FLASH_PTR(page * FLASH_PAGE_SIZE);
+
+  for (uint16_t i = 0; i < FLASH_PAGE_SIZE / 4; i++)
+  {
+    if (word[i] != 0xFFFFFFFF)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Programming only clears bits, so 0xFF words can be left out of a write
+ * without changing the result. Every sd_flash_write is a timeslot and an
+ * event round trip of its own though, so only the leading 0xFF words and
+ * gaps of FLASH_GAP_WORDS or more are left out; shorter gaps are cheaper
+ * written along. Moves the cursor past the leading ones and sets run to
+ * the words up to the next long gap, trailing 0xFF words not included.
+ */
+static void flash_next_run(flash_op_t *op)
+{
+  const uint32_t *src = op->src ? op->src : op->data;
+  uint16_t gap = 0;
+
+  while (op->cursor < op->words && src[op->cursor] == 0xFFFFFFFF)
+  {
+    op->cursor++;
+    op->skipped++;
+  }
+
+  op->run = 0;
+  for (uint16_t i = op->cursor; i < op->words && gap < FLASH_GAP_WORDS; i++)
+  {
+    if (src[i] == 0xFFFFFFFF)
+    {
+      gap++;
+    }
+    else
+    {
+      gap = 0;
+      op->run = i + 1 - op->cursor;
+    }
+  }
+}
+
+static void flash_complete(bool success)
+{
+  /* copy out, the callback may queue more work into this slot */
+  flash_op_t op = queue[queue_head];
+
+  queue_head = (queue_head + 1) % FLASH_QUEUE_SIZE;
+  queue_count--;
+  inflight = false;
+
+  if (op.done)
+  {
+    op.done(&op, success);
+  }
+}
+
+void flash_process(void)
+{
+  while (queue_count && !inflight)
+  {
+    flash_op_t *op = &queue[queue_head];
+    uint32_t err;
+
+    if (op->type == FLASH_OP_ERASE)
+    {
+      if (!op->retries && flash_blank(op->page))
+      {
+        /* nothing to erase, don't stall the radio for it */
+        op->skipped = FLASH_PAGE_SIZE / 4;
+        flash_complete(true);
+        continue;
+      }
+
+      err = sd_flash_page_erase(op->page);
+    }
+    else
+    {
+      flash_next_run(op);
+
+      if (!op->run)
+      {
+        /* whatever was left is 0xFF */
+        flash_complete(true);
+        continue;
+      }
+
+      err = sd_flash_write(op->dst + op->cursor,
+          (op->src ? op->src : op->data) + op->cursor, op->run);
+    }
+
+    if (err == NRF_SUCCESS)
+    {
+      inflight = true;
+    }
+    else if (err == NRF_ERROR_BUSY)
+    {
+      /* someone else has the flash, try again on the next flash event */
+      return;
+    }
+    else
+    {
+      _debug_printf("flash op refused (%d)", err);
+      flash_complete(false);
+    }
+  }
+}
+
+/*
+ * Have touch called for every page an operation is queued for, before it is
+ * queued: anything the handler queues itself goes to the flash first.
+ */
+void flash_watch(flash_touch_t touch)
+{
+  touch_handler = touch;
+}
+
+bool flash_erase(uint8_t page, flash_done_t done, void *context)
+{
+  if (touch_handler)
+  {
+    touch_handler(page);
+  }
+
+  flash_op_t *op = flash_alloc();
+
+  if (!op)
+  {
+    return false;
+  }
+
+  op->type = FLASH_OP_ERASE;
+  op->page = page;
+  op->done = done;
+  op->context = context;
+  queue_count++;
+
+  flash_process();
+  return true;
+}
+
+bool flash_write(uint32_t *dst, const uint32_t *src, uint16_t words,
+    flash_done_t done, void *context)
+{
+  if (touch_handler)
+  {
+    touch_handler((uint32_t)dst / FLASH_PAGE_SIZE);
+  }
+
+  flash_op_t *op = flash_alloc();
+
+  if (!op)
+  {
+    return false;
+  }
+
+  op->type = FLASH_OP_WRITE;
+  op->dst = dst;
+  op->src = src;
+  op->words = words;
+  op->done = done;
+  op->context = context;
+  queue_count++;
+
+  flash_process();
+  return true;
+}
+
+bool flash_write_copy(uint32_t *dst, const uint8_t *data, uint16_t words,
+    flash_done_t done, void *context)
+{
+  if (words > FLASH_INLINE_WORDS)
+  {
+    return false;
+  }
+
+  if (touch_handler)
+  {
+    touch_handler((uint32_t)dst / FLASH_PAGE_SIZE);
+  }
+
+  flash_op_t *op = flash_alloc();
+
+  if (!op)
+  {
+    return false;
+  }
+
+  /* the packet buffer is gone once we return, keep our own copy */
+  memcpy(op->data, data, words * 4);
+
+  op->type = FLASH_OP_WRITE;
+  op->dst = dst;
+  op->src = NULL;
+  op->words = words;
+  op->done = done;
+  op->context = context;
+  queue_count++;
+
+  flash_process();
+  return true;
+}
+
+void flash_sys_event(uint32_t evt)
+{
+  if (evt != NRF_EVT_FLASH_OPERATION_SUCCESS && evt != NRF_EVT_FLASH_OPERATION_ERROR)
+  {
+    return;
+  }
+
+  if (inflight)
+  {
+    flash_op_t *op = &queue[queue_head];
+
+    if (evt == NRF_EVT_FLASH_OPERATION_SUCCESS && op->type == FLASH_OP_WRITE &&
+        op->cursor + op->run < op->words)
+    {
+      /* more words after a long 0xFF gap, go on with the same op */
+      op->cursor += op->run;
+      op->run = 0;
+      inflight = false;
+    }
+    else if (evt == NRF_EVT_FLASH_OPERATION_SUCCESS)
+    {
+      flash_complete(true);
+    }
+    else if (op->retries++ < FLASH_RETRIES)
+    {
+      /* usually the radio got in the way, just issue it again */
+      _debug_printf("flash op failed, retrying");
+      inflight = false;
+    }
+    else
+    {
+      flash_complete(false);
+    }
+  }
+
+  /* the flash is free again, whoever was using it */
+  flash_process();
+}
+
+bool flash_idle(void)
+{
+  return queue_count == 0;
+}
+
+/* Free queue entries, for producers that can hold back */
+uint8_t flash_room(void)
+{
+  return FLASH_QUEUE_SIZE - queue_count;
+}
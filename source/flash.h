@@ -0,0 +1,69 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef _flash_h
+#define _flash_h
+
+#define FLASH_PAGE_SIZE   1024
+#define FLASH_QUEUE_SIZE  8 /* operations waiting for the softdevice */
+#define FLASH_RETRIES     3 /* attempts after a FLASH_OPERATION_ERROR */
+#define FLASH_INLINE_WORDS 4 /* small writes carry their own copy of the data */
+#define FLASH_GAP_WORDS   32 /* 0xFF words it takes to split a write in two */
+
+/*
+ * Reading flash contents. On the chip that is the address itself, the host
+ * simulator (sim/) keeps its 256 KB somewhere else. Writes and erases only
+ * ever pass addresses to the softdevice and need no mapping.
+ */
+#ifdef __arm__
+#define FLASH_PTR(addr) ((const void *)(addr))
+#else
+extern uint8_t *sim_flash; /* sim/softdevice.c */
+#define FLASH_PTR(addr) ((const void *)(sim_flash + (uintptr_t)(addr)))
+#endif
+
+typedef enum
+{
+  FLASH_OP_ERASE,
+  FLASH_OP_WRITE,
+} flash_op_type_t;
+
+typedef struct flash_op_s flash_op_t;
+typedef void (*flash_done_t)(const flash_op_t *op, bool success);
+typedef void (*flash_touch_t)(uint8_t page); /* a page is about to change */
+
+struct flash_op_s
+{
+  flash_op_type_t type;
+  uint8_t         page;    /* erase: page number */
+  uint8_t         retries;
+  uint16_t        words;   /* write: length in words */
+  uint16_t        cursor;  /* write: words already dealt with */
+  uint16_t        run;     /* write: words currently with the softdevice */
+  uint16_t        skipped; /* words left alone because they were 0xFF, or
+                              for an erase the whole page if already blank */
+  uint32_t       *dst;     /* write: destination in flash */
+  const uint32_t *src;     /* write: source, must stay valid until done */
+  uint32_t        data[FLASH_INLINE_WORDS];
+  flash_done_t    done;
+  void           *context;
+};
+
+void flash_watch(flash_touch_t touch);
+bool flash_erase(uint8_t page, flash_done_t done, void *context);
+bool flash_write(uint32_t *dst, const uint32_t *src, uint16_t words,
+    flash_done_t done, void *context);
+bool flash_write_copy(uint32_t *dst, const uint8_t *data, uint16_t words,
+    flash_done_t done, void *context);
+void flash_sys_event(uint32_t evt);
+void flash_process(void);
+bool flash_idle(void);
+uint8_t flash_room(void);
+
+#endif
@@ -6,6 +6,7 @@
  */
 
 #include "hw.h"
+#include "timers.h"
 #include "nrf.h"
 #include "nrf51.h"
 #include "debug.h"
@@ -17,6 +18,8 @@
 volatile NVIC_Type *Interrupts = NVIC;
 volatile SCB_Type *SystemControlBlock = SCB;
 
+gpioIntFnPtr gpioFn = NULL;
+
 /* Function to eliminate blocking */
 void wait_for_val_ne(volatile uint32_t *value)
 {
@@ -57,6 +60,24 @@ void hw_clear_port_event()
   NRF_GPIOTE->EVENTS_PORT = 0;
 }
 
+/* Route PORT (pin sense) events to gpioFn */
+void hw_latch_interrupt(bool enable)
+{
+  if (enable)
+  {
+    hw_clear_port_event();
+    NVIC_ClearPendingIRQ(GPIOTE_IRQn);
+    NRF_GPIOTE->INTENSET = GPIOTE_INTENSET_PORT_Msk;
+    NVIC_EnableIRQ(GPIOTE_IRQn);
+  }
+  else
+  {
+    NVIC_DisableIRQ(GPIOTE_IRQn);
+    NRF_GPIOTE->INTENCLR = GPIOTE_INTENCLR_PORT_Msk;
+    hw_clear_port_event();
+  }
+}
+
 /* Handle a sense interrupt */
 void GPIOTE_IRQHandler(void)
 {
@@ -69,6 +90,184 @@ void GPIOTE_IRQHandler(void)
   NVIC_ClearPendingIRQ(GPIOTE_IRQn);
 }
 
+/*
+ * RTC1, counting at RTC_FREQUENCY (RTC0 belongs to the softdevice)
+ *
+ * The 24 bit counter is extended with an overflow count into a monotonic
+ * 32 bit tick clock (about 48 days at 1024 Hz). Compare 0 serves both
+ * hw_rtc_wakeup and the timers below: whichever is due first is armed, and
+ * the interrupt sorts out what happened. Both halves of that are in
+ * timers.c, the simulator runs them too.
+ */
+static volatile uint32_t rtc_overflows = 0;
+static bool              rtc_own_lfclk = false; /* started the LF clock ourselves */
+static timers_clock_t    rtc_clock;             /* wakeup and timers */
+
+/* Point compare 0 at whatever comes first */
+static void rtc_arm(void)
+{
+  uint32_t due;
+
+  if (!timers_next(&rtc_clock, &due))
+  {
+    NRF_RTC1->INTENCLR = RTC_INTENCLR_COMPARE0_Msk;
+    return;
+  }
+
+  uint32_t now = hw_rtc_value();
+  uint32_t delta = timers_due(due, now) ? 0 : due - now;
+
+  /* the counter needs to be at least 2 ticks short of CC to see it, and
+   * far-off deadlines are simply re-armed when an earlier compare fires */
+  if (delta < 2)
+  {
+    delta = 2;
+  }
+  if (delta > RTC_COUNTER_MASK / 2)
+  {
+    delta = RTC_COUNTER_MASK / 2;
+  }
+
+  NRF_RTC1->EVENTS_COMPARE[0] = 0;
+  NRF_RTC1->CC[0] = (NRF_RTC1->COUNTER + delta) & RTC_COUNTER_MASK;
+  NRF_RTC1->INTENSET = RTC_INTENSET_COMPARE0_Msk;
+}
+
+void hw_rtc_start(void)
+{
+  if (!(NRF_CLOCK->LFCLKSTAT & CLOCK_LFCLKSTAT_STATE_Msk))
+  {
+    /* nobody has the LF clock running yet (the softdevice would) */
+    NRF_CLOCK->LFCLKSRC = (CLOCK_LFCLKSRC_SRC_RC << CLOCK_LFCLKSRC_SRC_Pos);
+    NRF_CLOCK->EVENTS_LFCLKSTARTED = 0;
+    NRF_CLOCK->TASKS_LFCLKSTART = 1;
+    while (!NRF_CLOCK->EVENTS_LFCLKSTARTED)
+    {
+      /* the RC takes a few hundred us */
+    }
+    rtc_own_lfclk = true;
+  }
+
+  NRF_RTC1->PRESCALER = COUNTER_PRESCALER;
+  NRF_RTC1->INTENSET = RTC_INTENSET_OVRFLW_Msk;
+
+  /* same level as the rest of the application under the softdevice */
+  NVIC_SetPriority(RTC1_IRQn, 3);
+  NVIC_ClearPendingIRQ(RTC1_IRQn);
+  NVIC_EnableIRQ(RTC1_IRQn);
+
+  NRF_RTC1->TASKS_START = 1;
+}
+
+void hw_rtc_stop(void)
+{
+  NVIC_DisableIRQ(RTC1_IRQn);
+  NRF_RTC1->INTENCLR = RTC_INTENCLR_COMPARE0_Msk | RTC_INTENCLR_OVRFLW_Msk;
+  NRF_RTC1->TASKS_STOP = 1;
+
+  if (rtc_own_lfclk)
+  {
+    /* leave the clock the way the next owner expects it */
+    hw_stop_LF_clk();
+    rtc_own_lfclk = false;
+  }
+}
+
+void hw_rtc_clear(void)
+{
+  NRF_RTC1->TASKS_CLEAR = 1;
+  NRF_RTC1->EVENTS_OVRFLW = 0;
+  rtc_overflows = 0;
+}
+
+/* Monotonic ticks since hw_rtc_clear */
+uint32_t hw_rtc_value(void)
+{
+  uint32_t high, low;
+  bool     pending;
+
+  do
+  {
+    high = rtc_overflows;
+    low = NRF_RTC1->COUNTER;
+    pending = NRF_RTC1->EVENTS_OVRFLW;
+  } while (high != rtc_overflows);
+
+  /* wrapped, but the interrupt has not been able to count it yet */
+  if (pending && low < RTC_COUNTER_MASK / 2)
+  {
+    high++;
+  }
+
+  return (high << 24) | low;
+}
+
+/* The same clock in milliseconds */
+uint32_t hw_rtc_ms(void)
+{
+  return (uint32_t)((uint64_t)hw_rtc_value() * 1000 / RTC_TICK_HZ);
+}
+
+/* Raise an interrupt ms from now, rounded up to whole ticks */
+void hw_rtc_wakeup(uint32_t ms)
+{
+  timers_wakeup(&rtc_clock, hw_rtc_value(), ms);
+  rtc_arm();
+}
+
+bool hw_rtc_fired(void)
+{
+  return rtc_clock.wakeup_fired;
+}
+
+/*
+ * One-shot timers. The callback runs from the RTC1 interrupt; a timer may
+ * be started again from its own callback. Starting a running timer moves it.
+ */
+void hw_timer_start(hw_timer_t *timer, uint32_t ms, hw_timer_fn_t fn, void *context)
+{
+  hw_timer_stop(timer);
+
+  NVIC_DisableIRQ(RTC1_IRQn);
+
+  timer->due = hw_rtc_value() + timers_ticks(ms);
+  timer->fn = fn;
+  timer->context = context;
+
+  timers_insert(&rtc_clock.list, timer);
+
+  rtc_arm();
+  NVIC_EnableIRQ(RTC1_IRQn);
+}
+
+void hw_timer_stop(hw_timer_t *timer)
+{
+  NVIC_DisableIRQ(RTC1_IRQn);
+
+  timers_remove(&rtc_clock.list, timer);
+
+  rtc_arm();
+  NVIC_EnableIRQ(RTC1_IRQn);
+}
+
+void RTC1_IRQHandler(void)
+{
+  if (NRF_RTC1->EVENTS_OVRFLW)
+  {
+    NRF_RTC1->EVENTS_OVRFLW = 0;
+    rtc_overflows++;
+  }
+
+  if (!NRF_RTC1->EVENTS_COMPARE[0])
+  {
+    return;
+  }
+  NRF_RTC1->EVENTS_COMPARE[0] = 0;
+
+  timers_fire(&rtc_clock, hw_rtc_value());
+  rtc_arm();
+}
+
 /*
  * Function to switch CPU clock source to internal LFCLK RC oscillator.
  */
@@ -177,6 +376,14 @@ uint32_t hw_ficr_deviceid(size_t index)
   return NRF_FICR->DEVICEID[index];
 }
 
+/* Jump through the reset vector of the image at vector_table, no return */
+typedef void (*application_entry_t)(void);
+void hw_start_application(uint32_t vector_table)
+{
+  application_entry_t application_entry = *(application_entry_t *)(vector_table + 4);
+  application_entry();
+}
+
 void hw_sleep_power_on(void)
 {
   /* Set the power mode to power on sleeping, retain some RAM */
@@ -16,8 +16,10 @@
 #define WFI() __WFI()
 #define SEV() __SEV()
 #else
-#define WFE()
-#define WFI()
+/* host simulator (sim/): waiting hands over to whatever raises the event */
+void sim_wait(void);
+#define WFE() sim_wait()
+#define WFI() sim_wait()
 #define SEV()
 #endif
 
@@ -30,13 +32,31 @@
 /* f = LFCLK/(prescaler + 1) */
 #define COUNTER_PRESCALER     ((LFCLK_FREQUENCY/RTC_FREQUENCY) - 1)
 
+/* The rate the RTC really runs at, after the integer prescaler */
+#define RTC_TICK_HZ           (LFCLK_FREQUENCY/(COUNTER_PRESCALER + 1))
+#define RTC_COUNTER_MASK      0x00FFFFFF /* 24 bit counter */
+
 typedef void (*gpioIntFnPtr)(void);
-gpioIntFnPtr gpioFn;
+extern gpioIntFnPtr gpioFn;
+
+typedef void (*hw_timer_fn_t)(void *context);
+
+typedef struct hw_timer_s
+{
+  struct hw_timer_s *next;
+  uint32_t           due;  /* in hw_rtc_value ticks */
+  hw_timer_fn_t      fn;
+  void              *context;
+} hw_timer_t;
 
 void wait_for_val_ne(volatile uint32_t *value);
 void hw_init(void);
 void hw_latch_interrupt(bool enable);
 void hw_rtc_wakeup(uint32_t ms);
+bool hw_rtc_fired(void);
+uint32_t hw_rtc_ms(void);
+void hw_timer_start(hw_timer_t *timer, uint32_t ms, hw_timer_fn_t fn, void *context);
+void hw_timer_stop(hw_timer_t *timer);
 uint32_t hw_rtc_value(void);
 void hw_rtc_start(void);
 void hw_rtc_clear(void);
@@ -50,5 +70,6 @@ void hw_stop_LF_clk(void);
 void hw_start_LF_clk(void);
 void hw_read_reset_reason(uint32_t *resetreas);
 uint32_t hw_ficr_deviceid(size_t index);
+void hw_start_application(uint32_t vector_table);
 
 #endif
@@ -0,0 +1,159 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "image.h"
+#include "crc32.h"
+#include "flash.h"
+
+#define RECORD ((const image_record_t *)FLASH_PTR(IMAGE_RECORD))
+
+static uint32_t     running_crc = 0;
+static uint32_t     hashed_end = IMAGE_START; /* running_crc covers up to here */
+static bool         dropping = false;         /* invalidation queued, not done yet */
+static image_record_t record;                 /* source of the record write */
+static image_done_t finalize_done = NULL;
+
+static void record_dropped(const flash_op_t *op, bool success)
+{
+  dropping = false;
+}
+
+static void image_touch(uint8_t page)
+{
+  uint32_t addr = page * IMAGE_PAGE_SIZE;
+
+  if (addr < IMAGE_START || addr >= IMAGE_END)
+  {
+    return;
+  }
+
+  if (addr < hashed_end)
+  {
+    /* changes under the running crc, start over */
+    running_crc = 0;
+    hashed_end = IMAGE_START;
+  }
+
+  if (dropping || image_state() == IMAGE_INVALID)
+  {
+    return;
+  }
+
+  /*
+   * Queued before the change itself, so the record says invalid first. With
+   * no record at all, the magic alone makes one that is not valid.
+   */
+  static const uint32_t zero = 0;
+  static const uint32_t magic = IMAGE_MAGIC;
+  bool none = image_state() == IMAGE_NO_RECORD;
+
+  uint32_t field = none ? offsetof(image_record_t, magic) : offsetof(image_record_t, flags);
+
+  if (flash_write_copy((uint32_t *)(IMAGE_RECORD + field),
+        (const uint8_t *)(none ? &magic : &zero), 1, record_dropped, NULL))
+  {
+    dropping = true;
+  }
+}
+
+void image_init(void)
+{
+  flash_watch(image_touch);
+}
+
+void image_reset(void)
+{
+  running_crc = 0;
+  hashed_end = IMAGE_START;
+}
+
+/* A page made it to flash; extend the running crc if it is the next one */
+void image_committed(uint8_t page)
+{
+  uint32_t addr = page * IMAGE_PAGE_SIZE;
+
+  if (addr != hashed_end || addr >= IMAGE_END)
+  {
+    return; /* out of order, image_crc catches up later */
+  }
+
+  running_crc = crc32(running_crc, FLASH_PTR(addr), IMAGE_PAGE_SIZE);
+  hashed_end += IMAGE_PAGE_SIZE;
+}
+
+/* CRC-32 of the first length bytes, padded to whole pages */
+uint32_t image_crc(uint32_t length)
+{
+  uint32_t end = IMAGE_START +
+    (length + IMAGE_PAGE_SIZE - 1) / IMAGE_PAGE_SIZE * IMAGE_PAGE_SIZE;
+
+  if (hashed_end > end)
+  {
+    image_reset();
+  }
+
+  running_crc = crc32(running_crc, FLASH_PTR(hashed_end), end - hashed_end);
+  hashed_end = end;
+  return running_crc;
+}
+
+static void record_written(const flash_op_t *op, bool success)
+{
+  if (finalize_done)
+  {
+    finalize_done(success && RECORD->flags == IMAGE_FLAG_VALID);
+  }
+}
+
+static void record_erased(const flash_op_t *op, bool success)
+{
+  /* the erase just left the queue, so there is room for the write */
+  if (!success || !flash_write(
+        (uint32_t *)IMAGE_RECORD, (const uint32_t *)&record, sizeof(record) / 4,
+        record_written, NULL))
+  {
+    record_written(op, false);
+  }
+}
+
+/*
+ * Store a valid record for an image the caller has checked with image_crc.
+ * done hears whether the record made it to flash; false here means nothing
+ * was queued.
+ */
+bool image_finalize(uint32_t length, uint32_t crc, image_done_t done)
+{
+  if (!length || length > IMAGE_END - IMAGE_START)
+  {
+    return false;
+  }
+
+  record.magic = IMAGE_MAGIC;
+  record.length = length;
+  record.crc = crc;
+  record.flags = IMAGE_FLAG_VALID;
+  finalize_done = done;
+
+  return flash_erase(IMAGE_RECORD / IMAGE_PAGE_SIZE, record_erased, NULL);
+}
+
+image_state_t image_state(void)
+{
+  if (RECORD->magic == 0xFFFFFFFF)
+  {
+    return IMAGE_NO_RECORD;
+  }
+
+  if (RECORD->magic == IMAGE_MAGIC && RECORD->flags == IMAGE_FLAG_VALID)
+  {
+    return IMAGE_VALID;
+  }
+
+  return IMAGE_INVALID;
+}
@@ -0,0 +1,61 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef _image_h
+#define _image_h
+
+/*
+ * Application image bookkeeping
+ *
+ * While pages are committed a CRC-32 runs over the application region, so
+ * finalizing an upload only has to hash whatever was not covered yet. The
+ * result goes into a small record in the settings page (.bootloaderSettings
+ * in the linker script), which is all the boot path looks at.
+ *
+ * The digest is the CRC-32 of the image padded with 0xFF to whole pages,
+ * i.e. of exactly what ends up in flash.
+ *
+ * The record is written once, on an erased page. Invalidating it only
+ * clears bits (the flags word, or writes the magic if there was no record),
+ * so it needs no erase and is queued ahead of the first change to the
+ * application region.
+ */
+
+#define IMAGE_START       0x00018000
+#define IMAGE_END         0x0003C000
+#define IMAGE_PAGE_SIZE   1024
+#define IMAGE_RECORD      0x0003FC00 /* start of the settings page */
+#define IMAGE_MAGIC       0x55464474 /* "tDFU" */
+#define IMAGE_FLAG_VALID  0x0000A5A5 /* anything else is not valid */
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t length;  /* bytes */
+  uint32_t crc;     /* of the padded image, see above */
+  uint32_t flags;
+} image_record_t;
+
+typedef enum
+{
+  IMAGE_NO_RECORD, /* nothing written yet, e.g. programmed over SWD */
+  IMAGE_VALID,
+  IMAGE_INVALID,   /* changed since, or never finished */
+} image_state_t;
+
+typedef void (*image_done_t)(bool success);
+
+void image_init(void);
+void image_reset(void);
+void image_committed(uint8_t page);
+uint32_t image_crc(uint32_t length);
+bool image_finalize(uint32_t length, uint32_t crc, image_done_t done);
+image_state_t image_state(void);
+
+#endif
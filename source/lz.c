@@ -0,0 +1,95 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "lz.h"
+
+void lz_init(lz_t *lz)
+{
+  memset(lz, 0, sizeof(*lz));
+}
+
+static inline void lz_put(lz_t *lz, uint8_t **out, uint8_t value)
+{
+  lz->window[lz->produced % LZ_WINDOW] = value;
+  lz->produced++;
+  *(*out)++ = value;
+}
+
+/*
+ * Decode as much as fits. *out_len is the room in out on entry and the
+ * number of bytes produced on return; the return value is the number of
+ * input bytes used. Whatever is not used has to be offered again.
+ */
+uint16_t lz_decode(lz_t *lz, const uint8_t *in, uint16_t in_len,
+    uint8_t *out, uint16_t *out_len)
+{
+  const uint8_t *in_start = in;
+  const uint8_t *in_end   = in + in_len;
+  uint8_t       *out_start = out;
+  uint8_t       *out_end   = out + *out_len;
+
+  while (!lz->error && out < out_end)
+  {
+    /* finish a match first, it may have been cut by the end of a page */
+    if (lz->match_left)
+    {
+      lz_put(lz, &out, lz->window[(lz->produced - lz->match_dist) % LZ_WINDOW]);
+      lz->match_left--;
+      continue;
+    }
+
+    if (in == in_end)
+    {
+      break;
+    }
+
+    if (!lz->items)
+    {
+      lz->flags = *in++;
+      lz->items = 8;
+      continue;
+    }
+
+    if (lz->flags & 1)
+    {
+      lz_put(lz, &out, *in++);
+    }
+    else if (!lz->have_low)
+    {
+      lz->low = *in++;
+      lz->have_low = true;
+      continue; /* same item, wait for its second byte */
+    }
+    else
+    {
+      uint16_t token = lz->low | (*in++ << 8);
+
+      lz->have_low   = false;
+      lz->match_dist = (token & 0x3FF) + 1;
+      lz->match_left = (token >> 10) + LZ_MIN_MATCH;
+
+      if (lz->match_dist > lz->produced)
+      {
+        /* points before the start of the stream */
+        lz->error = true;
+      }
+    }
+
+    lz->flags >>= 1;
+    lz->items--;
+  }
+
+  *out_len = out - out_start;
+  return in - in_start;
+}
+
+/* True when the stream could end here */
+bool lz_idle(const lz_t *lz)
+{
+  return !lz->match_left && !lz->have_low;
+}
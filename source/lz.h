@@ -0,0 +1,50 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef _lz_h
+#define _lz_h
+
+/*
+ * Streaming LZSS decoder
+ *
+ * The stream is a sequence of groups. Each group starts with a flag byte
+ * whose bits, LSB first, describe the following eight items:
+ *
+ *   1: literal, one byte that goes to the output as is
+ *   0: match, two bytes (little endian):
+ *        bits  0-9:  distance - 1 (1-1024 bytes back)
+ *        bits 10-15: length - 3   (3-66 bytes)
+ *
+ * The decoder can stop at any input byte and any output byte, so both the
+ * packets coming in and the page buffers going out may end anywhere.
+ */
+
+#define LZ_WINDOW      1024
+#define LZ_MIN_MATCH   3
+#define LZ_MAX_MATCH   (LZ_MIN_MATCH + 63)
+
+typedef struct
+{
+  uint8_t  window[LZ_WINDOW];
+  uint32_t produced;   /* total output, to validate distances */
+  uint16_t match_dist; /* match being copied */
+  uint8_t  match_left;
+  uint8_t  flags;      /* current flag byte, shifted as items are used */
+  uint8_t  items;      /* items left under the current flag byte */
+  uint8_t  low;        /* first byte of a match, waiting for the second */
+  bool     have_low;
+  bool     error;
+} lz_t;
+
+void lz_init(lz_t *lz);
+uint16_t lz_decode(lz_t *lz, const uint8_t *in, uint16_t in_len,
+    uint8_t *out, uint16_t *out_len);
+bool lz_idle(const lz_t *lz);
+
+#endif
@@ -1,5 +1,13 @@
 #include "hw.h"
 #include "debug.h"
+#include "dfu_request.h"
+#include "flash.h"
+#include "image.h"
+#include "lz.h"
+#include "patch.h"
+#include "stage.h"
+#include "stream.h"
+#include "tx.h"
 #include "nrf_delay.h"
 #include "nrf_gpio.h"
 #include "nrf_mbr.h"
@@ -7,79 +15,163 @@
 /* soft device stuff */
 
 #include "ble.h"
-#include "ble_conn_params.h"
 #include "ble_advertising.h"
 #include "softdevice_handler.h"
 #include "softdevice_handler_appsh.h"
-#include "app_timer_appsh.h"
 #include "app_scheduler.h"
-#include "app_timer.h"
-#include "ble_nus.h"
+#include "ble_dfus.h"
+#include "crc32.h"
 #include "ble_hci.h"
 #include "ble_radio_notification.h"
 #include "pstorage_platform.h"
 
-#define WAIT_TIME 1 /* seconds */
+#define DFU_PIN_A 25 /* both low at reset: stay in the bootloader */
+#define DFU_PIN_B 28
+#ifndef DFU_SENSE_WINDOW_MS
+#define DFU_SENSE_WINDOW_MS 0 /* also watch the pins this long, 0 for a single sample */
+#endif
 
 #define APPLICATION_ENTRY 0x00018000 //was: 0x0001B
 #define BOOTLOADER_REGION_START 0x0003C000
-#define APPLICATION_BUFFER 0x100 /* approx 256 bytes */
 
 uint32_t m_uicr_bootloader_start_address __attribute__((section(".uicrBootStartAddress"))) = BOOTLOADER_REGION_START;
-uint8_t application_buffer[APPLICATION_BUFFER]; /* we're just gonna allocate this one up front */
+volatile uint32_t m_dfu_request __attribute__((section(".noinit"))); /* see dfu_request.h */
+
+/* Session flags, set by the host with 's' and cleared on disconnect */
+#define SESSION_STAGED   0x01 /* collect 'w' chunks in RAM, one flash write per page */
+#define SESSION_WINDOWED 0x02 /* no reply per 'w', cumulative 'a' bitmaps instead */
+#define SESSION_ERASE_AHEAD 0x04 /* erase page n+1 as soon as page n is written to */
+#define SESSION_AUTO_ERASE  0x08 /* erase a page on its first write, no 'd' needed */
+#define DEFAULT_WINDOW   16   /* chunks per cumulative ack */
+uint8_t session_flags = 0;
+uint8_t session_window = DEFAULT_WINDOW;
+uint8_t ack_page = 0;    /* page the next cumulative ack is about */
+uint8_t ack_pending = 0; /* chunks seen for it since the last ack */
+
+/* Byte streams ('z' compressed image, 'p' patch) decode straight into the page staging */
+#define APPLICATION_END BOOTLOADER_REGION_START
+static union                       /* one stream at a time, they share the RAM */
+{
+  lz_t    unpack;                  /* 'z' decoder state incl. its window */
+  patch_t patch;                   /* 'p' decoder state incl. its scratch page */
+} decoder;
+uint8_t  stream_cmd = 0;           /* 'z' or 'p', names the replies too */
+uint32_t stream_base = 0;          /* first output address */
+uint32_t stream_out = 0;           /* where the next output byte goes */
+uint32_t stream_acked = 0;         /* consumed count last told to the host */
+bool     stream_finishing = false; /* host sent the end, FIFO still draining */
+bool     stream_stalled = false;   /* decoder has output left, waits for a page or the TX ring */
+
+/* Pages erased (or being written) on this connection, so not to be erased again */
+#define ERASE_QUEUE_ROOM 2 /* flash queue entries range erases leave to writes */
+uint8_t erased[256 / 8];
+uint8_t range_next = 0;    /* next page of a 'D' range to queue */
+uint8_t range_end = 0;     /* first page past it */
+uint8_t ahead_first = 0;   /* pages the host said it will write, erase ahead stays inside */
+uint8_t ahead_end = 0;
+
+/* Bulk replies ('h' hash table, 'R' read-back) are produced as the TX ring drains */
+#define HASHES_PER_REPLY 4 /* crc32s in one notification */
+uint8_t hash_page = 0;     /* next page to hash */
+uint8_t hash_last = 0;     /* last page asked for */
+bool    hash_active = false;
+uint32_t read_addr = 0;    /* next chunk to read back */
+uint32_t read_end = 0;     /* first address past the range */
+
+/* Commands waiting for room in the TX ring, in the order they came */
+#define RX_HOLD_SIZE 16 /* commands a host may keep unanswered */
+typedef struct
+{
+  uint8_t len;
+  uint8_t data[BLE_DFUS_MAX_DATA_LEN];
+} rx_packet_t;
+
+static rx_packet_t rx_hold[RX_HOLD_SIZE];
+static uint8_t     rx_head = 0;
+static uint8_t     rx_count = 0;
 
 /* Forward Declarations */
 bool check_enter_bootloader();
+bool dfu_pins_arm();
 void launch_application();
 void sd_init();
 void ble_init();
 void check_error(uint32_t);
 void sd_dispatch(ble_evt_t *);
 void sys_evt_dispatch(uint32_t);
-void nus_data_handler(ble_nus_t*, uint8_t*, uint16_t);
+void erase_done(const flash_op_t *, bool);
+void write_done(const flash_op_t *, bool);
+void page_committed(uint8_t, bool, uint16_t);
+void send_ack(uint8_t);
+void stream_poll();
+uint16_t unpack_consume(const uint8_t *, uint16_t);
+uint16_t patch_consume(const uint8_t *, uint16_t);
+void bulk_poll();
+void erase_poll();
+bool reply_room();
+void rx_poll();
+void erase_ahead(uint8_t);
+void range_erase_done(const flash_op_t *, bool);
+void ahead_erase_done(const flash_op_t *, bool);
+void image_stored(bool);
+void dfus_data_handler(ble_dfus_t*, uint8_t*, uint16_t);
 void on_adv_evt(ble_adv_evt_t);
+void link_activity();
+void link_idle_timeout(void *);
+void link_idle_check(void *, uint16_t);
+void link_disconnected();
 void _32mhz_clock();
 
 /* Software device stuff */
-ble_nus_t  m_nus; /* uart service identifier */
+ble_dfus_t m_dfus; /* dfu service identifier */
 uint16_t   m_conn_handle = BLE_CONN_HANDLE_INVALID; /* connection handle */
-ble_uuid_t m_adv_uuids[] = {{BLE_UUID_NUS_SERVICE, BLE_UUID_TYPE_VENDOR_BEGIN}}; /* uuids for uart service */
+ble_uuid_t m_adv_uuids[] = {{BLE_UUID_DFUS_SERVICE, BLE_UUID_TYPE_VENDOR_BEGIN}}; /* uuids for dfu service */
 bool       sd_initialized = false;
-volatile bool tx_wait     = false; // send one package and wait until it's recieved
 ///
 /// Entry point
 ///
 int main(void)
 {
 
-  /* HW INIT, clocks and so forth */
   _32mhz_clock();
-  hw_init();
 
-  _debug_printf("hardware initialized");
   /* Check to see if we need to enter the bootloader, or just jump to the application */
+  /* (before any clock is started, the application does its own) */
 
   if (!check_enter_bootloader())
   {
-    _debug_printf("launching application");
     launch_application();  
   }
 
+  /* HW INIT, clocks and so forth */
+  hw_init();
+
   /* if we got here, we're supposed to do bootloader things */
   _debug_printf("entering bootloader");
   /* If bootloader: */
   /* init the (yuck) softdevice */
   sd_init();
   ble_init();
+  tx_init(&m_dfus);
+  stage_init(page_committed);
+  image_init();
 
   /* begin advertising */
   _debug_printf("beginning advertising");
   uint32_t err = ble_advertising_start(BLE_ADV_MODE_FAST);
   check_error(err);
 
-  _debug_printf("entering powersave loop");
+  /*
+   * Event loop. Softdevice events (and with them every DFU packet) and
+   * deferred timer work arrive through the scheduler and are handled here,
+   * in thread context, all of them per wakeup; we only sleep once the queue
+   * is empty. Anything that lands while draining sets the event register,
+   * so the wait returns at once and nothing is left behind.
+   */
+  _debug_printf("entering event loop");
   for(;;)
   {
+    app_sched_execute();
     err = sd_app_evt_wait();
     check_error(err);
   }
@@ -93,37 +185,117 @@ bool check_enter_bootloader()
 {  
   bool should_enter = false;
 
-  // Fast path--check if there is an application. if not, true fast
-  uint8_t * ptr = (uint8_t *)APPLICATION_ENTRY;
-  if(ptr[3] != 0x20) /* stack pointer */
+  // The application may have asked for DFU before resetting (see
+  // dfu_request.h). Taken and cleared first, whatever decides below
+  bool requested = false;
+  if (NRF_POWER->GPREGRET == DFU_REQUEST_GPREGRET)
   {
-    return true;
+    NRF_POWER->GPREGRET = 0;
+    requested = true;
+  }
+  if (m_dfu_request == DFU_REQUEST_MAGIC)
+  {
+    m_dfu_request = 0;
+    requested = true;
   }
 
-  uint32_t accumulated_ms = 0;
+  // Fast path--the settings record says whether the last upload finished
+  image_state_t state = image_state();
+  if (state == IMAGE_INVALID)
+  {
+    return true;
+  }
 
-  /* Example: set up GPIO directions */
-  nrf_gpio_cfg_input(25, NRF_GPIO_PIN_PULLUP);
-  nrf_gpio_cfg_input(28, NRF_GPIO_PIN_PULLUP);
+  // No record (programmed some other way): check if there is an application
+  const uint8_t * ptr = FLASH_PTR(APPLICATION_ENTRY);
+  if(state == IMAGE_NO_RECORD && ptr[3] != 0x20) /* stack pointer */
+  {
+    return true;
+  }
 
-  /* Example: wait up to WAIT_TIME seconds for input to happen */
-  while (!should_enter && accumulated_ms < WAIT_TIME * 1000UL)
-  {    
-    /* Example: check if these two pins are low at any time in the first WAIT_TIME seconds */    
-    should_enter = (!nrf_gpio_pin_read(28) && !nrf_gpio_pin_read(25));
+  if (requested)
+  {
+    return true;
+  }
 
-    nrf_delay_ms(50);
-    accumulated_ms += 50;
+  /* Example: both pins held low at reset */
+  nrf_gpio_cfg_input(DFU_PIN_A, NRF_GPIO_PIN_PULLUP);
+  nrf_gpio_cfg_input(DFU_PIN_B, NRF_GPIO_PIN_PULLUP);
+
+  /* let the pullups settle, then one sample */
+  nrf_delay_us(5);
+  should_enter = (!nrf_gpio_pin_read(DFU_PIN_A) && !nrf_gpio_pin_read(DFU_PIN_B));
+
+#if DFU_SENSE_WINDOW_MS
+  /*
+   * Optionally give a slow button the window. Sleep until a pin changes
+   * (PORT sense) or the RTC says the window is over, whichever is first.
+   * PORT fires when DETECT, the OR of all sensing pins, goes high; a pin
+   * left sensing low once it is low would hold DETECT up and hide the
+   * other pin. So every wakeup re-arms each pin for the level it does not
+   * have, a press of one and then the other is seen as it happens.
+   *
+   * This runs before hw_init, SEVONPEND is not set yet. WFE wakes all the
+   * same: the GPIOTE and RTC1 interrupts are enabled and taken, and taking
+   * one sets the event register, also between the pin read and the WFE.
+   */
+  if (!should_enter)
+  {
+    hw_rtc_start();
+    hw_rtc_wakeup(DFU_SENSE_WINDOW_MS);
+    hw_latch_interrupt(true);
+    should_enter = dfu_pins_arm();
+
+    while (!should_enter && !hw_rtc_fired())
+    {
+      WFE();
+      should_enter = dfu_pins_arm();
+    }
+
+    hw_latch_interrupt(false);
+    hw_rtc_stop();
+    hw_rtc_clear();
   }
+#endif
+
+  /* sense off again, the application gets the pins as they were */
+  nrf_gpio_cfg_input(DFU_PIN_A, NRF_GPIO_PIN_PULLUP);
+  nrf_gpio_cfg_input(DFU_PIN_B, NRF_GPIO_PIN_PULLUP);
+  hw_clear_port_event();
 
   return should_enter;
 }
 
+#if DFU_SENSE_WINDOW_MS
+///
+/// Sense each DFU pin for the level it does not have, true if both are low
+///
+bool dfu_pins_arm()
+{
+  for (;;)
+  {
+    bool a_low = !nrf_gpio_pin_read(DFU_PIN_A);
+    bool b_low = !nrf_gpio_pin_read(DFU_PIN_B);
+
+    nrf_gpio_cfg_sense_input(DFU_PIN_A, NRF_GPIO_PIN_PULLUP,
+        a_low ? NRF_GPIO_PIN_SENSE_HIGH : NRF_GPIO_PIN_SENSE_LOW);
+    nrf_gpio_cfg_sense_input(DFU_PIN_B, NRF_GPIO_PIN_PULLUP,
+        b_low ? NRF_GPIO_PIN_SENSE_HIGH : NRF_GPIO_PIN_SENSE_LOW);
+    hw_clear_port_event();
+
+    /* a pin that changed meanwhile raised DETECT before the clear, again */
+    if (a_low == !nrf_gpio_pin_read(DFU_PIN_A) && b_low == !nrf_gpio_pin_read(DFU_PIN_B))
+    {
+      return a_low && b_low;
+    }
+  }
+}
+#endif
+
 ///
 /// Go to and launch the main application
 ///
 
-typedef void (*application_entry_t)(void);
 void launch_application()
 {
   if (sd_initialized) /* should we do this in all cases? */
@@ -133,12 +305,12 @@ void launch_application()
     check_error(err_code);
   }
 
-  application_entry_t application_entry = *(application_entry_t *)(APPLICATION_ENTRY+4);
-  application_entry();
+  hw_start_application(APPLICATION_ENTRY);
 }
 
 /*
  * Memory Layout
+ * 0x0003FC00 Settings page (image record, see image.h)
  * 0x0003C000 BOOTLOADER_REGION_START
  * 0x00018000 APPLICATION_ENTRY
  * 0x00001000 Softdevice S110 v10
@@ -166,12 +338,15 @@ void serial_rx(uint8_t* data, uint16_t len)
          *
          * Valid pages to delete: 0x00018000 - 0x0003C000
          * Page Number(s) 96 - 239
+         *
+         * Answers 'd', page, 'O', 'K', 1 if the page was blank already and
+         * the erase was skipped, 0 otherwise.
          */
         if (len != 2)
         {
           {
             const char* test = "! invalid args";
-            ble_nus_string_send(&m_nus, (uint8_t *)test, strlen(test));
+            tx_send((uint8_t *)test, strlen(test));
           }
           return; /* invalid length */
         }
@@ -180,21 +355,21 @@ void serial_rx(uint8_t* data, uint16_t len)
         {
           {
             const char* test = "! invalid page";
-            ble_nus_string_send(&m_nus, (uint8_t *)test, strlen(test));
+            tx_send((uint8_t *)test, strlen(test));
           } 
           return; /* invalid page */
         }
 
-        uint32_t err = sd_flash_page_erase(data[1]);
-        check_error(err);
-
-        application_buffer[60] = 'd';
-        application_buffer[61] = data[1];
-        application_buffer[62] = 'O';
-        application_buffer[63] = 'K';
-        ble_nus_string_send(&m_nus, &application_buffer[60], 4);
-        check_error(err);
-
+        /* acked from erase_done once the page is really erased */
+        if (!flash_erase(data[1], erase_done, NULL))
+        {
+          {
+            const char* test = "! flash busy";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* queue full */
+        }
+        erased[data[1] / 8] |= 1 << (data[1] % 8);
       }
       break;
 
@@ -212,12 +387,15 @@ void serial_rx(uint8_t* data, uint16_t len)
          * Valid pages to write: 0x00018000 - 0x0003C000
          * Page Number(s) 96 - 239
          * Portions: 0-63 (16 bytes segments)
+         *
+         * Answers 'w', page, portion, 'O', 'K', number of 0xFFFFFFFF words
+         * that did not need writing (0-4).
          */
         if (len != 19)
         {
           {
             const char* test = "! invalid args";
-            ble_nus_string_send(&m_nus, (uint8_t *)test, strlen(test));
+            tx_send((uint8_t *)test, strlen(test));
           }
           return; /* invalid length */
         }
@@ -226,7 +404,7 @@ void serial_rx(uint8_t* data, uint16_t len)
         {
           {
             const char* test = "! invalid page";
-            ble_nus_string_send(&m_nus, (uint8_t *)test, strlen(test));
+            tx_send((uint8_t *)test, strlen(test));
           }
           return; /* invalid page */
         }
@@ -235,40 +413,106 @@ void serial_rx(uint8_t* data, uint16_t len)
         {
           {
             const char* test = "! invalid chunk";
-            ble_nus_string_send(&m_nus, (uint8_t *)test, strlen(test));
+            tx_send((uint8_t *)test, strlen(test));
           }
           return; /* invalid chunk */
         }
 
-        application_buffer[0]  = data[3];
-        application_buffer[1]  = data[4];
-        application_buffer[2]  = data[5];
-        application_buffer[3]  = data[6];
-        application_buffer[4]  = data[7];
-        application_buffer[5]  = data[8];
-        application_buffer[6]  = data[9];
-        application_buffer[7]  = data[10];
-        application_buffer[8]  = data[11];
-        application_buffer[9]  = data[12];
-        application_buffer[10] = data[13];
-        application_buffer[11] = data[14];
-        application_buffer[12] = data[15];
-        application_buffer[13] = data[16];
-        application_buffer[14] = data[17];
-        application_buffer[15] = data[18];
-
-        /* write it out */
-        uint32_t err = sd_flash_write((uint32_t *)(data[1] * 1024 + data[2] * 16), (const uint32_t *)&application_buffer[0], 4);
-        check_error(err);   
-
-        application_buffer[60] = 'w';
-        application_buffer[61] = data[1];
-        application_buffer[62] = data[2];
-        application_buffer[63] = 'O';
-        application_buffer[64] = 'K';
-        ble_nus_string_send(&m_nus, &application_buffer[60], 5);
-        check_error(err);
+        if ((session_flags & SESSION_AUTO_ERASE) && !(session_flags & SESSION_STAGED) &&
+            !(erased[data[1] / 8] & (1 << (data[1] % 8))))
+        {
+          /* the erase has to be queued together with the write behind it */
+          if (flash_room() < 2 || !flash_erase(data[1], ahead_erase_done, NULL))
+          {
+            {
+              const char* test = "! flash busy";
+              tx_send((uint8_t *)test, strlen(test));
+            }
+            return; /* queue full */
+          }
+          erased[data[1] / 8] |= 1 << (data[1] % 8);
+        }
+
+        if (session_flags & SESSION_ERASE_AHEAD)
+        {
+          /* a page being written must never be erased ahead of again */
+          erased[data[1] / 8] |= 1 << (data[1] % 8);
+          erase_ahead(data[1] + 1);
+        }
+
+        if (session_flags & SESSION_WINDOWED)
+        {
+          /*
+           * (page, chunk) is the sequence number. Chunks are not answered
+           * one by one; every session_window chunks, a finished page or a
+           * switch to another page produce one 'a' bitmap of what this page
+           * holds so far. Chunks that found no room simply stay 0 in there.
+           */
+          if (data[1] != ack_page && ack_pending)
+          {
+            send_ack(ack_page);
+          }
+
+          if (data[1] != ack_page)
+          {
+            ack_page = data[1];
+            ack_pending = 0;
+          }
+
+          /*
+           * A page that is complete or in flash already only gets late
+           * copies of chunks the host could not know had arrived. Staged
+           * again they would hold a slot that never fills.
+           */
+          stage_result_t result = STAGE_OK;
+
+          if (stage_received(data[1]) != UINT64_MAX)
+          {
+            result = stage_write(data[1], data[2], &data[3]);
+          }
+
+          if (result == STAGE_COMMIT || ++ack_pending >= session_window)
+          {
+            send_ack(ack_page);
+            ack_pending = 0;
+          }
+          break;
+        }
 
+        if (session_flags & SESSION_STAGED)
+        {
+          /* a resent chunk of a complete page is acked, not staged again */
+          if (stage_received(data[1]) != UINT64_MAX &&
+              stage_write(data[1], data[2], &data[3]) == STAGE_BUSY)
+          {
+            {
+              const char* test = "! stage busy";
+              tx_send((uint8_t *)test, strlen(test));
+            }
+            return; /* no room, host has to resend */
+          }
+
+          /* the page itself is acked with 'c' once it is in flash */
+          uint8_t *reply = tx_alloc();
+          reply[0] = 'w';
+          reply[1] = data[1];
+          reply[2] = data[2];
+          reply[3] = 'O';
+          reply[4] = 'K';
+          uint32_t err = tx_commit(reply, 5);
+          check_error(err);
+          break;
+        }
+
+        /* write it out, acked from write_done */
+        if (!flash_write_copy((uint32_t *)(data[1] * 1024 + data[2] * 16), &data[3], 4, write_done, NULL))
+        {
+          {
+            const char* test = "! flash busy";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* queue full */
+        }
       }
 
       break;
@@ -290,7 +534,7 @@ void serial_rx(uint8_t* data, uint16_t len)
         {
           {
             const char* test = "! invalid args";
-            ble_nus_string_send(&m_nus, (uint8_t *)test, strlen(test));
+            tx_send((uint8_t *)test, strlen(test));
           }
           return; /* invalid length */
         }
@@ -299,7 +543,7 @@ void serial_rx(uint8_t* data, uint16_t len)
         {
           {
             const char* test = "! invalid page";
-            ble_nus_string_send(&m_nus, (uint8_t *)test, strlen(test));
+            tx_send((uint8_t *)test, strlen(test));
           }
           return; /* invalid page */
         }
@@ -308,25 +552,20 @@ void serial_rx(uint8_t* data, uint16_t len)
         {
           {
             const char* test = "! invalid chunk";
-            ble_nus_string_send(&m_nus, (uint8_t *)test, strlen(test));
+            tx_send((uint8_t *)test, strlen(test));
           }
           return; /* invalid chunk */
         }
 
-        uint8_t * addr = (uint8_t *) ((data[1]*1024) + (data[2]*16));
-        for(uint8_t i = 0; i < 16; i+=4)
-        {
-          application_buffer[3 + i + 0] = *(addr + i + 0);
-          application_buffer[3 + i + 1] = *(addr + i + 1);
-          application_buffer[3 + i + 2] = *(addr + i + 2);
-          application_buffer[3 + i + 3] = *(addr + i + 3);
-        }
+        /* straight from flash into the notification */
+        uint8_t *reply = tx_alloc();
+        memcpy(&reply[3], FLASH_PTR((data[1]*1024) + (data[2]*16)), 16);
 
-        application_buffer[0] = 'r';
-        application_buffer[1] = data[1];
-        application_buffer[2] = data[2];
+        reply[0] = 'r';
+        reply[1] = data[1];
+        reply[2] = data[2];
        
-        uint32_t err = ble_nus_string_send(&m_nus, &application_buffer[0], 16+3);
+        uint32_t err = tx_commit(reply, 16+3);
         check_error(err);
       }
 
@@ -345,31 +584,488 @@ void serial_rx(uint8_t* data, uint16_t len)
         {
           {
             const char* test = "! invalid args";
-            ble_nus_string_send(&m_nus, (uint8_t *)test, strlen(test));
+            tx_send((uint8_t *)test, strlen(test));
           }
           return; /* invalid length */
         }
 
-        uint8_t * addr = (uint8_t *) 0x1000005c;
+        uint32_t ids[3] = { NRF_FICR->CONFIGID, NRF_FICR->DEVICEID[0], NRF_FICR->DEVICEID[1] };
+        uint8_t *reply = tx_alloc();
         for(uint8_t i = 0; i < 12; i+=4)
         {
           /* little endians */
-          application_buffer[1 + i + 0] = *(addr + i + 3);
-          application_buffer[1 + i + 1] = *(addr + i + 2);
-          application_buffer[1 + i + 2] = *(addr + i + 1);
-          application_buffer[1 + i + 3] = *(addr + i + 0);
+          reply[1 + i + 0] = ids[i / 4] >> 24;
+          reply[1 + i + 1] = ids[i / 4] >> 16;
+          reply[1 + i + 2] = ids[i / 4] >> 8;
+          reply[1 + i + 3] = ids[i / 4];
         }
 
-        application_buffer[0] = 'i';
+        reply[0] = 'i';
        
-        uint32_t err = ble_nus_string_send(&m_nus, &application_buffer[0], 12+1);
+        uint32_t err = tx_commit(reply, 12+1);
+        check_error(err);
+      }
+      break;
+    case 's':
+      /* set session flags */
+      {
+        /*
+         * Command format:
+         * byte 0: s
+         * byte 1: flags
+         * byte 2: (optional) window, chunks per cumulative ack, 1-64
+         * byte 3: first page of the image (with bit 2, required there)
+         * byte 4: number of pages in it, every one of them to be written
+         *
+         * bit 0: staged writes. 'w' chunks are collected in RAM and every
+         *        page goes to flash in one piece once all 64 chunks are in,
+         *        acknowledged with 'c', page, 'O', 'K', words not written
+         *        (2 bytes LE, 0xFF words left out or the page already matched).
+         *        Chunks resent for a complete page are acked and dropped
+         * bit 1: windowed writes (implies staged). 'w' gets no reply of its
+         *        own, the host streams chunks back to back and gets
+         *        'a', page, 8 byte bitmap (LE, bit n = chunk n) instead.
+         *        Once a page is complete, further chunks for it are
+         *        ignored until the next 's'
+         * bit 2: erase ahead. The first 'w' to a page queues the erase of
+         *        the page after it, so that erase runs while the rest of
+         *        this page is still on its way. Only pages inside the range
+         *        in bytes 3-4 are erased this way, so the host has to write
+         *        all of them; pages already erased with 'd' or 'D' on this
+         *        connection are left alone. Only a failed erase is
+         *        reported ("! erase failed").
+         * bit 3: auto erase. No 'd' needed: the first 'w' to a page on
+         *        this connection erases it before the write, and staged
+         *        pages are erased right before their commit (also for
+         *        'z' streams). Same pages as 'd', failures as above.
+         *
+         * Any partially collected page is thrown away.
+         */
+        if (len != 2 && len != 3 && len != 5)
+        {
+          {
+            const char* test = "! invalid args";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid length */
+        }
+
+        if ((data[1] & SESSION_ERASE_AHEAD) && len != 5)
+        {
+          {
+            const char* test = "! invalid args";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* erase ahead without a range */
+        }
+
+        if (len == 5 && (data[3] < 96 || data[4] == 0 || data[3] + data[4] > 240))
+        {
+          {
+            const char* test = "! invalid page";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid range */
+        }
+
+        if (len >= 3 && (data[2] == 0 || data[2] > 64))
+        {
+          {
+            const char* test = "! invalid window";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid window */
+        }
+
+        session_flags = data[1];
+        if (session_flags & SESSION_WINDOWED)
+        {
+          session_flags |= SESSION_STAGED;
+        }
+        session_window = (len >= 3) ? data[2] : DEFAULT_WINDOW;
+        ahead_first = (len == 5) ? data[3] : 0;
+        ahead_end = (len == 5) ? data[3] + data[4] : 0;
+        ack_pending = 0;
+        stage_reset();
+        stage_set_erase(session_flags & SESSION_AUTO_ERASE);
+
+        uint8_t *reply = tx_alloc();
+        reply[0] = 's';
+        reply[1] = session_flags;
+        reply[2] = 'O';
+        reply[3] = 'K';
+        uint32_t err = tx_commit(reply, 4);
+        check_error(err);
+      }
+      break;
+    case 'z':
+    case 'p':
+      /* compressed stream / patch start and end */
+      {
+        /*
+         * Command format:
+         * byte 0: z (compressed) or p (patch)
+         * byte 1: first page to write (start)
+         *
+         * or just 'z' / 'p' on its own to end the stream.
+         *
+         * Start answers 'z', page, 'O', 'K', FIFO size (2 bytes LE). The
+         * data then comes in 'Z' packets (see lz.h for the format) and is
+         * unpacked straight into the page staging; every STREAM_ACK_STEP
+         * bytes the device reports 'Z', bytes consumed (4 bytes LE). The
+         * host may run at most FIFO size bytes ahead of that count.
+         *
+         * The end pads the last page with 0xFF, commits it and answers
+         * 'z', 'E', bytes written (4 bytes LE). Pages must be erased,
+         * unless the session has auto erase on.
+         *
+         * A patch works the same with 'p' and 'P' in place of 'z' and 'Z'.
+         * Its data (see patch.h) is applied against the image already in
+         * flash, and pages are erased as they are overwritten, so no 'd'
+         * first. Pages that come out unchanged are not touched at all.
+         */
+        if (len == 1)
+        {
+          if (!stream_active() || data[0] != stream_cmd)
+          {
+            {
+              const char* test = "! no stream";
+              tx_send((uint8_t *)test, strlen(test));
+            }
+            return; /* nothing to end */
+          }
+
+          stream_finishing = true;
+          stream_poll();
+          break;
+        }
+
+        if (len != 2)
+        {
+          {
+            const char* test = "! invalid args";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid length */
+        }
+
+        if (data[1] < 96 || data[1] >= 240)
+        {
+          {
+            const char* test = "! invalid page";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid page */
+        }
+
+        stage_reset();
+        stream_cmd = data[0];
+        stream_base = data[1] * 1024;
+        stream_out = stream_base;
+        stream_acked = 0;
+        stream_finishing = false;
+
+        if (stream_cmd == 'p')
+        {
+          patch_init(&decoder.patch, stream_base);
+          stage_set_erase(true);
+          stream_start(patch_consume);
+        }
+        else
+        {
+          lz_init(&decoder.unpack);
+          stage_set_erase(session_flags & SESSION_AUTO_ERASE);
+          stream_start(unpack_consume);
+        }
+
+        uint8_t *reply = tx_alloc();
+        reply[0] = stream_cmd;
+        reply[1] = data[1];
+        reply[2] = 'O';
+        reply[3] = 'K';
+        reply[4] = STREAM_FIFO_SIZE & 0xFF;
+        reply[5] = STREAM_FIFO_SIZE >> 8;
+        uint32_t err = tx_commit(reply, 6);
         check_error(err);
       }
       break;
+    case 'Z':
+    case 'P':
+      /* compressed stream / patch data */
+      {
+        /*
+         * Command format:
+         * byte 0: Z or P, matching the stream
+         * byte 1-19: stream bytes
+         *
+         * No reply of its own, see 'z'.
+         */
+        if (len < 2)
+        {
+          {
+            const char* test = "! invalid args";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid length */
+        }
+
+        if (!stream_active() || stream_finishing || data[0] != stream_cmd - 'a' + 'A')
+        {
+          {
+            const char* test = "! no stream";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* not expecting data */
+        }
+
+        if (!stream_push(&data[1], len - 1))
+        {
+          stream_stop();
+          stage_reset(); /* and the page it had started */
+          {
+            const char* test = "! stream overflow";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* host ran past its credit */
+        }
+
+        stream_poll();
+      }
+      break;
+    case 'h':
+      /* hash pages */
+      {
+        /*
+         * Command format:
+         * byte 0: h
+         * byte 1: first page to hash
+         * byte 2: last page to hash (optional, defaults to the first)
+         *
+         * Valid pages: 96 - 239
+         *
+         * Answers 'h', page, then the CRC-32 (4 bytes LE) of that page
+         * and the ones following it, up to HASHES_PER_REPLY per
+         * notification, until the last page is covered. A new 'h'
+         * replaces one still running.
+         */
+        if (len != 2 && len != 3)
+        {
+          {
+            const char* test = "! invalid args";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid length */
+        }
+
+        uint8_t last = len == 3 ? data[2] : data[1];
+
+        if (data[1] < 96 || last >= 240 || last < data[1])
+        {
+          {
+            const char* test = "! invalid page";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid page */
+        }
+
+        hash_page = data[1];
+        hash_last = last;
+        hash_active = true;
+        bulk_poll();
+      }
+      break;
+    case 'D':
+      /* delete page range */
+      {
+        /*
+         * Command format:
+         * byte 0: D
+         * byte 1: first page to delete
+         * byte 2: number of pages
+         *
+         * Valid pages to delete: 96 - 239
+         *
+         * The erases run back to back in the background; each page
+         * answers 'D', page, 'O', 'K', 1 if it was blank already (else 0),
+         * pages still to come. The last one says 0 there. A new 'D'
+         * replaces a range still running.
+         */
+        if (len != 3 || data[2] == 0)
+        {
+          {
+            const char* test = "! invalid args";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid length */
+        }
+
+        if (data[1] < 96 || data[1] + data[2] > 240)
+        {
+          {
+            const char* test = "! invalid page";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid page */
+        }
+
+        range_next = data[1];
+        range_end = data[1] + data[2];
+        erase_poll();
+      }
+      break;
+    case 'f':
+      /* finalize image */
+      {
+        /*
+         * Command format:
+         * byte 0: f
+         * byte 1-4: image length in bytes (LE)
+         * byte 5-8: CRC-32 of the image padded with 0xFF to whole pages (LE)
+         *
+         * Once all flash work is done, the device compares the digest
+         * with its own and on a match writes the record that lets the
+         * next boot start the application, then answers 'f', 'O', 'K'.
+         * A mismatch answers 'f', '!', the device's CRC-32 (4 bytes LE).
+         * Any change to the application afterwards drops the record again.
+         */
+        if (len != 9)
+        {
+          {
+            const char* test = "! invalid args";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid length */
+        }
+
+        uint32_t length, crc;
+        memcpy(&length, &data[1], 4);
+        memcpy(&crc, &data[5], 4);
+
+        if (!length || length > APPLICATION_END - APPLICATION_ENTRY)
+        {
+          {
+            const char* test = "! invalid args";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid length */
+        }
+
+        if (!flash_idle() || stream_active())
+        {
+          {
+            const char* test = "! flash busy";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* pages still on their way */
+        }
+
+        uint32_t actual = image_crc(length);
+
+        if (actual != crc)
+        {
+          uint8_t *reply = tx_alloc();
+          reply[0] = 'f';
+          reply[1] = '!';
+          memcpy(&reply[2], &actual, 4);
+          uint32_t err = tx_commit(reply, 6);
+          check_error(err);
+          break;
+        }
+
+        /* acked from image_stored once the record is in flash */
+        if (!image_finalize(length, crc, image_stored))
+        {
+          {
+            const char* test = "! flash busy";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* queue full */
+        }
+      }
+      break;
+    case 'R':
+      /* bulk read pages */
+      {
+        /*
+         * Command format:
+         * byte 0: R
+         * byte 1: first page to read
+         * byte 2: last page to read (optional, defaults to the first)
+         *
+         * Valid pages: 96 - 239
+         *
+         * Answers with the same 'r', page, chunk, 16 bytes notifications
+         * a series of 'r' commands would get, for every chunk of the
+         * range in order, as fast as the link takes them. A new 'R'
+         * replaces one still running, 'R' on its own stops it.
+         */
+        if (len == 1)
+        {
+          read_addr = read_end;
+          break;
+        }
+
+        if (len != 2 && len != 3)
+        {
+          {
+            const char* test = "! invalid args";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid length */
+        }
+
+        uint8_t last = len == 3 ? data[2] : data[1];
+
+        if (data[1] < 96 || last >= 240 || last < data[1])
+        {
+          {
+            const char* test = "! invalid page";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid page */
+        }
+
+        read_addr = data[1] * 1024;
+        read_end = (last + 1) * 1024;
+        bulk_poll();
+      }
+      break;
+    case 'q':
+      /* query staged chunks */
+      {
+        /*
+         * Command format:
+         * byte 0: q
+         * byte 1: page
+         *
+         * Answers with the same 'a' bitmap windowed writes produce, for when
+         * the host lost track of a page (all ones once it was committed).
+         */
+        if (len != 2)
+        {
+          {
+            const char* test = "! invalid args";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid length */
+        }
+
+        if (data[1] < 96 || data[1] >= 240)
+        {
+          {
+            const char* test = "! invalid page";
+            tx_send((uint8_t *)test, strlen(test));
+          }
+          return; /* invalid page */
+        }
+
+        send_ack(data[1]);
+      }
+      break;
     case 'e':
       /* echo */
       {
-        ble_nus_string_send(&m_nus, data+1, len-1);
+        tx_send(data+1, len-1);
       }
 
       break;
@@ -377,7 +1073,7 @@ void serial_rx(uint8_t* data, uint16_t len)
       /* unknown command */
       {
         const char* test = "! Unknown Cmd";
-        ble_nus_string_send(&m_nus, (uint8_t *)test, strlen(test));
+        tx_send((uint8_t *)test, strlen(test));
       }
   } 
 }
@@ -387,7 +1083,7 @@ void _32mhz_clock()
   /* Configure for the 32MHz Clock, as per Taiyo-Yuden Datasheet */
 
   /* First, check if it's not already set */
-  if (*(uint32_t *)0x10001008 == 0xFFFFFFFF) 
+  if (NRF_UICR->XTALFREQ == 0xFFFFFFFF) 
   { 
     _debug_printf("setting clock to 32mhz");
 
@@ -396,7 +1092,7 @@ void _32mhz_clock()
     while (NRF_NVMC->READY == NVMC_READY_READY_Busy){} 
     
     /* Configure for the proper 32mhz clock */
-    *(uint32_t *)0x10001008 = 0xFFFFFF00; 
+    NRF_UICR->XTALFREQ = 0xFFFFFF00; 
     NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Ren << NVMC_CONFIG_WEN_Pos; 
     while (NRF_NVMC->READY == NVMC_READY_READY_Busy){} 
 
@@ -417,30 +1113,111 @@ void _32mhz_clock()
 
 #define DEVICE_NAME       "KRALN TINYDFU"
 
-#define MIN_CONN_INTERVAL 16   /* units of 1.25ms -> 20ms */
+#define MIN_CONN_INTERVAL 6    /* units of 1.25ms -> 7.5ms, the fastest allowed */
 #define MAX_CONN_INTERVAL 60   /* units of 1.25ms -> 75ms */
 #define CONN_SUP_TIMEOUT  400  /* units of 10ms -> 4s */
+
+#define IDLE_MIN_CONN_INTERVAL 40   /* units of 1.25ms -> 50ms */
+#define IDLE_MAX_CONN_INTERVAL 60   /* units of 1.25ms -> 75ms */
+#define IDLE_SLAVE_LATENCY     4    /* connection events we may sleep through */
+#define LINK_IDLE_TIMEOUT      2000 /* ms without a packet before relaxing */
+#define LINK_RETRY_TIMEOUT     250  /* ms before asking again after a refused update */
 #define APP_ADV_INTERVAL  64   /* units of 0.625ms -> 40ms */
 #define APP_ADV_TIMEOUT   180  /* units of 1s -> 3 minutes (max) */
 
-#define FIRST_CONN_PARAMS_UPDATE_DELAY  5000  /* assuming RTC1 prescaler = 0, 5s */
-#define NEXT_CONN_PARAMS_UPDATE_DELAY   30000 /* assuming same as above */
-#define MAX_CONN_PARAMS_UPDATE_COUNT    3     /* give up after this many attempts */
+///
+/// Connection interval switching
+///
+/// As soon as the host talks to us we ask for the shortest interval, and once
+/// it has been quiet for LINK_IDLE_TIMEOUT we go back to a relaxed interval
+/// with slave latency. Both lie inside the preferred range. This is all the
+/// connection parameter negotiation there is.
+///
+/// A refused request (usually an update still in progress) is asked again
+/// from the timer after LINK_RETRY_TIMEOUT, not on every packet.
+///
+hw_timer_t    m_idle_timer;
+bool          link_fast   = false; /* what we last asked the central for */
+bool          link_retry  = false; /* a request was refused, the timer asks again */
+volatile bool link_active = false; /* packets seen since the last idle check */
 
-void sd_conn_params(ble_conn_params_evt_t* p_evt)
+void link_request(bool fast)
 {
-  if(p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED)
+  ble_gap_conn_params_t params;
+
+  params.min_conn_interval = fast ? MIN_CONN_INTERVAL : IDLE_MIN_CONN_INTERVAL;
+  params.max_conn_interval = fast ? MIN_CONN_INTERVAL : IDLE_MAX_CONN_INTERVAL;
+  params.slave_latency     = fast ? 0 : IDLE_SLAVE_LATENCY;
+  params.conn_sup_timeout  = CONN_SUP_TIMEOUT;
+
+  uint32_t err = sd_ble_gap_conn_param_update(m_conn_handle, &params);
+  if (err == NRF_SUCCESS)
   {
-    _debug_printf("! BLE connection parameters failed, disconnecting");
-    uint32_t error = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
-    check_error(error);
+    link_fast = fast;
+    link_retry = false;
+    if (fast)
+    {
+      hw_timer_start(&m_idle_timer, LINK_IDLE_TIMEOUT, link_idle_timeout, NULL);
+    }
+  }
+  else
+  {
+    check_error(err);
+    link_retry = true;
+    hw_timer_start(&m_idle_timer, LINK_RETRY_TIMEOUT, link_idle_timeout, NULL);
   }
 }
 
-void sd_conn_error(uint32_t e)
+void link_activity()
 {
-  _debug_printf("Connection error!");
-  check_error(e);
+  link_active = true;
+
+  if (!link_fast && !link_retry && m_conn_handle != BLE_CONN_HANDLE_INVALID)
+  {
+    link_request(true);
+  }
+}
+
+/* RTC interrupt: hand the check over to the event loop */
+void link_idle_timeout(void * context)
+{
+  uint32_t err = app_sched_event_put(NULL, 0, link_idle_check);
+  check_error(err);
+}
+
+void link_idle_check(void * data, uint16_t size)
+{
+  if (m_conn_handle == BLE_CONN_HANDLE_INVALID)
+  {
+    return;
+  }
+
+  if (!link_fast)
+  {
+    /* the request for the short interval was refused */
+    link_request(true);
+    return;
+  }
+
+  if (link_active)
+  {
+    /* still busy, look again later. cheaper than restarting per packet */
+    link_active = false;
+    link_retry = false;
+    hw_timer_start(&m_idle_timer, LINK_IDLE_TIMEOUT, link_idle_timeout, NULL);
+    return;
+  }
+
+  _debug_printf("link idle, relaxing interval");
+  link_request(false);
+}
+
+void link_disconnected()
+{
+  hw_timer_stop(&m_idle_timer);
+  link_fast = false;
+  link_retry = false;
+  link_active = false;
 }
 
 void ble_init()
@@ -471,11 +1248,11 @@ void ble_init()
 
   _debug_printf("Initializing Services...");
   
-  /* We're just using the serial service here */
-  ble_nus_init_t nus_init;
-  memset(&nus_init, 0, sizeof(nus_init));
-  nus_init.data_handler = nus_data_handler;
-  err_code = ble_nus_init(&m_nus, &nus_init);
+  /* Our own service: control point + write-without-response data */
+  ble_dfus_init_t dfus_init;
+  memset(&dfus_init, 0, sizeof(dfus_init));
+  dfus_init.data_handler = dfus_data_handler;
+  err_code = ble_dfus_init(&m_dfus, &dfus_init);
   check_error(err_code);
 
   _debug_printf("Initializing Advertising...");
@@ -500,33 +1277,438 @@ void ble_init()
   err_code = ble_advertising_init(&advdata, &scanrsp, &options, on_adv_evt, NULL);
   check_error(err_code);
 
-  _debug_printf("Initializing connection parameters...");
-  ble_conn_params_init_t cp_init;
+}
+
+///
+/// Flash queue callbacks, the host is only answered once the flash is done
+///
+void erase_done(const flash_op_t *op, bool success)
+{
+  if (!success)
+  {
+    const char* test = "! erase failed";
+    tx_send((uint8_t *)test, strlen(test));
+    return;
+  }
+
+  uint8_t *reply = tx_alloc();
+  reply[0] = 'd';
+  reply[1] = op->page;
+  reply[2] = 'O';
+  reply[3] = 'K';
+  reply[4] = op->skipped ? 1 : 0; /* was blank already */
+  uint32_t err = tx_commit(reply, 5);
+  check_error(err);
+}
 
-  memset(&cp_init, 0, sizeof(cp_init));
+void write_done(const flash_op_t *op, bool success)
+{
+  if (!success)
+  {
+    const char* test = "! write failed";
+    tx_send((uint8_t *)test, strlen(test));
+    return;
+  }
 
-  cp_init.p_conn_params                  = NULL;
-  cp_init.first_conn_params_update_delay = FIRST_CONN_PARAMS_UPDATE_DELAY;
-  cp_init.next_conn_params_update_delay  = NEXT_CONN_PARAMS_UPDATE_DELAY;
-  cp_init.max_conn_params_update_count   = MAX_CONN_PARAMS_UPDATE_COUNT;
-  cp_init.start_on_notify_cccd_handle    = BLE_GATT_HANDLE_INVALID;
-  cp_init.disconnect_on_fail             = false;
-  cp_init.evt_handler                    = sd_conn_params;
-  cp_init.error_handler                  = sd_conn_error;
+  uint32_t addr = (uint32_t)op->dst;
 
-  err_code = ble_conn_params_init(&cp_init);
-  check_error(err_code);
+  uint8_t *reply = tx_alloc();
+  reply[0] = 'w';
+  reply[1] = addr / 1024;
+  reply[2] = (addr % 1024) / 16;
+  reply[3] = 'O';
+  reply[4] = 'K';
+  reply[5] = op->skipped; /* 0xFF words not written */
+  uint32_t err = tx_commit(reply, 6);
+  check_error(err);
+}
+
+void page_committed(uint8_t page, bool success, uint16_t skipped)
+{
+  if (!success)
+  {
+    const char* test = "! commit failed";
+    tx_send((uint8_t *)test, strlen(test));
+    return;
+  }
+
+  image_committed(page);
+
+  uint8_t *reply = tx_alloc();
+  reply[0] = 'c';
+  reply[1] = page;
+  reply[2] = 'O';
+  reply[3] = 'K';
+  memcpy(&reply[4], &skipped, 2); /* words not written */
+  uint32_t err = tx_commit(reply, 6);
+  check_error(err);
+}
+
+void image_stored(bool success)
+{
+  if (!success)
+  {
+    const char* test = "! write failed";
+    tx_send((uint8_t *)test, strlen(test));
+    return;
+  }
+
+  uint8_t *reply = tx_alloc();
+  reply[0] = 'f';
+  reply[1] = 'O';
+  reply[2] = 'K';
+  uint32_t err = tx_commit(reply, 3);
+  check_error(err);
+}
+
+///
+/// Cumulative ack: which chunks of a page have made it so far
+///
+void send_ack(uint8_t page)
+{
+  uint64_t received = stage_received(page);
+
+  uint8_t *reply = tx_alloc();
+  reply[0] = 'a';
+  reply[1] = page;
+  for (uint8_t i = 0; i < 8; i++)
+  {
+    reply[2 + i] = (uint8_t)(received >> (8 * i));
+  }
+  uint32_t err = tx_commit(reply, 10);
+  check_error(err);
+}
+
+///
+/// Stream consumer for 'z': unpack into the page staging until either the
+/// input runs out, every page buffer is busy or the TX ring runs low
+///
+uint16_t unpack_consume(const uint8_t *data, uint16_t len)
+{
+  uint16_t used = 0;
+
+  stream_stalled = false;
+
+  while (stream_out < APPLICATION_END && (used < len || !lz_idle(&decoder.unpack)))
+  {
+    uint16_t room;
+    uint8_t *out = stage_span(stream_out, &room);
+
+    if (!out || !reply_room())
+    {
+      /* all pages busy, or no room left to report the next commit */
+      stream_stalled = true;
+      break;
+    }
+
+    uint16_t produced = room;
+    uint16_t taken = lz_decode(&decoder.unpack, data + used, len - used, out, &produced);
+
+    stage_fill(stream_out, produced);
+    stream_out += produced;
+    used += taken;
+
+    if (!taken && !produced)
+    {
+      break;
+    }
+  }
+
+  return used;
+}
+
+///
+/// Stream consumer for 'p': rebuild pages from the old image and the patch
+///
+uint16_t patch_consume(const uint8_t *data, uint16_t len)
+{
+  uint16_t used = 0;
+
+  stream_stalled = false;
+
+  while (stream_out < APPLICATION_END && (used < len || !patch_idle(&decoder.patch)))
+  {
+    uint16_t room;
+    uint8_t *out = stage_span(stream_out, &room);
+
+    if (!out || !reply_room())
+    {
+      /* all pages busy, or no room left to report the next commit */
+      stream_stalled = true;
+      break;
+    }
+
+    uint16_t produced = room;
+    uint16_t taken = patch_decode(&decoder.patch, stream_out, data + used, len - used, out, &produced);
+
+    if (produced && produced == room)
+    {
+      /* the page goes to the flash next, keep what it held */
+      patch_page_done(&decoder.patch, stream_out / 1024);
+    }
+
+    stage_fill(stream_out, produced);
+    stream_out += produced;
+    used += taken;
+
+    if (!taken && !produced)
+    {
+      break;
+    }
+  }
+
+  return used;
+}
+
+///
+/// Push a running stream forward, return credit and finish it when told to
+///
+void stream_poll()
+{
+  if (!stream_active())
+  {
+    return;
+  }
+
+  stream_process();
+
+  if (!reply_room())
+  {
+    return; /* the replies below once TX_COMPLETE makes room */
+  }
+
+  bool error = stream_cmd == 'p' ? decoder.patch.error : decoder.unpack.error;
+
+  if (error || (stream_pending() && stream_out >= APPLICATION_END))
+  {
+    stream_stop();
+    stage_reset(); /* a half page must not hold its slot */
+    const char* test = "! bad stream";
+    tx_send((uint8_t *)test, strlen(test));
+    return;
+  }
+
+  bool drained = stream_finishing && !stream_pending();
+  uint32_t consumed = stream_consumed();
+
+  if (consumed - stream_acked >= STREAM_ACK_STEP || (drained && consumed != stream_acked))
+  {
+    stream_acked = consumed;
+    uint8_t *reply = tx_alloc();
+    reply[0] = stream_cmd - 'a' + 'A';
+    memcpy(&reply[1], &consumed, 4);
+    uint32_t err = tx_commit(reply, 5);
+    check_error(err);
+  }
+
+  if (!drained)
+  {
+    return;
+  }
+
+  if (!(stream_cmd == 'p' ? patch_idle(&decoder.patch) : lz_idle(&decoder.unpack)))
+  {
+    if (stream_stalled)
+    {
+      return; /* a copy or match still to write out, once there is room */
+    }
+
+    stream_stop();
+    stage_reset();
+    const char* test = "! bad stream";
+    tx_send((uint8_t *)test, strlen(test));
+    return;
+  }
+
+  stage_flush(stream_out);
+  stream_stop();
+  stream_finishing = false;
+
+  uint32_t written = stream_out - stream_base;
+  uint8_t *reply = tx_alloc();
+  reply[0] = stream_cmd;
+  reply[1] = 'E';
+  memcpy(&reply[2], &written, 4);
+  uint32_t err = tx_commit(reply, 6);
+  check_error(err);
 }
 
 ///
-/// Callback from uart service
+/// Queue the erases of a 'D' range, a few at a time
 ///
-void nus_data_handler(ble_nus_t * p_nus, uint8_t * p_data, uint16_t length)
+void erase_poll()
+{
+  while (range_next < range_end && flash_room() > ERASE_QUEUE_ROOM && reply_room())
+  {
+    /* the op carries the end of its range, a new 'D' may have replaced it */
+    if (!flash_erase(range_next, range_erase_done, (void *)(uintptr_t)range_end))
+    {
+      return;
+    }
+    erased[range_next / 8] |= 1 << (range_next % 8);
+    range_next++;
+  }
+}
+
+void range_erase_done(const flash_op_t *op, bool success)
 {
+  uint8_t end = (uintptr_t)op->context;
+
+  if (!success)
+  {
+    erased[op->page / 8] &= ~(1 << (op->page % 8));
+    if (end == range_end)
+    {
+      range_next = range_end; /* give up on the rest */
+    }
+
+    const char* test = "! erase failed";
+    tx_send((uint8_t *)test, strlen(test));
+    return;
+  }
+
+  uint8_t *reply = tx_alloc();
+  reply[0] = 'D';
+  reply[1] = op->page;
+  reply[2] = 'O';
+  reply[3] = 'K';
+  reply[4] = op->skipped ? 1 : 0;
+  reply[5] = end - op->page - 1;
+  uint32_t err = tx_commit(reply, 6);
+  check_error(err);
+}
+
+///
+/// Erase a page before the host gets to it, unless it already was or the
+/// host never said it would write it
+///
+void erase_ahead(uint8_t page)
+{
+  if (page < ahead_first || page >= ahead_end || erased[page / 8] & (1 << (page % 8)))
+  {
+    return;
+  }
+
+  /* a full queue just means no head start this time */
+  if (flash_erase(page, ahead_erase_done, NULL))
+  {
+    erased[page / 8] |= 1 << (page % 8);
+  }
+}
+
+void ahead_erase_done(const flash_op_t *op, bool success)
+{
+  if (!success)
+  {
+    erased[op->page / 8] &= ~(1 << (op->page % 8));
+
+    const char* test = "! erase failed";
+    tx_send((uint8_t *)test, strlen(test));
+  }
+}
+
+///
+/// Produce bulk replies while the TX ring has room for them
+///
+void bulk_poll()
+{
+  while (hash_active && reply_room())
+  {
+    uint8_t count = 0;
+    uint8_t *reply = tx_alloc();
+
+    reply[0] = 'h';
+    reply[1] = hash_page;
+
+    while (count < HASHES_PER_REPLY && hash_page + count <= hash_last)
+    {
+      uint32_t crc = crc32(0, FLASH_PTR((hash_page + count) * 1024), 1024);
+      memcpy(&reply[2 + count * 4], &crc, 4);
+      count++;
+    }
+
+    uint32_t err = tx_commit(reply, 2 + count * 4);
+    check_error(err);
+
+    if (hash_page + count > hash_last)
+    {
+      hash_active = false;
+    }
+    hash_page += count;
+  }
+
+  /* hashes first, they are the quicker answer */
+  while (!hash_active && read_addr < read_end && reply_room())
+  {
+    uint8_t *reply = tx_alloc();
+    reply[0] = 'r';
+    reply[1] = read_addr / 1024;
+    reply[2] = (read_addr % 1024) / 16;
+    memcpy(&reply[3], FLASH_PTR(read_addr), 16);
+
+    uint32_t err = tx_commit(reply, 16+3);
+    check_error(err);
+    read_addr += 16;
+  }
+}
+
+///
+/// Callback from dfu service, control point and data alike
+///
+void dfus_data_handler(ble_dfus_t * p_dfus, uint8_t * p_data, uint16_t length)
+{
+  /* a transfer is going on, make sure we are on the fast interval */
+  link_activity();
+
+  if (rx_count || !reply_room())
+  {
+    if (rx_count == RX_HOLD_SIZE || length > BLE_DFUS_MAX_DATA_LEN)
+    {
+      /* more in flight than a host may have (see ble_dfus.h), dropped */
+      _debug_printf("dropping command");
+      return;
+    }
+
+    rx_packet_t *packet = &rx_hold[(rx_head + rx_count++) % RX_HOLD_SIZE];
+    packet->len = length;
+    memcpy(packet->data, p_data, length);
+    return;
+  }
+
   /* pass through to application logic */
   serial_rx(p_data, length);
 }
 
+///
+/// Backpressure: a reply is never dropped for want of room in the TX ring.
+/// Replies that come later are owed already, one per queued flash operation
+/// and per complete page waiting for the queue. Anything that can lead to
+/// more replies (a command, a bulk or stream step, another range erase)
+/// only goes ahead while the ring has room for those plus TX_RESERVE, which
+/// covers the most one such step adds: a windowed 'w' that leaves one page
+/// and completes another sends two 'a', then the commit and a failed erase
+/// ahead follow. Commands wait in rx_hold meanwhile.
+///
+bool reply_room()
+{
+  uint8_t owed = FLASH_QUEUE_SIZE - flash_room() + stage_pending();
+
+  return tx_space() > TX_RESERVE + owed;
+}
+
+/* Run held commands as far as the TX ring allows */
+void rx_poll()
+{
+  while (rx_count && reply_room())
+  {
+    rx_packet_t *packet = &rx_hold[rx_head];
+
+    rx_head = (rx_head + 1) % RX_HOLD_SIZE;
+    rx_count--;
+    serial_rx(packet->data, packet->len);
+  }
+}
+
 ///
 /// Callback from advertising event
 ///
@@ -552,19 +1734,31 @@ void sd_dispatch(ble_evt_t * event)
 {
   uint32_t err_code;
 
-  ble_conn_params_on_ble_evt(event);
-  ble_nus_on_ble_evt(&m_nus, event);
+  ble_dfus_on_ble_evt(&m_dfus, event);
 
   switch (event->header.evt_id)
   {
     case BLE_GAP_EVT_CONNECTED:
       _debug_printf("Connected");
       m_conn_handle = event->evt.gap_evt.conn_handle;
+      tx_connected();
       break;
 
     case BLE_GAP_EVT_DISCONNECTED:
       _debug_printf("Disconnected");
       m_conn_handle = BLE_CONN_HANDLE_INVALID;
+      tx_disconnected();
+      rx_count = 0;
+      link_disconnected();
+      session_flags = 0;
+      ack_pending = 0;
+      hash_active = false;
+      read_addr = read_end;
+      range_next = range_end;
+      ahead_end = 0;
+      memset(erased, 0, sizeof(erased));
+      stream_stop();
+      stage_reset();
       break;
 
     case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
@@ -579,8 +1773,17 @@ void sd_dispatch(ble_evt_t * event)
       check_error(err_code);
       break;
 
+    case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+      _debug_printf("Connection interval now %d",
+          event->evt.gap_evt.params.conn_param_update.conn_params.max_conn_interval);
+      break;
+
     case BLE_EVT_TX_COMPLETE:
-      tx_wait = false;
+      tx_complete(event->evt.common_evt.params.tx_complete.count);
+      rx_poll();
+      bulk_poll();
+      stream_poll();
+      erase_poll();
       break;
 
     default:
@@ -602,6 +1805,8 @@ void ble_on_radio_active_evt(bool radio_active)
 ///
 /// Initialize the soft device.
 ///
+#define SCHED_MAX_EVENT_DATA_SIZE 0  /* softdevice wakeups and timer work carry no data */
+#define SCHED_QUEUE_SIZE          20
 
 void sd_init()
 {
@@ -610,8 +1815,9 @@ void sd_init()
   uint32_t         err_code;
   sd_mbr_command_t com = {SD_MBR_COMMAND_INIT_SD, };
 
-  /* starting the timer, needed for advertising */
-  APP_TIMER_INIT(0, 4, false); 
+  /* first, the softdevice handler queues into it from now on */
+  _debug_printf("Initializing Scheduler...");
+  APP_SCHED_INIT(SCHED_MAX_EVENT_DATA_SIZE, SCHED_QUEUE_SIZE);
 
   _debug_printf("Initializing the softdevice handlers...");
  
@@ -628,7 +1834,11 @@ void sd_init()
   _debug_printf("Setting clock source...");
   
   /* Give it the clock config */
-  SOFTDEVICE_HANDLER_APPSH_INIT(NRF_CLOCK_LFCLKSRC_RC_250_PPM_250MS_CALIBRATION, NULL); /* when the second argument is not NULL, it wants a handler? */
+  /* true: events are pulled in thread context, from the scheduler */
+  SOFTDEVICE_HANDLER_APPSH_INIT(NRF_CLOCK_LFCLKSRC_RC_250_PPM_250MS_CALIBRATION, true);
+
+  /* our clock and timers, on the LF clock the softdevice just started */
+  hw_rtc_start();
 
   // Enable BLE stack 
   ble_enable_params_t ble_enable_params;
@@ -651,15 +1861,20 @@ void sd_init()
   err_code = ble_radio_notification_init(NRF_APP_PRIORITY_LOW, NRF_RADIO_NOTIFICATION_DISTANCE_800US, ble_on_radio_active_evt);
   check_error(err_code);
 
-  _debug_printf("Initializing Scheduler...");
-  APP_SCHED_INIT(MAX(APP_TIMER_SCHED_EVT_SIZE, 0), 20);
-
   _debug_printf("Soft device initialized");
 
 }
 
 void sys_evt_dispatch(uint32_t disp)
 {
+  flash_sys_event(disp);
+
+  /* completed flash work may have made room for a waiting page */
+  stage_process();
+  rx_poll();
+  stream_poll();
+  erase_poll();
+
   pstorage_sys_event_handler(disp);
 }
 
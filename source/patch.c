@@ -0,0 +1,140 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "patch.h"
+#include "flash.h"
+
+void patch_init(patch_t *patch, uint32_t start)
+{
+  memset(patch, 0, sizeof(*patch));
+  patch->scratch_page = -1;
+  patch->first_page = start / PATCH_PAGE_SIZE;
+}
+
+/* Where the old contents of src live now, NULL if they are gone */
+static const uint8_t *patch_source(const patch_t *patch, uint32_t src)
+{
+  if (src < PATCH_OLD_START || src >= PATCH_OLD_END)
+  {
+    return NULL;
+  }
+
+  int16_t page = src / PATCH_PAGE_SIZE;
+
+  if (page == patch->scratch_page)
+  {
+    return &patch->scratch[src % PATCH_PAGE_SIZE];
+  }
+
+  if (page < patch->first_page || page > patch->scratch_page)
+  {
+    /* not touched by the patch, or not overwritten yet */
+    return FLASH_PTR(src);
+  }
+
+  return NULL;
+}
+
+/*
+ * Decode as much as fits. addr is the flash address out stands for, the
+ * rest works as in lz_decode.
+ */
+uint16_t patch_decode(patch_t *patch, uint32_t addr, const uint8_t *in,
+    uint16_t in_len, uint8_t *out, uint16_t *out_len)
+{
+  const uint8_t *in_start = in;
+  const uint8_t *in_end   = in + in_len;
+  uint16_t       room     = *out_len;
+  uint16_t       done     = 0;
+
+  while (!patch->error && done < room)
+  {
+    if (patch->left && patch->literal)
+    {
+      uint16_t n = patch->left;
+
+      n = n < room - done ? n : room - done;
+      n = n < in_end - in ? n : in_end - in;
+      if (!n)
+      {
+        break;
+      }
+
+      memcpy(out + done, in, n);
+      in += n;
+      done += n;
+      patch->left -= n;
+      continue;
+    }
+
+    if (patch->left)
+    {
+      uint32_t src = addr + done + patch->shift;
+      const uint8_t *from = patch_source(patch, src);
+      uint16_t n = patch->left;
+
+      if (!from)
+      {
+        patch->error = true;
+        break;
+      }
+
+      /* one source page at a time, the next one may live elsewhere */
+      n = n < room - done ? n : room - done;
+      n = n < PATCH_PAGE_SIZE - src % PATCH_PAGE_SIZE ? n : PATCH_PAGE_SIZE - src % PATCH_PAGE_SIZE;
+
+      memcpy(out + done, from, n);
+      done += n;
+      patch->left -= n;
+      continue;
+    }
+
+    if (in == in_end)
+    {
+      break;
+    }
+
+    patch->head[patch->head_len++] = *in++;
+
+    if (!(patch->head[0] & 0x80))
+    {
+      patch->literal = true;
+      patch->left = (patch->head[0] & 0x7F) + 1;
+      patch->head_len = 0;
+    }
+    else if (patch->head_len == ((patch->head[0] & 0x40) ? 4 : 2))
+    {
+      patch->literal = false;
+      patch->left = (((patch->head[0] & 0x3F) << 8) | patch->head[1]) + 1;
+      if (patch->head[0] & 0x40)
+      {
+        patch->shift += (int16_t)(patch->head[2] | (patch->head[3] << 8));
+      }
+      patch->head_len = 0;
+    }
+  }
+
+  *out_len = done;
+  return in - in_start;
+}
+
+/*
+ * The output page is complete and about to be overwritten: keep its old
+ * contents, the next page may still copy from them.
+ */
+void patch_page_done(patch_t *patch, uint8_t page)
+{
+  memcpy(patch->scratch, FLASH_PTR(page * PATCH_PAGE_SIZE), PATCH_PAGE_SIZE);
+  patch->scratch_page = page;
+}
+
+/* True when the patch could end here */
+bool patch_idle(const patch_t *patch)
+{
+  return !patch->left && !patch->head_len;
+}
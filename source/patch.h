@@ -0,0 +1,58 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef _patch_h
+#define _patch_h
+
+/*
+ * Streaming patch decoder
+ *
+ * A patch rebuilds the new image front to back out of the image already in
+ * the application region. It is a sequence of ops:
+ *
+ *   0LLLLLLL                     literal: L+1 bytes (1-128) follow as is
+ *   10LLLLLL LLLLLLLL            copy L+1 bytes (1-16384) of the old image
+ *   11LLLLLL LLLLLLLL DDDDDDDD DDDDDDDD
+ *                                move the source by D (int16, little endian)
+ *                                bytes, then copy as above
+ *
+ * The source starts at the first output address and moves along with the
+ * output, literals included, so an op only has to say where things shifted.
+ *
+ * Pages are rebuilt and overwritten in order. Before a page goes to the
+ * flash its old contents are kept in a scratch page, so the source may
+ * point into the page being built, the one before it (from the scratch) and
+ * anything behind it, plus whatever lies before the first page of the patch.
+ * Anything else has already been overwritten and is an error.
+ */
+
+#define PATCH_PAGE_SIZE  1024
+#define PATCH_OLD_START  0x00018000 /* application region, the old image */
+#define PATCH_OLD_END    0x0003C000
+
+typedef struct
+{
+  uint8_t  scratch[PATCH_PAGE_SIZE]; /* old copy of the last finished page */
+  int16_t  scratch_page;             /* -1 while there is none */
+  uint8_t  first_page;
+  int32_t  shift;      /* source minus output address */
+  uint16_t left;       /* bytes left of the current op */
+  bool     literal;    /* the current op is a literal */
+  uint8_t  head[4];    /* op header being collected */
+  uint8_t  head_len;
+  bool     error;
+} patch_t;
+
+void patch_init(patch_t *patch, uint32_t start);
+uint16_t patch_decode(patch_t *patch, uint32_t addr, const uint8_t *in,
+    uint16_t in_len, uint8_t *out, uint16_t *out_len);
+void patch_page_done(patch_t *patch, uint8_t page);
+bool patch_idle(const patch_t *patch);
+
+#endif
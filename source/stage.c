@@ -0,0 +1,305 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "stage.h"
+#include "debug.h"
+#include "flash.h"
+
+/*
+ * Page staging
+ *
+ * Chunks of a page are collected in RAM until all STAGE_CHUNKS of them have
+ * arrived, then the whole page goes out with a single flash write. The
+ * softdevice reads the source buffer asynchronously, so a slot stays locked
+ * until the flash queue reports the write done.
+ */
+
+typedef enum
+{
+  SLOT_FREE,
+  SLOT_FILLING,  /* collecting chunks */
+  SLOT_PENDING,  /* complete, waiting for room in the flash queue */
+  SLOT_WRITING,  /* queued for flash */
+} slot_state_t;
+
+typedef struct
+{
+  uint32_t     data[STAGE_PAGE_WORDS];
+  uint64_t     received; /* one bit per chunk */
+  uint8_t      page;
+  slot_state_t state;
+} stage_slot_t;
+
+static stage_slot_t   slots[STAGE_SLOTS];
+static stage_commit_t commit_handler = NULL;
+static uint8_t        committed[256 / 8]; /* pages written since the last reset */
+static bool           erase_first = false; /* pages are overwritten in place */
+
+static stage_slot_t *find_slot(uint8_t page)
+{
+  for (uint8_t i = 0; i < STAGE_SLOTS; i++)
+  {
+    if (slots[i].state == SLOT_FILLING && slots[i].page == page)
+    {
+      return &slots[i];
+    }
+  }
+  return NULL;
+}
+
+static stage_slot_t *claim_slot(uint8_t page)
+{
+  for (uint8_t i = 0; i < STAGE_SLOTS; i++)
+  {
+    if (slots[i].state == SLOT_FREE)
+    {
+      slots[i].state = SLOT_FILLING;
+      slots[i].page = page;
+      slots[i].received = 0;
+      return &slots[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Packet payloads sit at odd offsets. Assemble whole words from the bytes
+ * and store those: one store per word instead of four byte stores on the M0.
+ */
+static void copy_words(uint32_t *dst, const uint8_t *src, uint16_t words)
+{
+  while (words--)
+  {
+    *dst++ = src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+    src += 4;
+  }
+}
+
+static void stage_write_done(const flash_op_t *op, bool success)
+{
+  stage_slot_t *slot = (stage_slot_t *)op->context;
+
+  slot->state = SLOT_FREE;
+
+  if (success)
+  {
+    committed[slot->page / 8] |= 1 << (slot->page % 8);
+  }
+
+  if (commit_handler)
+  {
+    commit_handler(slot->page, success, op->skipped);
+  }
+}
+
+static void stage_erase_done(const flash_op_t *op, bool success)
+{
+  stage_slot_t *slot = (stage_slot_t *)op->context;
+
+  /* the erase just left the queue, so there is room for the write */
+  if (!success || !flash_write((uint32_t *)(slot->page * STAGE_PAGE_SIZE), slot->data,
+        STAGE_PAGE_WORDS, stage_write_done, slot))
+  {
+    flash_op_t failed = *op;
+
+    stage_write_done(&failed, false);
+  }
+}
+
+/* Hand every complete page to the flash queue */
+void stage_process(void)
+{
+  for (uint8_t i = 0; i < STAGE_SLOTS; i++)
+  {
+    if (slots[i].state != SLOT_PENDING)
+    {
+      continue;
+    }
+
+    uint32_t *dst = (uint32_t *)(slots[i].page * STAGE_PAGE_SIZE);
+
+    if (!memcmp(FLASH_PTR(dst), slots[i].data, STAGE_PAGE_SIZE))
+    {
+      /* already there, spare the flash the erase and write */
+      flash_op_t same = { .type = FLASH_OP_WRITE, .dst = dst, .context = &slots[i],
+                          .skipped = STAGE_PAGE_WORDS };
+
+      stage_write_done(&same, true);
+      continue;
+    }
+
+    /* set first, a refused write completes before flash_write returns */
+    slots[i].state = SLOT_WRITING;
+
+    if (!(erase_first ?
+          flash_erase(slots[i].page, stage_erase_done, &slots[i]) :
+          flash_write(dst, slots[i].data, STAGE_PAGE_WORDS, stage_write_done, &slots[i])))
+    {
+      /* queue full, stays pending until something completes */
+      slots[i].state = SLOT_PENDING;
+      return;
+    }
+  }
+}
+
+void stage_init(stage_commit_t handler)
+{
+  commit_handler = handler;
+}
+
+/* Erase each page right before its write, for sources that overwrite in place */
+void stage_set_erase(bool erase)
+{
+  erase_first = erase;
+}
+
+void stage_reset(void)
+{
+  /* slots already handed over must stay put until the softdevice is done */
+  for (uint8_t i = 0; i < STAGE_SLOTS; i++)
+  {
+    if (slots[i].state == SLOT_FILLING)
+    {
+      slots[i].state = SLOT_FREE;
+    }
+  }
+
+  memset(committed, 0, sizeof(committed));
+  erase_first = false;
+}
+
+stage_result_t stage_write(uint8_t page, uint8_t chunk, const uint8_t *data)
+{
+  stage_slot_t *slot = find_slot(page);
+
+  if (!slot)
+  {
+    slot = claim_slot(page);
+  }
+
+  if (!slot)
+  {
+    return STAGE_BUSY;
+  }
+
+  /* a repeated chunk simply overwrites the earlier copy */
+  copy_words(&slot->data[chunk * STAGE_CHUNK_SIZE / 4], data, STAGE_CHUNK_SIZE / 4);
+  slot->received |= 1ULL << chunk;
+
+  if (slot->received != UINT64_MAX)
+  {
+    return STAGE_OK;
+  }
+
+  slot->state = SLOT_PENDING;
+  stage_process();
+  return STAGE_COMMIT;
+}
+
+/*
+ * Sequential writers (the stream decoders) fill pages in place rather than
+ * chunk by chunk: stage_span gives the buffer behind addr and how much of the
+ * page is left, stage_fill reports how much of it was written.
+ */
+uint8_t *stage_span(uint32_t addr, uint16_t *room)
+{
+  uint8_t page = addr / STAGE_PAGE_SIZE;
+  uint16_t offset = addr % STAGE_PAGE_SIZE;
+  stage_slot_t *slot = find_slot(page);
+
+  if (!slot)
+  {
+    slot = claim_slot(page);
+  }
+
+  if (!slot)
+  {
+    *room = 0;
+    return NULL;
+  }
+
+  *room = STAGE_PAGE_SIZE - offset;
+  return (uint8_t *)slot->data + offset;
+}
+
+void stage_fill(uint32_t addr, uint16_t len)
+{
+  uint16_t offset = addr % STAGE_PAGE_SIZE;
+  stage_slot_t *slot = find_slot(addr / STAGE_PAGE_SIZE);
+
+  if (!slot)
+  {
+    return;
+  }
+
+  /* a chunk counts once its last byte is in */
+  for (uint8_t chunk = offset / STAGE_CHUNK_SIZE; chunk < (offset + len) / STAGE_CHUNK_SIZE; chunk++)
+  {
+    slot->received |= 1ULL << chunk;
+  }
+
+  if (slot->received == UINT64_MAX)
+  {
+    slot->state = SLOT_PENDING;
+    stage_process();
+  }
+}
+
+/* End of a sequential write: pad the last page with erased bytes, commit it */
+void stage_flush(uint32_t addr)
+{
+  uint16_t offset = addr % STAGE_PAGE_SIZE;
+  stage_slot_t *slot = find_slot(addr / STAGE_PAGE_SIZE);
+
+  if (!offset || !slot)
+  {
+    return;
+  }
+
+  memset((uint8_t *)slot->data + offset, 0xFF, STAGE_PAGE_SIZE - offset);
+  stage_fill(addr, STAGE_PAGE_SIZE - offset);
+}
+
+/* Complete pages still waiting for room in the flash queue */
+uint8_t stage_pending(void)
+{
+  uint8_t pending = 0;
+
+  for (uint8_t i = 0; i < STAGE_SLOTS; i++)
+  {
+    if (slots[i].state == SLOT_PENDING)
+    {
+      pending++;
+    }
+  }
+  return pending;
+}
+
+uint64_t stage_received(uint8_t page)
+{
+  for (uint8_t i = 0; i < STAGE_SLOTS; i++)
+  {
+    if (slots[i].state != SLOT_FREE && slots[i].page == page)
+    {
+      /* complete pages waiting for flash report everything received */
+      return slots[i].received;
+    }
+  }
+
+  if (committed[page / 8] & (1 << (page % 8)))
+  {
+    return UINT64_MAX;
+  }
+  return 0;
+}
+
+/* RAM the slots take, for the benchmark */
+uint16_t stage_ram(void)
+{
+  return sizeof(slots);
+}
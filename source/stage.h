@@ -0,0 +1,41 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef _stage_h
+#define _stage_h
+
+#define STAGE_PAGE_SIZE   1024 /* one nRF51 flash page */
+#define STAGE_PAGE_WORDS  (STAGE_PAGE_SIZE / 4)
+#define STAGE_CHUNK_SIZE  16   /* payload of a single 'w' packet */
+#define STAGE_CHUNKS      (STAGE_PAGE_SIZE / STAGE_CHUNK_SIZE)
+#define STAGE_SLOTS       2    /* pages that can be held in RAM at once */
+
+typedef enum
+{
+  STAGE_OK,      /* chunk stored, page not complete yet */
+  STAGE_COMMIT,  /* chunk stored, page complete and handed to the flash */
+  STAGE_BUSY,    /* no slot free for this page, try again later */
+} stage_result_t;
+
+/* skipped: words the flash was spared (0xFF, or the page was already right) */
+typedef void (*stage_commit_t)(uint8_t page, bool success, uint16_t skipped);
+
+void stage_init(stage_commit_t handler);
+void stage_reset(void);
+void stage_set_erase(bool erase);
+stage_result_t stage_write(uint8_t page, uint8_t chunk, const uint8_t *data);
+uint8_t *stage_span(uint32_t addr, uint16_t *room);
+void stage_fill(uint32_t addr, uint16_t len);
+void stage_flush(uint32_t addr);
+uint64_t stage_received(uint8_t page);
+uint8_t stage_pending(void);
+void stage_process(void);
+uint16_t stage_ram(void);
+
+#endif
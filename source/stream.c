@@ -0,0 +1,108 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "stream.h"
+
+/*
+ * Byte stream input
+ *
+ * Packets of a stream are appended to a FIFO and handed to the consumer,
+ * which may take less than offered when the page buffers are all busy. The
+ * rest stays here until stream_process is called again. The host keeps at
+ * most STREAM_FIFO_SIZE bytes beyond the last consumed count it was told
+ * about, so the FIFO can never overflow if it plays by the rules.
+ */
+
+static uint8_t           fifo[STREAM_FIFO_SIZE];
+static uint16_t          fifo_head  = 0;
+static uint16_t          fifo_count = 0;
+static uint32_t          consumed   = 0;
+static stream_consumer_t consumer   = NULL;
+
+void stream_start(stream_consumer_t handler)
+{
+  consumer = handler;
+  fifo_head = 0;
+  fifo_count = 0;
+  consumed = 0;
+}
+
+void stream_stop(void)
+{
+  consumer = NULL;
+  fifo_count = 0;
+}
+
+bool stream_active(void)
+{
+  return consumer != NULL;
+}
+
+bool stream_push(const uint8_t *data, uint16_t len)
+{
+  if (!consumer || fifo_count + len > STREAM_FIFO_SIZE)
+  {
+    return false;
+  }
+
+  uint16_t tail = (fifo_head + fifo_count) % STREAM_FIFO_SIZE;
+  uint16_t first = STREAM_FIFO_SIZE - tail;
+
+  if (first > len)
+  {
+    first = len;
+  }
+
+  memcpy(&fifo[tail], data, first);
+  memcpy(&fifo[0], data + first, len - first);
+  fifo_count += len;
+  return true;
+}
+
+void stream_process(void)
+{
+  if (consumer && !fifo_count)
+  {
+    /* no input, but a long copy or match may still have output to give */
+    consumer(&fifo[fifo_head], 0);
+    return;
+  }
+
+  while (consumer && fifo_count)
+  {
+    /* hand over the contiguous part, the wrapped part goes next round */
+    uint16_t len = STREAM_FIFO_SIZE - fifo_head;
+
+    if (len > fifo_count)
+    {
+      len = fifo_count;
+    }
+
+    uint16_t used = consumer(&fifo[fifo_head], len);
+
+    fifo_head = (fifo_head + used) % STREAM_FIFO_SIZE;
+    fifo_count -= used;
+    consumed += used;
+
+    if (used < len)
+    {
+      /* consumer is stuck, try again once something changed */
+      return;
+    }
+  }
+}
+
+uint16_t stream_pending(void)
+{
+  return fifo_count;
+}
+
+uint32_t stream_consumed(void)
+{
+  return consumed;
+}
@@ -0,0 +1,27 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef _stream_h
+#define _stream_h
+
+#define STREAM_FIFO_SIZE 256 /* bytes the host may have in flight */
+#define STREAM_ACK_STEP  64  /* credit is returned in steps of this */
+
+/* Consumes what it can of data, returns how much it used */
+typedef uint16_t (*stream_consumer_t)(const uint8_t *data, uint16_t len);
+
+void stream_start(stream_consumer_t consumer);
+void stream_stop(void);
+bool stream_active(void);
+bool stream_push(const uint8_t *data, uint16_t len);
+void stream_process(void);
+uint16_t stream_pending(void);
+uint32_t stream_consumed(void);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stddef.h>
+#include "timers.h"
+
+/*
+ * Pending hw_timer_t's, soonest first
+ *
+ * Due times are RTC ticks on a 32 bit clock that may wrap, so they are
+ * only ever compared by their difference. The list knows nothing of the
+ * RTC: hw.c (and the simulator's stand-in) points its compare at what
+ * timers_next picks and calls timers_fire from the interrupt.
+ */
+
+/* Round up, a timer must never fire early */
+uint32_t timers_ticks(uint32_t ms)
+{
+  return (uint32_t)(((uint64_t)ms * RTC_TICK_HZ + 999) / 1000);
+}
+
+bool timers_due(uint32_t due, uint32_t now)
+{
+  return (int32_t)(due - now) <= 0;
+}
+
+/* Behind everything due at the same time or earlier */
+void timers_insert(hw_timer_t **list, hw_timer_t *timer)
+{
+  hw_timer_t **link = list;
+
+  while (*link && !((int32_t)(timer->due - (*link)->due) < 0))
+  {
+    link = &(*link)->next;
+  }
+  timer->next = *link;
+  *link = timer;
+}
+
+void timers_remove(hw_timer_t **list, hw_timer_t *timer)
+{
+  for (hw_timer_t **link = list; *link; link = &(*link)->next)
+  {
+    if (*link == timer)
+    {
+      *link = timer->next;
+      break;
+    }
+  }
+  timer->next = NULL;
+}
+
+/* Run every timer due by now, in order. A callback may start timers again */
+void timers_expire(hw_timer_t **list, uint32_t now)
+{
+  while (*list && timers_due((*list)->due, now))
+  {
+    hw_timer_t *timer = *list;
+
+    *list = timer->next;
+    timer->next = NULL;
+    timer->fn(timer->context);
+  }
+}
+
+void timers_wakeup(timers_clock_t *clock, uint32_t now, uint32_t ms)
+{
+  clock->wakeup_fired = false;
+  clock->wakeup_due = now + timers_ticks(ms);
+  clock->wakeup_armed = true;
+}
+
+/* Whatever comes first, wakeup or timer. False if nothing is pending */
+bool timers_next(const timers_clock_t *clock, uint32_t *due)
+{
+  bool armed = false;
+
+  if (clock->wakeup_armed)
+  {
+    armed = true;
+    *due = clock->wakeup_due;
+  }
+
+  if (clock->list && (!armed || (int32_t)(clock->list->due - *due) < 0))
+  {
+    armed = true;
+    *due = clock->list->due;
+  }
+
+  return armed;
+}
+
+/* The compare went off: sort out which of the two it was for */
+void timers_fire(timers_clock_t *clock, uint32_t now)
+{
+  if (clock->wakeup_armed && timers_due(clock->wakeup_due, now))
+  {
+    clock->wakeup_armed = false;
+    clock->wakeup_fired = true;
+  }
+
+  timers_expire(&clock->list, now);
+}
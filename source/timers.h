@@ -0,0 +1,32 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hw.h"
+#ifndef _timers_h
+#define _timers_h
+
+/* RTC1's one compare, shared by hw_rtc_wakeup and the timer list */
+typedef struct
+{
+  hw_timer_t   *list;         /* pending, soonest first */
+  bool          wakeup_armed;
+  volatile bool wakeup_fired;
+  uint32_t      wakeup_due;
+} timers_clock_t;
+
+uint32_t timers_ticks(uint32_t ms);
+bool timers_due(uint32_t due, uint32_t now);
+void timers_wakeup(timers_clock_t *clock, uint32_t now, uint32_t ms);
+bool timers_next(const timers_clock_t *clock, uint32_t *due);
+void timers_fire(timers_clock_t *clock, uint32_t now);
+void timers_insert(hw_timer_t **list, hw_timer_t *timer);
+void timers_remove(hw_timer_t **list, hw_timer_t *timer);
+void timers_expire(hw_timer_t **list, uint32_t now);
+
+#endif
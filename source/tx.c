@@ -0,0 +1,155 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "tx.h"
+#include "debug.h"
+
+/*
+ * Outbound notification ring
+ *
+ * The softdevice only has a handful of TX buffers per connection. Replies are
+ * queued here and handed over while buffers are free; once it says
+ * BLE_ERROR_NO_TX_BUFFERS the rest waits for BLE_EVT_TX_COMPLETE. That way
+ * every buffer is used in each connection event and nothing gets dropped
+ * because the previous reply has not gone out yet.
+ */
+
+typedef struct
+{
+  uint8_t len;
+  uint8_t data[BLE_DFUS_MAX_DATA_LEN];
+} tx_packet_t;
+
+static tx_packet_t  ring[TX_RING_SIZE];
+static uint8_t      ring_head  = 0;
+static uint8_t      ring_count = 0;
+static uint8_t      tx_free    = 0; /* softdevice buffers we may still use */
+static ble_dfus_t  *dfus       = NULL;
+
+void tx_init(ble_dfus_t *p_dfus)
+{
+  dfus = p_dfus;
+}
+
+void tx_connected(void)
+{
+  uint32_t err = sd_ble_tx_buffer_count_get(&tx_free);
+  if (err != NRF_SUCCESS)
+  {
+    /* we will find out the hard way */
+    tx_free = 1;
+  }
+
+  _debug_printf("%d tx buffers", tx_free);
+}
+
+void tx_disconnected(void)
+{
+  ring_head = 0;
+  ring_count = 0;
+  tx_free = 0;
+}
+
+void tx_complete(uint8_t count)
+{
+  tx_free += count;
+  tx_pump();
+}
+
+void tx_pump(void)
+{
+  while (ring_count && tx_free)
+  {
+    tx_packet_t *packet = &ring[ring_head];
+    uint32_t err = ble_dfus_string_send(dfus, packet->data, packet->len);
+
+    if (err == BLE_ERROR_NO_TX_BUFFERS)
+    {
+      /* our count was off, wait for the next TX_COMPLETE */
+      tx_free = 0;
+      return;
+    }
+
+    if (err == NRF_SUCCESS)
+    {
+      tx_free--;
+    }
+    else
+    {
+      /* not connected or notifications off, nobody to tell */
+      _debug_printf("dropping reply (%d)", err);
+    }
+
+    ring_head = (ring_head + 1) % TX_RING_SIZE;
+    ring_count--;
+  }
+}
+
+/*
+ * Build a reply in place: tx_alloc hands out the next ring entry, tx_commit
+ * queues it. Nothing else may be sent in between. With the ring full the
+ * buffer is a scratch one and tx_commit drops it, as tx_send would; the
+ * backpressure in main.c (reply_room) keeps that from happening.
+ */
+uint8_t *tx_alloc(void)
+{
+  static uint8_t scratch[BLE_DFUS_MAX_DATA_LEN];
+
+  if (ring_count == TX_RING_SIZE)
+  {
+    return scratch;
+  }
+  return ring[(ring_head + ring_count) % TX_RING_SIZE].data;
+}
+
+uint32_t tx_commit(uint8_t *data, uint16_t len)
+{
+  if (len > BLE_DFUS_MAX_DATA_LEN)
+  {
+    return NRF_ERROR_INVALID_PARAM;
+  }
+
+  if (ring_count == TX_RING_SIZE ||
+      data != ring[(ring_head + ring_count) % TX_RING_SIZE].data)
+  {
+    return NRF_ERROR_NO_MEM;
+  }
+
+  ring[(ring_head + ring_count) % TX_RING_SIZE].len = len;
+  ring_count++;
+
+  tx_pump();
+  return NRF_SUCCESS;
+}
+
+/* Room left in the ring, for replies that come in bulk */
+uint8_t tx_space(void)
+{
+  return TX_RING_SIZE - ring_count;
+}
+
+uint32_t tx_send(uint8_t *data, uint16_t len)
+{
+  if (len > BLE_DFUS_MAX_DATA_LEN)
+  {
+    return NRF_ERROR_INVALID_PARAM;
+  }
+
+  if (ring_count == TX_RING_SIZE)
+  {
+    return NRF_ERROR_NO_MEM;
+  }
+
+  tx_packet_t *packet = &ring[(ring_head + ring_count) % TX_RING_SIZE];
+  memcpy(packet->data, data, len);
+  packet->len = len;
+  ring_count++;
+
+  tx_pump();
+  return NRF_SUCCESS;
+}
@@ -0,0 +1,27 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble_dfus.h"
+#ifndef _tx_h
+#define _tx_h
+
+#define TX_RING_SIZE    16 /* notifications that can wait for a softdevice buffer */
+#define TX_RESERVE      3  /* kept free beyond the replies already owed, see reply_room */
+
+void tx_init(ble_dfus_t *p_dfus);
+void tx_connected(void);
+void tx_disconnected(void);
+void tx_complete(uint8_t count);
+uint32_t tx_send(uint8_t *data, uint16_t len);
+uint8_t *tx_alloc(void);
+uint32_t tx_commit(uint8_t *data, uint16_t len);
+void tx_pump(void);
+uint8_t tx_space(void);
+
+#endif